@@ -0,0 +1,2395 @@
+/*
+ * GStreamer DVB Media Sink
+ * Copyright 2006 Felix Domke <tmbinc@elitedvb.net>
+ * based on code by:
+ * Copyright 2005 Thomas Vander Stichele <thomas@apestaart.org>
+ * Copyright 2005 Ronald S. Bultje <rbultje@ronald.bitfreak.net>
+ * 
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ *
+ * Alternatively, the contents of this file may be used under the
+ * GNU Lesser General Public License Version 2.1 (the "LGPL"), in
+ * which case the following provisions apply instead of the ones
+ * mentioned above:
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU Library General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/prctl.h>
+#include <sys/ioctl.h>
+#include <linux/dvb/dmx.h>
+
+#include <gst/base/gstbasesink.h>
+
+#include "common.h"
+
+GST_DEBUG_CATEGORY (dvbsink_common_debug);
+#define GST_CAT_DEFAULT dvbsink_common_debug
+
+gint write_state_set(volatile gint *state, gint bits)
+{
+	gint old;
+	do
+		old = g_atomic_int_get(state);
+	while (!g_atomic_int_compare_and_exchange(state, old, old | bits));
+	return old;
+}
+
+gint write_state_clear(volatile gint *state, gint bits)
+{
+	gint old;
+	do
+		old = g_atomic_int_get(state);
+	while (!g_atomic_int_compare_and_exchange(state, old, old & ~bits));
+	return old;
+}
+
+void queue_init(queue_t *queue)
+{
+	queue->data = NULL;
+	queue->size = 0;
+	queue->read = 0;
+	queue->copied = 0;
+	queue->chunks = NULL;
+	queue->chunks_size = 0;
+	queue->chunks_first = 0;
+	queue->chunks_count = 0;
+	queue->bytes = 0;
+	queue->filled = 0;
+	queue->first_time = GST_CLOCK_TIME_NONE;
+	queue->last_time = GST_CLOCK_TIME_NONE;
+	queue->max_bytes = 0;
+	queue->max_time = 0;
+	queue->low_percent = QUEUE_DEFAULT_LOW_PERCENT;
+	queue->leaky = FALSE;
+	queue->above_high = FALSE;
+	queue->dropped = 0;
+}
+
+/* (re)allocate the byte ring.. the copied data is kept, the ring is never
+ * shrunk below the number of copied bytes */
+static void queue_resize(queue_t *queue, size_t size)
+{
+	guint8 *data;
+	size_t first;
+
+	if (size < queue->copied)
+		size = queue->copied;
+
+	data = g_malloc(size);
+	first = MIN(queue->copied, queue->size - queue->read);
+	if (first)
+		memcpy(data, queue->data + queue->read, first);
+	if (queue->copied > first)
+		memcpy(data + first, queue->data, queue->copied - first);
+	g_free(queue->data);
+
+	queue->data = data;
+	queue->size = size;
+	queue->read = 0;
+}
+
+static void queue_resize_chunks(queue_t *queue, guint size)
+{
+	queue_chunk_t *chunks = g_new(queue_chunk_t, size);
+	guint first = MIN(queue->chunks_count, queue->chunks_size - queue->chunks_first);
+
+	if (first)
+		memcpy(chunks, queue->chunks + queue->chunks_first, first * sizeof(queue_chunk_t));
+	if (queue->chunks_count > first)
+		memcpy(chunks + first, queue->chunks, (queue->chunks_count - first) * sizeof(queue_chunk_t));
+	g_free(queue->chunks);
+
+	queue->chunks = chunks;
+	queue->chunks_size = size;
+	queue->chunks_first = 0;
+}
+
+static queue_chunk_t *queue_chunk(queue_t *queue, guint idx)
+{
+	idx += queue->chunks_first;
+	if (idx >= queue->chunks_size)
+		idx -= queue->chunks_size;
+	return queue->chunks + idx;
+}
+
+/* returns a new descriptor at the tail of the chunk ring */
+static queue_chunk_t *queue_new_chunk(queue_t *queue)
+{
+	if (queue->chunks_count == queue->chunks_size)
+		queue_resize_chunks(queue, queue->chunks_size ? queue->chunks_size * 2 : QUEUE_DEFAULT_CHUNKS);
+	return queue_chunk(queue, queue->chunks_count++);
+}
+
+static queue_chunk_t *queue_last_chunk(queue_t *queue)
+{
+	return queue->chunks_count ? queue_chunk(queue, queue->chunks_count - 1) : NULL;
+}
+
+void queue_alloc(queue_t *queue, size_t size)
+{
+	if (!size)
+		size = QUEUE_DEFAULT_SIZE;
+	if (queue->size != size)
+		queue_resize(queue, size);
+	if (!queue->chunks_size)
+		queue_resize_chunks(queue, QUEUE_DEFAULT_CHUNKS);
+}
+
+void queue_free(queue_t *queue)
+{
+	queue_clear(queue);
+	g_free(queue->data);
+	g_free(queue->chunks);
+	/* the watermark settings are kept */
+	queue->data = NULL;
+	queue->size = 0;
+	queue->chunks = NULL;
+	queue->chunks_size = 0;
+}
+
+void queue_clear(queue_t *queue)
+{
+	while (queue->chunks_count) {
+		queue_chunk_t *chunk = queue_chunk(queue, 0);
+		if (chunk->buffer)
+			gst_buffer_unref(chunk->buffer);
+		queue->chunks_first = (queue->chunks_first + 1) % queue->chunks_size;
+		--queue->chunks_count;
+	}
+	queue->chunks_first = 0;
+	queue->read = 0;
+	queue->copied = 0;
+	queue->bytes = 0;
+	g_atomic_int_set(&queue->filled, 0);
+	queue->first_time = GST_CLOCK_TIME_NONE;
+	queue->last_time = GST_CLOCK_TIME_NONE;
+}
+
+/* copy data into the byte ring */
+void queue_push(queue_t *queue, const guint8 *data, size_t len)
+{
+	queue_chunk_t *chunk;
+	size_t write, first;
+
+	if (!len)
+		return;
+
+	if (queue->copied + len > queue->size) {
+		size_t size = queue->size ? queue->size : QUEUE_DEFAULT_SIZE;
+		while (size < queue->copied + len)
+			size *= 2;
+		queue_resize(queue, size);
+	}
+
+	write = queue->read + queue->copied;
+	if (write >= queue->size)
+		write -= queue->size;
+
+	first = MIN(len, queue->size - write);
+	memcpy(queue->data + write, data, first);
+	if (len > first)
+		memcpy(queue->data, data + first, len - first);
+
+	/* consecutive copies are contiguous in the byte ring, share the descriptor */
+	chunk = queue_last_chunk(queue);
+	if (!chunk || chunk->buffer) {
+		chunk = queue_new_chunk(queue);
+		chunk->buffer = NULL;
+		chunk->data = NULL;
+		chunk->len = 0;
+	}
+	chunk->len += len;
+
+	queue->copied += len;
+	queue->bytes += len;
+	g_atomic_int_set(&queue->filled, 1);
+}
+
+/* queue len bytes at data, which must be part of buffer, by reference */
+void queue_push_buffer(queue_t *queue, GstBuffer *buffer, const guint8 *data, size_t len)
+{
+	queue_chunk_t *chunk;
+
+	if (!len)
+		return;
+
+	chunk = queue_last_chunk(queue);
+	if (chunk && chunk->buffer == buffer && chunk->data + chunk->len == data)
+		chunk->len += len;
+	else {
+		chunk = queue_new_chunk(queue);
+		chunk->buffer = gst_buffer_ref(buffer);
+		chunk->data = data;
+		chunk->len = len;
+	}
+
+	queue->bytes += len;
+	g_atomic_int_set(&queue->filled, 1);
+}
+
+/* queue an iovec array.. segments which lie inside one of the owner buffers
+ * are queued by reference, all others are copied. Only pass buffers whose
+ * data isn't modified after this call. */
+void queue_pushv(queue_t *queue, const struct iovec *iov, int iovcnt, GstBuffer * const *owners, int nowners)
+{
+	while (iovcnt--) {
+		const guint8 *base = iov->iov_base;
+		GstBuffer *owner = NULL;
+		int i;
+
+		for (i = 0; i < nowners; ++i) {
+			GstBuffer *buffer = owners[i];
+			if (buffer && base >= GST_BUFFER_DATA(buffer) &&
+				base + iov->iov_len <= GST_BUFFER_DATA(buffer) + GST_BUFFER_SIZE(buffer)) {
+				owner = buffer;
+				break;
+			}
+		}
+
+		if (owner)
+			queue_push_buffer(queue, owner, base, iov->iov_len);
+		else
+			queue_push(queue, base, iov->iov_len);
+		++iov;
+	}
+}
+
+void queue_pop(queue_t *queue, size_t len)
+{
+	while (len && queue->chunks_count) {
+		queue_chunk_t *chunk = queue_chunk(queue, 0);
+		size_t n = MIN(len, chunk->len);
+
+		if (chunk->buffer)
+			chunk->data += n;
+		else {
+			queue->read += n;
+			if (queue->read >= queue->size)
+				queue->read -= queue->size;
+			queue->copied -= n;
+		}
+		chunk->len -= n;
+		queue->bytes -= n;
+		len -= n;
+
+		if (!chunk->len) {
+			if (chunk->buffer)
+				gst_buffer_unref(chunk->buffer);
+			queue->chunks_first = (queue->chunks_first + 1) % queue->chunks_size;
+			--queue->chunks_count;
+		}
+	}
+	if (!queue->chunks_count)
+		queue_clear(queue);
+}
+
+/* fill iov with (up to iovmax) contiguous runs from the front of the queue,
+ * referenced data is returned in place. Returns the number of segments. */
+int queue_frontv(queue_t *queue, struct iovec *iov, int iovmax)
+{
+	size_t read = queue->read;
+	int iovcnt = 0;
+	guint i;
+
+	for (i = 0; i < queue->chunks_count && iovcnt < iovmax; ++i) {
+		queue_chunk_t *chunk = queue_chunk(queue, i);
+		if (chunk->buffer)
+			iov_add(iov, &iovcnt, chunk->data, chunk->len);
+		else {
+			/* a copied chunk may wrap around the end of the byte ring */
+			size_t first = MIN(chunk->len, queue->size - read);
+			iov_add(iov, &iovcnt, queue->data + read, first);
+			if (chunk->len > first && iovcnt < iovmax)
+				iov_add(iov, &iovcnt, queue->data, chunk->len - first);
+			read += chunk->len;
+			if (read >= queue->size)
+				read -= queue->size;
+		}
+	}
+	return iovcnt;
+}
+
+/* note the timestamp of data just pushed, for the time level */
+void queue_stamp(queue_t *queue, GstClockTime timestamp)
+{
+	if (!GST_CLOCK_TIME_IS_VALID(timestamp) || !queue->bytes)
+		return;
+	if (!GST_CLOCK_TIME_IS_VALID(queue->first_time))
+		queue->first_time = timestamp;
+	queue->last_time = timestamp;
+}
+
+/* fill level in percent of the high watermark (the larger of the byte and the
+ * time level), 0 without limits. The time level is only reset once the queue
+ * runs empty, it is an upper bound while the queue drains */
+int queue_level(queue_t *queue)
+{
+	guint64 percent = 0;
+
+	if (queue->max_bytes)
+		percent = (guint64)queue->bytes * 100 / queue->max_bytes;
+	if (queue->max_time && GST_CLOCK_TIME_IS_VALID(queue->first_time) &&
+		queue->last_time > queue->first_time)
+		percent = MAX(percent, (queue->last_time - queue->first_time) * 100 / queue->max_time);
+	return MIN(percent, 100);
+}
+
+/* decide what happens to new data for the queue, called with the object
+ * lock held. Only a paused sink blocks, a flushing or unlocked one must not
+ * wait for a state change */
+int queue_admit(queue_t *queue, gint no_write)
+{
+	if (queue_level(queue) < 100)
+		return QUEUE_PUSH;
+	if (queue->leaky) {
+		++queue->dropped;
+		return QUEUE_DROP;
+	}
+	if (no_write & (WRITE_FLUSHING | WRITE_UNLOCKED))
+		return QUEUE_PUSH;
+	return QUEUE_BLOCK;
+}
+
+/* post a "pauseQueueLevel" element message when the queue reached its high
+ * watermark or fell below the low watermark again. Must be called without the
+ * object lock, posting takes it */
+void queue_notify(GstElement *sink, queue_t *queue)
+{
+	GstStructure *s;
+	gboolean was_full;
+	int percent;
+	guint bytes;
+	guint64 time = 0, dropped;
+
+	if (!queue->max_bytes && !queue->max_time)
+		return;
+	/* unlocked precheck, the write loops call this after every queue write */
+	if (queue->above_high ? queue_level(queue) > (int)queue->low_percent : queue_level(queue) < 100)
+		return;
+
+	GST_OBJECT_LOCK(sink);
+	percent = queue_level(queue);
+	was_full = queue->above_high;
+	if (!was_full && percent >= 100)
+		queue->above_high = TRUE;
+	else if (was_full && percent <= (int)queue->low_percent)
+		queue->above_high = FALSE;
+	else {
+		GST_OBJECT_UNLOCK(sink);
+		return;
+	}
+	bytes = queue->bytes;
+	if (GST_CLOCK_TIME_IS_VALID(queue->first_time) && queue->last_time > queue->first_time)
+		time = queue->last_time - queue->first_time;
+	dropped = queue->dropped;
+	GST_OBJECT_UNLOCK(sink);
+
+	GST_DEBUG_OBJECT (sink, "pause queue %s (%d%%, %u bytes, %" G_GUINT64_FORMAT " dropped)",
+		was_full ? "below low watermark" : "at high watermark", percent, bytes, dropped);
+	s = gst_structure_new ("pauseQueueLevel",
+		"percent", G_TYPE_INT, percent,
+		"bytes", G_TYPE_UINT, bytes,
+		"time", G_TYPE_UINT64, time,
+		"full", G_TYPE_BOOLEAN, !was_full,
+		"dropped", G_TYPE_UINT64, dropped, NULL);
+	gst_element_post_message (sink, gst_message_new_element (GST_OBJECT (sink), s));
+}
+
+void iov_add(struct iovec *iov, int *iovcnt, const void *base, size_t len)
+{
+	if (!len)
+		return;
+	iov[*iovcnt].iov_base = (void*)base;
+	iov[*iovcnt].iov_len = len;
+	++*iovcnt;
+}
+
+size_t iov_length(const struct iovec *iov, int iovcnt)
+{
+	size_t len = 0;
+	while (iovcnt--)
+		len += (iov++)->iov_len;
+	return len;
+}
+
+/* drop 'bytes' from the front of the iovec array.. completely written segments
+ * are skipped, a partially written segment is adjusted in place */
+void iov_advance(struct iovec **iov, int *iovcnt, size_t bytes)
+{
+	struct iovec *v = *iov;
+	int cnt = *iovcnt;
+
+	while (cnt && bytes >= v->iov_len) {
+		bytes -= v->iov_len;
+		++v;
+		--cnt;
+	}
+	if (cnt && bytes) {
+		v->iov_base = (guint8*)v->iov_base + bytes;
+		v->iov_len -= bytes;
+	}
+
+	*iov = v;
+	*iovcnt = cnt;
+}
+
+/* header is the complete PES header (9 bytes plus the header data announced
+ * in header[8]), payload the data that follows it */
+void pes_init(pes_t *pes, guint8 *header, size_t header_len, struct iovec *payload, int payloadcnt)
+{
+	pes->header = header;
+	pes->header_len = header_len;
+	memcpy(pes->cont, header, 4);	/* start code and stream id */
+	pes->cont[6] = header[6] & 0xF8;	/* marker bits, scrambling, priority */
+	pes->cont[7] = 0;
+	pes->cont[8] = 0;
+	pes->iov = payload;
+	pes->iovcnt = payloadcnt;
+	pes->count = 0;
+	iov_advance(&pes->iov, &pes->iovcnt, 0); // skip empty segments
+}
+
+/* fill out with the next packet (header and payload segments), the segments
+ * point into the headers and the payload, so each packet has to be written
+ * (or queued) before the next call. Returns the number of segments, 0 when the
+ * payload is done */
+int pes_next(pes_t *pes, struct iovec *out, int outmax)
+{
+	guint8 *header = pes->count ? pes->cont : pes->header;
+	size_t header_len = pes->count ? PES_MIN_HEADER : pes->header_len;
+	size_t max = PES_MAX_LENGTH - (header_len - 6);
+	size_t len = 0, length;
+	int outcnt = 0, i;
+
+	if (pes->count && !pes->iovcnt)
+		return 0;
+
+	iov_add(out, &outcnt, header, header_len);
+	for (i = 0; i < pes->iovcnt && outcnt < outmax && len < max; ++i) {
+		size_t n = MIN(pes->iov[i].iov_len, max - len);
+		iov_add(out, &outcnt, pes->iov[i].iov_base, n);
+		len += n;
+	}
+	iov_advance(&pes->iov, &pes->iovcnt, len);
+
+	length = header_len - 6 + len;
+	header[4] = length >> 8;
+	header[5] = length & 0xFF;
+	++pes->count;
+	return outcnt;
+}
+
+void pes_put_timestamp(guint8 *out, guint8 prefix, guint64 ts)
+{
+	out[0] = prefix | ((ts >> 29) & 0xE);
+	out[1] = ts >> 22;
+	out[2] = 0x01 | ((ts >> 14) & 0xFE);
+	out[3] = ts >> 7;
+	out[4] = 0x01 | ((ts << 1) & 0xFE);
+}
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+#include <arm_neon.h>
+#endif
+
+/* a start code can't begin at pos..pos+2 when data[pos+2] > 1, at pos and
+ * pos+1 when data[pos+1] is set */
+static size_t startcode_scalar(const guint8 *data, size_t len, size_t pos)
+{
+	while (pos + 2 < len) {
+		if (data[pos + 2] > 1)
+			pos += 3;
+		else if (data[pos + 1])
+			pos += 2;
+		else if (data[pos] || data[pos + 2] != 1)
+			++pos;
+		else
+			return pos;
+	}
+	return len;
+}
+
+/* the vector loops skip blocks without a zero byte, nothing starts there.
+ * A block with one is checked by the scalar loop, limited to the two bytes
+ * behind the block a start code at its end needs */
+size_t startcode_find(const guint8 *data, size_t len, size_t pos)
+{
+#if defined(__AVX2__)
+	const __m256i zero = _mm256_setzero_si256();
+	while (pos + 32 + 2 <= len) {
+		__m256i v = _mm256_loadu_si256((const __m256i *)(data + pos));
+		if (_mm256_movemask_epi8(_mm256_cmpeq_epi8(v, zero))) {
+			size_t found = startcode_scalar(data, pos + 32 + 2, pos);
+			if (found < pos + 32)
+				return found;
+		}
+		pos += 32;
+	}
+#elif defined(__SSE2__)
+	const __m128i zero = _mm_setzero_si128();
+	while (pos + 16 + 2 <= len) {
+		__m128i v = _mm_loadu_si128((const __m128i *)(data + pos));
+		if (_mm_movemask_epi8(_mm_cmpeq_epi8(v, zero))) {
+			size_t found = startcode_scalar(data, pos + 16 + 2, pos);
+			if (found < pos + 16)
+				return found;
+		}
+		pos += 16;
+	}
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+	while (pos + 16 + 2 <= len) {
+		uint64x2_t zeros = vreinterpretq_u64_u8(vceqq_u8(vld1q_u8(data + pos), vdupq_n_u8(0)));
+		if (vgetq_lane_u64(zeros, 0) | vgetq_lane_u64(zeros, 1)) {
+			size_t found = startcode_scalar(data, pos + 16 + 2, pos);
+			if (found < pos + 16)
+				return found;
+		}
+		pos += 16;
+	}
+#endif
+	return startcode_scalar(data, len, pos);
+}
+
+#define NS_TO_PTS(ns)	((ns) * 9LL / 100000)	/* ns to 90kHz */
+#define PTS_TO_NS(pts)	((pts) * 100000LL / 9)
+
+/* also used after a flush, the next segment picks the base again */
+void pts_map_init(pts_map_t *map)
+{
+	map->base = 0;
+	map->base_valid = FALSE;
+	map->written = map->read = 0;
+	map->written_valid = map->read_valid = FALSE;
+}
+
+/* the base is kept for non flushing segment updates, to not break the
+ * continuity of the written timestamps */
+void pts_map_segment(pts_map_t *map, GstClockTime start)
+{
+	if (map->base_valid || !GST_CLOCK_TIME_IS_VALID(start))
+		return;
+	map->base = NS_TO_PTS(start) & ~(PTS_WRAP / 2 - 1);
+	map->base_valid = TRUE;
+	GST_DEBUG("pts base %" G_GUINT64_FORMAT " for segment start %" GST_TIME_FORMAT, map->base, GST_TIME_ARGS(start));
+}
+
+/* 33 bit PES timestamp of a buffer timestamp */
+guint64 pts_map_convert(const pts_map_t *map, GstClockTime ts)
+{
+	return (NS_TO_PTS(ts) - map->base) & PTS_MASK;
+}
+
+/* same, and remember it as the reference for unwrapping decoder readings */
+guint64 pts_map_write(pts_map_t *map, GstClockTime ts)
+{
+	map->written = (gint64)(NS_TO_PTS(ts) - map->base);
+	map->written_valid = TRUE;
+	return map->written & PTS_MASK;
+}
+
+/* maps a decoder PTS reading back to buffer time, picking the 33 bit period
+ * closest to the previous reading. 0 is no reading (some drivers return it
+ * while the decoder is starting), the previous one is returned then, or 0
+ * before the first one */
+GstClockTime pts_map_to_time(pts_map_t *map, guint64 pts)
+{
+	gint64 ref, delta, ext;
+
+	if (!pts) {
+		if (!map->read_valid)
+			return 0;
+		ext = map->read;
+	}
+	else {
+		ref = map->read_valid ? map->read : map->written_valid ? map->written : 0;
+		delta = (gint64)((pts - (guint64)ref) & PTS_MASK);
+		if (delta >= (gint64)(PTS_WRAP / 2))
+			delta -= PTS_WRAP;
+		ext = ref + delta;
+		map->read = ext;
+		map->read_valid = TRUE;
+	}
+	ext += map->base;
+	return ext > 0 ? PTS_TO_NS((guint64)ext) : 0;
+}
+
+void pacer_init(pacer_t *pacer)
+{
+	guint min_write = pacer->min_write;
+	memset(pacer, 0, sizeof(*pacer));
+	pacer->min_write = min_write;
+	pacer->last_write = GST_CLOCK_TIME_NONE;
+	pacer->last_full = GST_CLOCK_TIME_NONE;
+	pacer->resume = GST_CLOCK_TIME_NONE;
+}
+
+#define PACER_AVG(avg, sample) ((avg) ? ((avg) * 7 + (sample)) / 8 : (sample))
+
+/* account a write of len bytes of which the driver accepted 'written'
+ * (0 for EAGAIN) */
+void pacer_written(pacer_t *pacer, size_t len, int written)
+{
+	GstClockTime now = gst_util_get_timestamp();
+
+	if (written > 0) {
+		++pacer->writes;
+		pacer->bytes += written;
+		pacer->avg_accept = PACER_AVG(pacer->avg_accept, (guint64)written);
+		if (GST_CLOCK_TIME_IS_VALID(pacer->last_write) && now > pacer->last_write)
+			pacer->avg_interval = PACER_AVG(pacer->avg_interval, now - pacer->last_write);
+		pacer->last_write = now;
+	}
+
+	if (written >= 0 && (size_t)written < len) {
+		/* the buffer was full before and is full again, so the driver
+		 * drained what it accepted in between */
+		if (written > 0 && GST_CLOCK_TIME_IS_VALID(pacer->last_full) && now > pacer->last_full)
+			pacer->rate = PACER_AVG(pacer->rate, gst_util_uint64_scale(written, GST_SECOND, now - pacer->last_full));
+		pacer->last_full = now;
+		++pacer->partial_writes;
+		if (pacer->min_write && pacer->rate) {
+			GstClockTime delay = gst_util_uint64_scale(pacer->min_write, GST_SECOND, pacer->rate);
+			pacer->resume = now + MIN(delay, PACER_MAX_DELAY);
+			++pacer->deferrals;
+		}
+	}
+	else if (written > 0)
+		pacer->last_full = GST_CLOCK_TIME_NONE;
+}
+
+/* milliseconds to wait before polling for POLLOUT again, 0 = now */
+int pacer_delay(pacer_t *pacer)
+{
+	GstClockTime now;
+
+	if (!GST_CLOCK_TIME_IS_VALID(pacer->resume))
+		return 0;
+	now = gst_util_get_timestamp();
+	if (now + GST_MSECOND / 2 >= pacer->resume) {
+		pacer->resume = GST_CLOCK_TIME_NONE;
+		return 0;
+	}
+	return (pacer->resume - now + GST_MSECOND - 1) / GST_MSECOND;
+}
+
+/* the learned model, for the write-stats property. Read without a lock, the
+ * values are only approximate while the sink writes */
+GstStructure *pacer_stats(pacer_t *pacer)
+{
+	return gst_structure_new ("writeStats",
+		"writes", G_TYPE_UINT64, pacer->writes,
+		"partial-writes", G_TYPE_UINT64, pacer->partial_writes,
+		"bytes", G_TYPE_UINT64, pacer->bytes,
+		"deferrals", G_TYPE_UINT64, pacer->deferrals,
+		"avg-accept", G_TYPE_UINT64, pacer->avg_accept,
+		"avg-interval", G_TYPE_UINT64, pacer->avg_interval,
+		"rate", G_TYPE_UINT64, pacer->rate, NULL);
+}
+
+typedef struct writer_record
+{
+	guint32 len;
+	guint32 generation;
+} writer_record_t;
+
+#define WRITER_ALIGN(x)	(((x) + 7) & ~7)
+
+void writer_init(writer_t *writer)
+{
+	memset(writer, 0, sizeof(*writer));
+	writer->fd = -1;
+	writer->wake[0] = writer->wake[1] = -1;
+}
+
+static void writer_read_commands(int fd)
+{
+	gchar command;
+	while (read(fd, &command, 1) > 0);
+}
+
+/* wake up the streaming thread when it waits for space or for the drain */
+static void writer_signal(writer_t *writer)
+{
+	if (g_atomic_int_get(&writer->waiting)) {
+		unsigned char c = 'W';
+		write(writer->control_write, &c, 1);
+	}
+}
+
+void writer_wakeup(writer_t *writer)
+{
+	if (writer_running(writer)) {
+		unsigned char c = 'W';
+		write(writer->wake[1], &c, 1);
+	}
+}
+
+void writer_flush(writer_t *writer)
+{
+	if (writer_running(writer)) {
+		g_atomic_int_inc(&writer->generation);
+		writer_wakeup(writer);
+	}
+}
+
+/* first half of a writer iteration: handles flushes and returns the poll
+ * events wanted on the device. timeout is lowered to the pacing delay when
+ * POLLOUT is deferred */
+static short writer_prepare(writer_t *writer, int *timeout)
+{
+	writer_record_t *rec = NULL;
+	guint tail = g_atomic_int_get(&writer->tail);
+	gint no_write = write_state_get(writer->no_write);
+	short events = writer->events;
+
+	g_atomic_int_set(&writer->sleeping, 0);
+
+	if (g_atomic_int_get(&writer->error))
+		return 0;
+
+	if ((guint)g_atomic_int_get(&writer->generation) != writer->cur_generation) {
+		writer->cur_generation = g_atomic_int_get(&writer->generation);
+		writer->offset = 0;
+		GST_DEBUG_OBJECT (writer->sink, "flush, generation %u", writer->cur_generation);
+		if (writer->flush_cb)
+			writer->flush_cb(writer->sink);
+	}
+
+	/* drop the records queued before the last flush */
+	while (tail != (guint)g_atomic_int_get(&writer->head)) {
+		rec = (writer_record_t*)(writer->ring + (tail & (writer->size - 1)));
+		if (rec->generation == writer->cur_generation)
+			break;
+		tail += sizeof(*rec) + WRITER_ALIGN(rec->len);
+		g_atomic_int_set(&writer->tail, tail);
+		writer_signal(writer);
+		rec = NULL;
+	}
+
+	if (!no_write && (rec || queue_filled(writer->queue)))
+		events |= POLLOUT;
+
+	if (!(events & POLLOUT)) {
+		g_atomic_int_set(&writer->sleeping, 1);
+		/* the streaming thread only wakes up a sleeping writer.. recheck */
+		if (!no_write && tail != (guint)g_atomic_int_get(&writer->head)) {
+			g_atomic_int_set(&writer->sleeping, 0);
+			events |= POLLOUT;
+		}
+	}
+
+	if ((events & POLLOUT) && writer->pacer) {
+		int delay = pacer_delay(writer->pacer);
+		if (delay) {
+			events &= ~POLLOUT;
+			if (*timeout < 0 || delay < *timeout)
+				*timeout = delay;
+		}
+	}
+
+	return events;
+}
+
+#define WRITER_DEFER_EVENT	1
+#define WRITER_DEFER_NOTIFY	2
+
+/* second half: handles the poll result on the wake socket and the device.
+ * Returns FALSE on a fatal write error. With deferred, the event callback and
+ * the queue notification, which post messages, are left to the caller and
+ * only flagged there */
+static gboolean writer_dispatch(writer_t *writer, short wake_revents, short revents, guint *deferred)
+{
+	if (wake_revents & POLLIN)
+		writer_read_commands(writer->wake[0]);
+
+	if (g_atomic_int_get(&writer->error))
+		return FALSE;
+
+	if ((revents & writer->events) && writer->event_cb) {
+		if (deferred)
+			*deferred |= WRITER_DEFER_EVENT;
+		else
+			writer->event_cb(writer->sink);
+	}
+
+	if (revents & POLLOUT) {
+		guint tail = g_atomic_int_get(&writer->tail);
+		writer_record_t *rec = NULL;
+		int wr;
+
+		if (tail != (guint)g_atomic_int_get(&writer->head)) {
+			rec = (writer_record_t*)(writer->ring + (tail & (writer->size - 1)));
+			/* flushed meanwhile, dropped by the next writer_prepare */
+			if (rec->generation != writer->cur_generation)
+				return TRUE;
+		}
+
+		if (rec) {
+			struct iovec iov[2];
+			int iovcnt = 0;
+			guint pos = (tail + sizeof(*rec) + writer->offset) & (writer->size - 1);
+			size_t len = rec->len - writer->offset;
+			size_t first = MIN(len, writer->size - pos);
+			iov_add(iov, &iovcnt, writer->ring + pos, first);
+			iov_add(iov, &iovcnt, writer->ring, len - first);
+			wr = writev(writer->fd, iov, iovcnt);
+			if (writer->pacer && (wr >= 0 || errno == EAGAIN))
+				pacer_written(writer->pacer, len, MAX(wr, 0));
+			if (wr > 0) {
+				writer->offset += wr;
+				if (writer->offset == rec->len) {
+					writer->offset = 0;
+					tail += sizeof(*rec) + WRITER_ALIGN(rec->len);
+					g_atomic_int_set(&writer->tail, tail);
+					writer_signal(writer);
+				}
+			}
+		}
+		else {
+			/* only polled for with data in the queue. The lock stays held
+			 * over the writev: a flush frees and a push may move the queued
+			 * data, the device doesn't block */
+			struct iovec qiov[IOV_MAX_FRAME];
+			int qiovcnt;
+			size_t left = 0;
+			GST_OBJECT_LOCK(writer->sink);
+			wr = 0;
+			qiovcnt = queue_frontv(writer->queue, qiov, IOV_MAX_FRAME);
+			if (qiovcnt) {
+				wr = writev(writer->fd, qiov, qiovcnt);
+				if (writer->pacer && (wr >= 0 || errno == EAGAIN))
+					pacer_written(writer->pacer, iov_length(qiov, qiovcnt), MAX(wr, 0));
+				if (wr > 0) {
+					queue_pop(writer->queue, wr);
+					left = writer->queue->bytes;
+				}
+			}
+			GST_OBJECT_UNLOCK(writer->sink);
+			if (wr > 0) {
+				GST_DEBUG_OBJECT (writer->sink, "written %d queue bytes... %d left", wr, (int)left);
+				if (deferred)
+					*deferred |= WRITER_DEFER_NOTIFY;
+				else
+					queue_notify(GST_ELEMENT(writer->sink), writer->queue);
+			}
+			if (!queue_filled(writer->queue))
+				writer_signal(writer);
+		}
+		if (wr < 0 && errno != EINTR && errno != EAGAIN) {
+			GST_WARNING_OBJECT (writer->sink, "write failed: %s", g_strerror(errno));
+			g_atomic_int_set(&writer->error, errno);
+			/* let a waiting streaming thread see the error */
+			writer_signal(writer);
+			return FALSE;
+		}
+	}
+	/* reported even when no events are polled for */
+	else if (revents & (POLLERR | POLLHUP)) {
+		GST_WARNING_OBJECT (writer->sink, "device error, revents 0x%x", revents);
+		g_atomic_int_set(&writer->error, EIO);
+		writer_signal(writer);
+		return FALSE;
+	}
+
+	return TRUE;
+}
+
+static gpointer writer_thread(gpointer data)
+{
+	writer_t *writer = data;
+	struct pollfd pfd[2];
+
+	pfd[0].fd = writer->wake[0];
+	pfd[0].events = POLLIN;
+	pfd[1].fd = writer->fd;
+
+	GST_DEBUG_OBJECT (writer->sink, "writer thread started");
+
+	while (g_atomic_int_get(&writer->running)) {
+		int timeout = -1;
+
+		pfd[1].events = writer_prepare(writer, &timeout);
+
+		if (poll(pfd, 2, timeout) == -1) {
+			g_atomic_int_set(&writer->sleeping, 0);
+			if (errno == EINTR)
+				continue;
+			GST_WARNING_OBJECT (writer->sink, "poll failed: %s", g_strerror(errno));
+			g_atomic_int_set(&writer->error, errno);
+			writer_signal(writer);
+			break;
+		}
+		g_atomic_int_set(&writer->sleeping, 0);
+
+		if (!writer_dispatch(writer, pfd[0].revents, pfd[1].revents, NULL))
+			break;
+	}
+
+	GST_DEBUG_OBJECT (writer->sink, "writer thread stopped");
+
+	return NULL;
+}
+
+/* shared reactor: one epoll thread per process servicing the writers of all
+ * dvb sinks. The audio and video sinks are separate plugins, each with its own
+ * copy of this file, so the reactor is published as qdata on the basesink type
+ * (under the registry lock) and always used through its function pointers.
+ * The first plugin creating it provides the implementation. The quark name
+ * carries the layout version of reactor_t and writer_t, the version and the
+ * writer size are checked again before a published reactor is used.. a
+ * plugin built differently runs a private reactor instead. */
+
+#define REACTOR_QUARK	"dvbsink-reactor-4"
+#define REACTOR_VERSION	4
+#define REACTOR_MAX_WRITERS	8
+
+typedef struct reactor reactor_t;
+
+/* callbacks of a writer which run after the reactor lock is released.. they
+ * post messages, and a handler of those could stop a sink and wait for the
+ * lock. reactor_remove waits while the writer is dispatched */
+typedef struct
+{
+	writer_t *writer;
+	guint deferred;
+} reactor_deferred_t;
+
+struct reactor
+{
+	guint version;		/* REACTOR_VERSION, first in every version */
+	gsize writer_size;	/* sizeof(writer_t) of the implementation */
+	gboolean (*add) (reactor_t *reactor, writer_t *writer);
+	void (*remove) (reactor_t *reactor, writer_t *writer);
+	gboolean (*video_ioctl) (reactor_t *reactor, unsigned long request, unsigned long arg);
+
+	GMutex *lock;		/* held while writers are serviced */
+	GCond *idle;		/* signalled when a deferred callback returned */
+	GThread *thread;
+	int epfd;
+	int wake[2];
+	writer_t *writers[REACTOR_MAX_WRITERS];
+	short events[REACTOR_MAX_WRITERS];	/* device events registered in epoll, -1 when removed after an error */
+	int nwriters;
+	reactor_deferred_t pending[REACTOR_MAX_WRITERS];
+	int npending;
+	writer_t *dispatching;	/* writer whose callbacks run unlocked */
+};
+
+static void reactor_ctl(reactor_t *reactor, int op, int fd, short events)
+{
+	struct epoll_event ev;
+	memset(&ev, 0, sizeof(ev));
+	ev.events = events;	/* POLL* and EPOLL* values are the same */
+	ev.data.fd = fd;
+	if (epoll_ctl(reactor->epfd, op, fd, &ev) < 0)
+		GST_WARNING ("epoll_ctl(%d, %d) failed: %s", op, fd, g_strerror(errno));
+}
+
+/* runs the deferred callbacks, called with the lock held. It is released
+ * around each callback, a writer removed meanwhile is skipped and one removed
+ * from its own callback (dispatching reset) isn't touched again */
+static void reactor_run_deferred(reactor_t *reactor)
+{
+	int i;
+
+	for (i = 0; i < reactor->npending; ++i) {
+		writer_t *writer = reactor->pending[i].writer;
+		guint deferred = reactor->pending[i].deferred;
+
+		if (!deferred)
+			continue;
+		reactor->dispatching = writer;
+		if (deferred & WRITER_DEFER_EVENT) {
+			g_mutex_unlock(reactor->lock);
+			writer->event_cb(writer->sink);
+			g_mutex_lock(reactor->lock);
+		}
+		if ((deferred & WRITER_DEFER_NOTIFY) && reactor->dispatching == writer) {
+			g_mutex_unlock(reactor->lock);
+			queue_notify(GST_ELEMENT(writer->sink), writer->queue);
+			g_mutex_lock(reactor->lock);
+		}
+		reactor->dispatching = NULL;
+		g_cond_broadcast(reactor->idle);
+	}
+	reactor->npending = 0;
+}
+
+static gpointer reactor_thread(gpointer data)
+{
+	reactor_t *reactor = data;
+	struct epoll_event evs[2 * REACTOR_MAX_WRITERS + 1];
+
+	prctl(PR_SET_NAME, "dvbsink-reactor", 0, 0, 0);
+
+	while (TRUE) {
+		guint deferred[REACTOR_MAX_WRITERS];
+		int i, n, timeout = -1;
+
+		g_mutex_lock(reactor->lock);
+		for (i = 0; i < reactor->nwriters; ++i) {
+			writer_t *writer = reactor->writers[i];
+			short events = writer_prepare(writer, &timeout);
+			if (reactor->events[i] >= 0 && events != reactor->events[i]) {
+				reactor_ctl(reactor, EPOLL_CTL_MOD, writer->fd, events);
+				reactor->events[i] = events;
+			}
+		}
+		g_mutex_unlock(reactor->lock);
+
+		n = epoll_wait(reactor->epfd, evs, G_N_ELEMENTS(evs), timeout);
+		if (n < 0) {
+			if (errno != EINTR)
+				GST_WARNING ("epoll_wait failed: %s", g_strerror(errno));
+			continue;
+		}
+
+		g_mutex_lock(reactor->lock);
+		memset(deferred, 0, sizeof(deferred));
+		for (i = 0; i < n; ++i) {
+			int fd = evs[i].data.fd;
+			int w;
+			if (fd == reactor->wake[0]) {
+				writer_read_commands(fd);
+				continue;
+			}
+			/* the writer might be gone already */
+			for (w = 0; w < reactor->nwriters; ++w) {
+				writer_t *writer = reactor->writers[w];
+				if (fd == writer->wake[0])
+					writer_dispatch(writer, evs[i].events, 0, &deferred[w]);
+				else if (fd == writer->fd) {
+					/* epoll keeps reporting errors and hangups of the
+					 * device, take it out once the writer failed */
+					if (!writer_dispatch(writer, 0, evs[i].events, &deferred[w]) && reactor->events[w] >= 0) {
+						reactor_ctl(reactor, EPOLL_CTL_DEL, writer->fd, 0);
+						reactor->events[w] = -1;
+					}
+				}
+				else
+					continue;
+				break;
+			}
+		}
+		for (i = 0; i < reactor->nwriters; ++i) {
+			if (!deferred[i])
+				continue;
+			reactor->pending[reactor->npending].writer = reactor->writers[i];
+			reactor->pending[reactor->npending++].deferred = deferred[i];
+		}
+		reactor_run_deferred(reactor);
+		g_mutex_unlock(reactor->lock);
+	}
+
+	return NULL;
+}
+
+static void reactor_wakeup(reactor_t *reactor)
+{
+	unsigned char c = 'R';
+	write(reactor->wake[1], &c, 1);
+}
+
+/* wakes up the reactor thread and waits until it released the lock */
+static void reactor_lock(reactor_t *reactor)
+{
+	reactor_wakeup(reactor);
+	g_mutex_lock(reactor->lock);
+}
+
+/* the reactor thread might have gone back to epoll_wait before the writers
+ * changed, let it collect the events of the writers again */
+static void reactor_unlock(reactor_t *reactor)
+{
+	g_mutex_unlock(reactor->lock);
+	reactor_wakeup(reactor);
+}
+
+static gboolean reactor_add(reactor_t *reactor, writer_t *writer)
+{
+	gboolean ret = FALSE;
+
+	reactor_lock(reactor);
+	if (reactor->nwriters < REACTOR_MAX_WRITERS) {
+		reactor->writers[reactor->nwriters] = writer;
+		reactor->events[reactor->nwriters] = 0;
+		++reactor->nwriters;
+		reactor_ctl(reactor, EPOLL_CTL_ADD, writer->wake[0], POLLIN);
+		reactor_ctl(reactor, EPOLL_CTL_ADD, writer->fd, 0);
+		ret = TRUE;
+	}
+	reactor_unlock(reactor);
+
+	return ret;
+}
+
+static void reactor_remove(reactor_t *reactor, writer_t *writer)
+{
+	int i;
+
+	reactor_lock(reactor);
+	/* the device is closed and the sink may go away after this returns,
+	 * no callback may run for the writer anymore */
+	for (i = 0; i < reactor->npending; ++i)
+		if (reactor->pending[i].writer == writer)
+			reactor->pending[i].deferred = 0;
+	if (reactor->dispatching == writer) {
+		if (g_thread_self() == reactor->thread)
+			reactor->dispatching = NULL;
+		else while (reactor->dispatching == writer)
+			g_cond_wait(reactor->idle, reactor->lock);
+	}
+	for (i = 0; i < reactor->nwriters; ++i) {
+		if (reactor->writers[i] == writer) {
+			reactor_ctl(reactor, EPOLL_CTL_DEL, writer->wake[0], 0);
+			if (reactor->events[i] >= 0)
+				reactor_ctl(reactor, EPOLL_CTL_DEL, writer->fd, 0);
+			--reactor->nwriters;
+			reactor->writers[i] = reactor->writers[reactor->nwriters];
+			reactor->events[i] = reactor->events[reactor->nwriters];
+			break;
+		}
+	}
+	reactor_unlock(reactor);
+}
+
+/* the device stays open while the writer is registered */
+static gboolean reactor_video_ioctl(reactor_t *reactor, unsigned long request, unsigned long arg)
+{
+	gboolean found = FALSE;
+	int i;
+
+	reactor_lock(reactor);
+	for (i = 0; i < reactor->nwriters && !found; ++i) {
+		writer_t *writer = reactor->writers[i];
+		if (writer->video && reactor->events[i] >= 0) {
+			if (ioctl(writer->fd, request, arg) < 0)
+				GST_DEBUG_OBJECT (writer->sink, "ioctl 0x%lx failed: %s", request, g_strerror(errno));
+			found = TRUE;
+		}
+	}
+	reactor_unlock(reactor);
+
+	return found;
+}
+
+/* a reactor implemented by this plugin's copy of the code */
+static reactor_t *reactor_new(void)
+{
+	reactor_t *reactor = g_new0(reactor_t, 1);
+	GError *err = NULL;
+
+	reactor->version = REACTOR_VERSION;
+	reactor->writer_size = sizeof(writer_t);
+	reactor->add = reactor_add;
+	reactor->remove = reactor_remove;
+	reactor->video_ioctl = reactor_video_ioctl;
+	reactor->lock = g_mutex_new();
+	reactor->idle = g_cond_new();
+	reactor->wake[0] = reactor->wake[1] = -1;
+	reactor->epfd = epoll_create(2 * REACTOR_MAX_WRITERS + 1);
+	if (reactor->epfd < 0 || socketpair(PF_UNIX, SOCK_STREAM, 0, reactor->wake) < 0) {
+		GST_WARNING ("failed to create reactor: %s", g_strerror(errno));
+		goto fail;
+	}
+	fcntl(reactor->wake[0], F_SETFL, O_NONBLOCK);
+	fcntl(reactor->wake[1], F_SETFL, O_NONBLOCK);
+	reactor_ctl(reactor, EPOLL_CTL_ADD, reactor->wake[0], POLLIN);
+
+	reactor->thread = g_thread_create(reactor_thread, reactor, FALSE, &err);
+	if (!reactor->thread) {
+		GST_WARNING ("failed to create reactor thread: %s", err->message);
+		g_error_free(err);
+		goto fail;
+	}
+	return reactor;
+fail:
+	if (reactor->epfd >= 0)
+		close(reactor->epfd);
+	if (reactor->wake[0] >= 0) {
+		close(reactor->wake[0]);
+		close(reactor->wake[1]);
+	}
+	g_cond_free(reactor->idle);
+	g_mutex_free(reactor->lock);
+	g_free(reactor);
+	return NULL;
+}
+
+/* returns the process wide reactor, creates it on first use (with create).. it
+ * is never destroyed, the plugins stay resident */
+static reactor_t *reactor_get(gboolean create)
+{
+	static reactor_t *private_reactor;
+	GstRegistry *registry = gst_registry_get_default();
+	GQuark quark = g_quark_from_static_string(REACTOR_QUARK);
+	reactor_t *reactor;
+
+	GST_OBJECT_LOCK(registry);
+	reactor = g_type_get_qdata(GST_TYPE_BASE_SINK, quark);
+	if (!reactor) {
+		if (create)
+			reactor = reactor_new();
+		if (reactor)
+			g_type_set_qdata(GST_TYPE_BASE_SINK, quark, reactor);
+	}
+	else if (reactor->version != REACTOR_VERSION || reactor->writer_size != sizeof(writer_t)) {
+		/* the writers of this plugin can't be handed to that one */
+		if (!private_reactor && create) {
+			GST_WARNING ("shared reactor version %u/%u, using a private one",
+				reactor->version, (guint)reactor->writer_size);
+			private_reactor = reactor_new();
+		}
+		reactor = private_reactor;
+	}
+	GST_OBJECT_UNLOCK(registry);
+
+	return reactor;
+}
+
+/* start the writer.. on a thread of its own or (shared) serviced by the
+ * process wide reactor */
+gboolean writer_start(writer_t *writer, gboolean shared)
+{
+	GError *err = NULL;
+
+	if (writer_running(writer))
+		return TRUE;
+
+	if (socketpair(PF_UNIX, SOCK_STREAM, 0, writer->wake) < 0) {
+		GST_WARNING_OBJECT (writer->sink, "socketpair failed: %s", g_strerror(errno));
+		return FALSE;
+	}
+	fcntl(writer->wake[0], F_SETFL, O_NONBLOCK);
+	fcntl(writer->wake[1], F_SETFL, O_NONBLOCK);
+
+	writer->size = WRITER_RING_SIZE;
+	writer->ring = g_malloc(writer->size);
+	writer->head = 0;
+	writer->tail = 0;
+	writer->generation = 0;
+	writer->cur_generation = 0;
+	writer->offset = 0;
+	writer->running = 1;
+	writer->sleeping = 0;
+	writer->waiting = 0;
+	writer->error = 0;
+
+	if (shared) {
+		reactor_t *reactor = reactor_get(TRUE);
+		if (reactor && reactor->add(reactor, writer)) {
+			writer->reactor = reactor;
+			return TRUE;
+		}
+		GST_WARNING_OBJECT (writer->sink, "can't use the shared reactor, starting a writer thread");
+	}
+
+	writer->thread = g_thread_create(writer_thread, writer, TRUE, &err);
+	if (!writer->thread) {
+		GST_WARNING_OBJECT (writer->sink, "failed to create writer thread: %s", err->message);
+		g_error_free(err);
+		writer_stop(writer);
+		return FALSE;
+	}
+
+	return TRUE;
+}
+
+void writer_stop(writer_t *writer)
+{
+	if (writer->reactor) {
+		reactor_t *reactor = writer->reactor;
+		reactor->remove(reactor, writer);
+		writer->reactor = NULL;
+	}
+	if (writer->thread) {
+		g_atomic_int_set(&writer->running, 0);
+		writer_wakeup(writer);
+		g_thread_join(writer->thread);
+		writer->thread = NULL;
+	}
+	if (writer->wake[0] >= 0) {
+		close(writer->wake[0]);
+		close(writer->wake[1]);
+		writer->wake[0] = writer->wake[1] = -1;
+	}
+	g_free(writer->ring);
+	writer->ring = NULL;
+}
+
+static guint writer_space(writer_t *writer)
+{
+	guint head = g_atomic_int_get(&writer->head);
+	guint tail = g_atomic_int_get(&writer->tail);
+	return writer->size - (head - tail);
+}
+
+/* writer_wait until the pause queue is written, the ring may still be in use */
+#define WRITER_WAIT_QUEUE	G_MAXUINT
+
+/* wait for the writer thread.. until the ring has 'need' bytes of space or
+ * (need == 0) until everything is written. Returns 0 on success, 1 when the
+ * sink stopped writing (flushing, paused or unlocked) and -1 on poll errors */
+static int writer_wait(writer_t *writer, guint need)
+{
+	struct pollfd pfd;
+
+	pfd.fd = writer->control_read;
+	pfd.events = POLLIN;
+
+	while (TRUE) {
+		gboolean done;
+		gint no_write = write_state_get(writer->no_write);
+
+		if (g_atomic_int_get(&writer->error))
+			return 0;
+
+		g_atomic_int_set(&writer->waiting, 1);
+		if (need == WRITER_WAIT_QUEUE)
+			done = !queue_filled(writer->queue);
+		else if (need)
+			done = writer_space(writer) >= need;
+		else
+			done = writer_space(writer) == writer->size && !queue_filled(writer->queue);
+		if (done || (no_write & (need ? WRITE_FLUSHING | WRITE_QUEUE : WRITE_FLUSHING | WRITE_UNLOCKED))) {
+			g_atomic_int_set(&writer->waiting, 0);
+			return done ? 0 : 1;
+		}
+
+		if (poll(&pfd, 1, -1) == -1) {
+			g_atomic_int_set(&writer->waiting, 0);
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+		g_atomic_int_set(&writer->waiting, 0);
+		if (pfd.revents & POLLIN)
+			writer_read_commands(writer->control_read);
+	}
+}
+
+/* copy 'len' bytes from the iovec array into the ring at position 'pos' */
+static void writer_copy(writer_t *writer, guint pos, struct iovec **iov, int *iovcnt, size_t len)
+{
+	while (len) {
+		size_t n = MIN(len, (*iov)->iov_len);
+		guint off = pos & (writer->size - 1);
+		size_t first = MIN(n, writer->size - off);
+		memcpy(writer->ring + off, (*iov)->iov_base, first);
+		if (n > first)
+			memcpy(writer->ring, (guint8*)(*iov)->iov_base + first, n - first);
+		pos += n;
+		len -= n;
+		iov_advance(iov, iovcnt, n);
+	}
+}
+
+/* push the iovec array to the pause queue. Over the high watermark the
+ * streaming thread waits until the writer drained the queue after the sink
+ * resumed (or flushes), leaky queues drop the data instead. Returns 1 when the
+ * caller has to start over, -1 on poll errors */
+static int writer_queue(writer_t *writer, struct iovec *iov, int iovcnt, GstBuffer * const *owners, int nowners)
+{
+	int admit;
+
+	GST_OBJECT_LOCK(writer->sink);
+	admit = queue_admit(writer->queue, write_state_get(writer->no_write));
+	if (admit == QUEUE_PUSH) {
+		queue_pushv(writer->queue, iov, iovcnt, owners, nowners);
+		/* owners[0] is the buffer being rendered */
+		if (nowners && owners[0])
+			queue_stamp(writer->queue, GST_BUFFER_TIMESTAMP(owners[0]));
+	}
+	GST_OBJECT_UNLOCK(writer->sink);
+
+	switch (admit) {
+	case QUEUE_PUSH:
+		GST_DEBUG_OBJECT (writer->sink, "pushed %d bytes to queue", (int)iov_length(iov, iovcnt));
+		queue_notify(GST_ELEMENT(writer->sink), writer->queue);
+		return 0;
+	case QUEUE_DROP:
+		GST_DEBUG_OBJECT (writer->sink, "queue full, dropped %d bytes", (int)iov_length(iov, iovcnt));
+		return 0;
+	default:
+		GST_DEBUG_OBJECT (writer->sink, "queue full, wait for resume");
+		return writer_wait(writer, 0) < 0 ? -1 : 1;
+	}
+}
+
+/* hand the iovec array over to the writer thread.. called from the streaming
+ * thread only. Data which ends up in the pause queue is referenced from the
+ * owner buffers where possible (see queue_pushv). Returns the same codes as the sinks' async write functions */
+int writer_push(writer_t *writer, struct iovec *iov, int iovcnt, GstBuffer * const *owners, int nowners)
+{
+	guint max_len = writer->size / 4 - sizeof(writer_record_t);
+
+	iov_advance(&iov, &iovcnt, 0); // skip empty segments
+
+	while (iovcnt) {
+		writer_record_t *rec;
+		guint head, len;
+		int ret;
+		gint no_write = write_state_get(writer->no_write);
+
+		if (g_atomic_int_get(&writer->error)) {
+			errno = g_atomic_int_get(&writer->error);
+			return -3;
+		}
+
+		if (no_write & WRITE_FLUSHING) {
+			GST_DEBUG_OBJECT (writer->sink, "skip %d bytes", (int)iov_length(iov, iovcnt));
+			break;
+		}
+
+		/* once data went to the pause queue everything else has to follow
+		 * while the sink doesn't write. Playing, the writer empties the
+		 * queue first (after the ring), then the ring takes over again */
+		if (queue_filled(writer->queue)) {
+			if (no_write & WRITE_QUEUE) {
+				ret = writer_queue(writer, iov, iovcnt, owners, nowners);
+				if (ret < 0)
+					return -1;
+				if (ret)
+					continue;
+				break;
+			}
+			if (writer_wait(writer, WRITER_WAIT_QUEUE) < 0)
+				return -1;
+			continue;
+		}
+
+		len = MIN(iov_length(iov, iovcnt), max_len);
+
+		switch (writer_wait(writer, sizeof(*rec) + WRITER_ALIGN(len))) {
+		case -1:
+			return -1;
+		case 1:
+			if (write_state_get(writer->no_write) & WRITE_FLUSHING)
+				continue;
+			GST_DEBUG_OBJECT (writer->sink, "ring full, queue %d bytes", (int)iov_length(iov, iovcnt));
+			ret = writer_queue(writer, iov, iovcnt, owners, nowners);
+			if (ret < 0)
+				return -1;
+			if (ret)
+				continue;
+			return 0;
+		default:
+			if (g_atomic_int_get(&writer->error))
+				continue;
+			break;
+		}
+
+		head = g_atomic_int_get(&writer->head);
+		rec = (writer_record_t*)(writer->ring + (head & (writer->size - 1)));
+		rec->len = len;
+		rec->generation = g_atomic_int_get(&writer->generation);
+		writer_copy(writer, head + sizeof(*rec), &iov, &iovcnt, len);
+		g_atomic_int_set(&writer->head, head + sizeof(*rec) + WRITER_ALIGN(len));
+
+		if (g_atomic_int_get(&writer->sleeping))
+			writer_wakeup(writer);
+	}
+
+	return 0;
+}
+
+/* wait until the writer thread has written all pending data (used on EOS).
+ * Returns FALSE when it was aborted by a flush or unlock */
+gboolean writer_drain(writer_t *writer)
+{
+	if (!writer_running(writer))
+		return TRUE;
+	writer_wakeup(writer);
+	return writer_wait(writer, 0) == 0 && !g_atomic_int_get(&writer->error);
+}
+
+gboolean writer_video_ioctl(unsigned long request, unsigned long arg)
+{
+	reactor_t *reactor = reactor_get(FALSE);
+
+	return reactor && reactor->video_ioctl(reactor, request, arg);
+}
+
+#ifdef HAVE_LINUX_IO_URING_H
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+
+#define URING_ENTRIES	8
+
+/* user_data of the requests, also their bit in uring->pending */
+#define URING_CONTROL	(1 << 0)	/* POLLIN on the control socket */
+#define URING_EVENT	(1 << 1)	/* decoder events (POLLPRI) */
+#define URING_POLLOUT	(1 << 2)	/* POLLOUT on the device.. */
+#define URING_WRITE	(1 << 3)	/* ..optionally linked to the writev */
+#define URING_CANCEL	(1 << 4)
+
+static int uring_enter(uring_t *uring, unsigned to_submit, unsigned min_complete)
+{
+	return syscall(__NR_io_uring_enter, uring->fd, to_submit, min_complete,
+		min_complete ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+}
+
+static struct io_uring_sqe *uring_sqe(uring_t *uring, unsigned *queued, int op, int fd, guint64 user_data)
+{
+	unsigned tail = *uring->sq_tail + *queued;
+	unsigned idx = tail & *uring->sq_mask;
+	struct io_uring_sqe *sqe = (struct io_uring_sqe*)uring->sqes + idx;
+
+	memset(sqe, 0, sizeof(*sqe));
+	sqe->opcode = op;
+	sqe->fd = fd;
+	sqe->user_data = user_data;
+	uring->sq_array[idx] = idx;
+	if (user_data != URING_CANCEL)
+		uring->pending |= user_data;
+	++*queued;
+	return sqe;
+}
+
+static void uring_poll_add(uring_t *uring, unsigned *queued, int fd, short events, guint64 user_data)
+{
+	struct io_uring_sqe *sqe = uring_sqe(uring, queued, IORING_OP_POLL_ADD, fd, user_data);
+	/* the 16 bit field works with old and new kernels on both endians */
+	sqe->poll_events = events;
+}
+
+/* publish the queued entries and wait for min_complete completions */
+static int uring_submit(uring_t *uring, unsigned queued, unsigned min_complete)
+{
+	g_atomic_int_set((gint*)uring->sq_tail, *uring->sq_tail + queued);
+	while (TRUE) {
+		int ret = uring_enter(uring, queued, min_complete);
+		if (ret >= 0)
+			return 0;
+		if (errno != EINTR)
+			return -1;
+		/* the entries were consumed if enter was interrupted while waiting */
+		if (g_atomic_int_get((gint*)uring->sq_head) == (gint)*uring->sq_tail)
+			queued = 0;
+	}
+}
+
+static void uring_reap(uring_t *uring, int fd, short revents[2], int *written, int *wrote)
+{
+	unsigned head = *uring->cq_head;
+
+	while (head != (unsigned)g_atomic_int_get((gint*)uring->cq_tail)) {
+		struct io_uring_cqe *cqe = (struct io_uring_cqe*)uring->cqes + (head & *uring->cq_mask);
+		int res = cqe->res;
+
+		uring->pending &= ~cqe->user_data;
+		switch (cqe->user_data) {
+		case URING_CONTROL:
+			revents[0] |= res < 0 ? POLLERR : res;
+			break;
+		case URING_EVENT:
+			if (res != -ECANCELED)
+				revents[1] |= res < 0 ? POLLERR : res;
+			break;
+		case URING_POLLOUT:
+			if (res != -ECANCELED)
+				revents[1] |= res < 0 ? POLLERR : res;
+			break;
+		case URING_WRITE:
+			if (res != -ECANCELED) {
+				*wrote = 1;
+				if (res < 0) {
+					*written = -1;
+					errno = -res;
+				}
+				else
+					*written = res;
+			}
+			break;
+		default:
+			break;
+		}
+		++head;
+	}
+	g_atomic_int_set((gint*)uring->cq_head, head);
+}
+
+gboolean uring_setup(uring_t *uring)
+{
+	struct io_uring_params p;
+
+	if (uring_running(uring))
+		return TRUE;
+
+	memset(&p, 0, sizeof(p));
+	uring->fd = syscall(__NR_io_uring_setup, URING_ENTRIES, &p);
+	if (uring->fd < 0) {
+		uring->fd = -1;
+		return FALSE;
+	}
+	/* async cancel came with the same kernel (5.5) as NODROP */
+	if (!(p.features & IORING_FEAT_NODROP)) {
+		errno = ENOSYS;
+		goto fail;
+	}
+
+	uring->sq_len = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+	uring->cq_len = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+	if (p.features & IORING_FEAT_SINGLE_MMAP)
+		uring->sq_len = uring->cq_len = MAX(uring->sq_len, uring->cq_len);
+
+	uring->sq_ptr = mmap(NULL, uring->sq_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, uring->fd, IORING_OFF_SQ_RING);
+	if (uring->sq_ptr == MAP_FAILED)
+		goto fail;
+	if (p.features & IORING_FEAT_SINGLE_MMAP)
+		uring->cq_ptr = uring->sq_ptr;
+	else {
+		uring->cq_ptr = mmap(NULL, uring->cq_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, uring->fd, IORING_OFF_CQ_RING);
+		if (uring->cq_ptr == MAP_FAILED)
+			goto fail;
+	}
+	uring->sqes_len = p.sq_entries * sizeof(struct io_uring_sqe);
+	uring->sqes = mmap(NULL, uring->sqes_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, uring->fd, IORING_OFF_SQES);
+	if (uring->sqes == MAP_FAILED)
+		goto fail;
+
+	uring->sq_head = (unsigned*)((guint8*)uring->sq_ptr + p.sq_off.head);
+	uring->sq_tail = (unsigned*)((guint8*)uring->sq_ptr + p.sq_off.tail);
+	uring->sq_mask = (unsigned*)((guint8*)uring->sq_ptr + p.sq_off.ring_mask);
+	uring->sq_array = (unsigned*)((guint8*)uring->sq_ptr + p.sq_off.array);
+	uring->cq_head = (unsigned*)((guint8*)uring->cq_ptr + p.cq_off.head);
+	uring->cq_tail = (unsigned*)((guint8*)uring->cq_ptr + p.cq_off.tail);
+	uring->cq_mask = (unsigned*)((guint8*)uring->cq_ptr + p.cq_off.ring_mask);
+	uring->cqes = (guint8*)uring->cq_ptr + p.cq_off.cqes;
+	uring->pending = 0;
+	return TRUE;
+fail:
+	uring_free(uring);
+	return FALSE;
+}
+
+void uring_free(uring_t *uring)
+{
+	if (uring->sqes && uring->sqes != MAP_FAILED)
+		munmap(uring->sqes, uring->sqes_len);
+	if (uring->cq_ptr && uring->cq_ptr != MAP_FAILED && uring->cq_ptr != uring->sq_ptr)
+		munmap(uring->cq_ptr, uring->cq_len);
+	if (uring->sq_ptr && uring->sq_ptr != MAP_FAILED)
+		munmap(uring->sq_ptr, uring->sq_len);
+	/* closing the ring cancels the polls still armed */
+	if (uring->fd >= 0)
+		close(uring->fd);
+	uring_init(uring);
+}
+
+/* one iteration of the write loop: waits until fd is writable and writes iov
+ * (iov == NULL only waits for POLLOUT), until control_fd gets readable or one
+ * of 'events' fires on fd. revents[0] (control_fd) and revents[1] (fd) are
+ * filled like poll() does. Returns -1 on error, 1 when the writev was done
+ * (*written has its result) and 0 otherwise. The iovec array isn't referenced
+ * anymore on return. */
+int uring_poll_writev(uring_t *uring, int control_fd, int fd, short events,
+	const struct iovec *iov, int iovcnt, short revents[2], int *written)
+{
+	unsigned queued = 0;
+	int wrote = 0;
+
+	revents[0] = revents[1] = 0;
+
+	if (!(uring->pending & URING_CONTROL))
+		uring_poll_add(uring, &queued, control_fd, POLLIN, URING_CONTROL);
+	if (events && !(uring->pending & URING_EVENT))
+		uring_poll_add(uring, &queued, fd, events, URING_EVENT);
+	uring_poll_add(uring, &queued, fd, POLLOUT, URING_POLLOUT);
+	if (iov) {
+		struct io_uring_sqe *sqe;
+		((struct io_uring_sqe*)uring->sqes)[(*uring->sq_tail + queued - 1) & *uring->sq_mask].flags |= IOSQE_IO_LINK;
+		sqe = uring_sqe(uring, &queued, IORING_OP_WRITEV, fd, URING_WRITE);
+		sqe->addr = (unsigned long)iov;
+		sqe->len = iovcnt;
+	}
+
+	if (uring_submit(uring, queued, 1) < 0)
+		goto error;
+	uring_reap(uring, fd, revents, written, &wrote);
+
+	/* woken up by the control socket or an event.. the pending poll and write
+	 * must be gone before the caller's iovec goes out of scope */
+	if (uring->pending & (URING_POLLOUT | URING_WRITE)) {
+		struct io_uring_sqe *sqe;
+		queued = 0;
+		sqe = uring_sqe(uring, &queued, IORING_OP_ASYNC_CANCEL, -1, URING_CANCEL);
+		sqe->addr = URING_POLLOUT;
+		if (uring_submit(uring, queued, 0) < 0)
+			goto error;
+		while (uring->pending & (URING_POLLOUT | URING_WRITE)) {
+			if (uring_submit(uring, 0, 1) < 0)
+				goto error;
+			uring_reap(uring, fd, revents, written, &wrote);
+		}
+	}
+
+	return wrote;
+error:
+	GST_WARNING ("io_uring_enter failed: %s", g_strerror(errno));
+	return -1;
+}
+
+#else
+
+gboolean uring_setup(uring_t *uring)
+{
+	errno = ENOSYS;
+	return FALSE;
+}
+
+void uring_free(uring_t *uring)
+{
+	uring_init(uring);
+}
+
+int uring_poll_writev(uring_t *uring, int control_fd, int fd, short events,
+	const struct iovec *iov, int iovcnt, short revents[2], int *written)
+{
+	errno = ENOSYS;
+	return -1;
+}
+
+#endif
+
+void uring_init(uring_t *uring)
+{
+	memset(uring, 0, sizeof(*uring));
+	uring->fd = -1;
+}
+
+/* MPEG-TS muxer. Each sink passes complete PES packets of its stream, the
+ * sink writing holds the mux lock until its PES is out (or a flush/unlock
+ * aborted it), so the packets of one PES are never interleaved with others.
+ * An aborted write leaves the rest of its current packet in pending, which
+ * goes out first on the next write and keeps the output packet aligned. */
+
+#define TSMUX_QUARK	"dvbsink-tsmux-2"
+#define TSMUX_PCR	TSMUX_STREAMS	/* filter index of the PCR pid */
+#define TSMUX_BATCH	64		/* packets per write */
+#define TSMUX_PCR_DELAY	63000		/* PCR runs 700ms behind the DTS, the decoder buffer delay */
+#define TSMUX_PCR_INTERVAL	3600	/* 40ms */
+#define TSMUX_PCR_LEAD	(TSMUX_PCR_DELAY - 9000)	/* the clock stops 100ms before the newest DTS */
+#define TSMUX_PCR_FOLLOW	5400	/* audio leading the PCR by more than 60ms pulls it along */
+#define TSMUX_PCR_RATE_SPAN	18000	/* ticks per packet measured over 200ms */
+#define TSMUX_PCR_STEP	(2 * TSMUX_PCR_INTERVAL)	/* larger steps take several PCRs.. */
+#define TSMUX_PCR_JUMP	(10 * 90000)	/* ..up to discontinuities */
+#define TSMUX_PSI_INTERVAL	9000	/* PAT/PMT every 100ms.. */
+#define TSMUX_PSI_PACKETS	4000	/* ..or every ~750kB without PCR */
+
+static const guint16 tsmux_pids[] = { TSMUX_PID_VIDEO, TSMUX_PID_AUDIO, TSMUX_PID_PCR };
+static const int tsmux_pes_types[] = { DMX_PES_VIDEO, DMX_PES_AUDIO, DMX_PES_PCR };
+
+struct tsmux
+{
+	int (*write) (tsmux_t *mux, int stream, const struct iovec *iov, int iovcnt, int control_fd, volatile gint *no_write);
+	void (*set_stream) (tsmux_t *mux, int stream, guint8 stream_type);
+	void (*release) (tsmux_t *mux, int stream);
+
+	/* protected by the registry lock */
+	gchar *location;
+	int refcount;
+	guint streams;		/* bitmask of the registered streams */
+	guint8 stream_type[TSMUX_STREAMS];	/* 0 = not known yet */
+	volatile gint psi_changed;
+
+	int token[2];		/* pipe holding one byte while no sink writes, the
+				 * writing sink has read it. Protects the rest */
+	int fd;
+	int pcr_filter;
+	guint8 pmt_type[TSMUX_STREAMS];	/* as announced in the PMT */
+	guint8 psi_version;
+	gboolean psi_sent;
+	guint psi_packets;	/* packets since the last PAT/PMT */
+	guint64 psi_pcr;
+	guint8 pat_cc, pmt_cc, cc[TSMUX_STREAMS];
+	guint64 pcr;		/* the last one sent.. */
+	guint pcr_packets;	/* ..after this many packets */
+	gboolean pcr_valid;
+	guint packets;		/* packets written */
+	guint64 rate_pcr;	/* the PCR stream timestamp the rate is measured from.. */
+	guint rate_packets;	/* ..and the packets written at it */
+	guint64 pcr_rate;	/* 90kHz ticks per packet << 16, 0 = not known yet */
+	guint64 pcr_limit;	/* the clock stops here */
+	guint8 pending[TS_PACKET_SIZE];
+	guint pending_len;
+	guint8 buf[TSMUX_BATCH * TS_PACKET_SIZE];
+};
+
+static guint32 tsmux_crc32(const guint8 *data, int len)
+{
+	guint32 crc = 0xFFFFFFFF;
+	int i;
+
+	while (len--) {
+		crc ^= (guint32)*data++ << 24;
+		for (i = 0; i < 8; ++i)
+			crc = crc & 0x80000000 ? (crc << 1) ^ 0x04C11DB7 : crc << 1;
+	}
+	return crc;
+}
+
+/* puts one PSI section (without CRC) into a packet of its own */
+static void tsmux_section(guint8 *p, int pid, guint8 *cc, int len)
+{
+	guint8 *s = p + 5;
+	guint32 crc = tsmux_crc32(s, len);
+
+	p[0] = 0x47;
+	p[1] = 0x40 | pid >> 8;
+	p[2] = pid & 0xFF;
+	p[3] = 0x10 | (*cc)++ % 16;
+	p[4] = 0;	/* pointer field */
+	s[len] = crc >> 24;
+	s[len + 1] = crc >> 16;
+	s[len + 2] = crc >> 8;
+	s[len + 3] = crc;
+	memset(s + len + 4, 0xFF, TS_PACKET_SIZE - 5 - len - 4);
+}
+
+static void tsmux_pat(tsmux_t *mux, guint8 *p)
+{
+	guint8 *s = p + 5;
+
+	s[0] = 0x00;
+	s[1] = 0xB0;
+	s[2] = 13;
+	s[3] = 0x00;	/* transport stream id */
+	s[4] = 0x01;
+	s[5] = 0xC1 | (mux->psi_version % 32) << 1;
+	s[6] = 0;
+	s[7] = 0;
+	s[8] = 0x00;	/* program number */
+	s[9] = 0x01;
+	s[10] = 0xE0 | TSMUX_PID_PMT >> 8;
+	s[11] = TSMUX_PID_PMT & 0xFF;
+	tsmux_section(p, 0, &mux->pat_cc, 12);
+}
+
+static void tsmux_pmt(tsmux_t *mux, guint8 *p)
+{
+	guint8 *s = p + 5;
+	int i, len = 12;
+
+	s[0] = 0x02;
+	s[3] = 0x00;	/* program number */
+	s[4] = 0x01;
+	s[5] = 0xC1 | (mux->psi_version % 32) << 1;
+	s[6] = 0;
+	s[7] = 0;
+	s[8] = 0xE0 | TSMUX_PID_PCR >> 8;
+	s[9] = TSMUX_PID_PCR & 0xFF;
+	s[10] = 0xF0;	/* no program info */
+	s[11] = 0;
+	for (i = 0; i < TSMUX_STREAMS; ++i) {
+		if (!mux->pmt_type[i])
+			continue;
+		s[len] = mux->pmt_type[i];
+		s[len + 1] = 0xE0 | tsmux_pids[i] >> 8;
+		s[len + 2] = tsmux_pids[i] & 0xFF;
+		s[len + 3] = 0xF0;
+		s[len + 4] = 0;
+		len += 5;
+	}
+	s[1] = 0xB0 | (len + 1) >> 8;	/* up to the CRC */
+	s[2] = (len + 1) & 0xFF;
+	tsmux_section(p, TSMUX_PID_PMT, &mux->pmt_cc, len);
+}
+
+/* a packet with nothing but the PCR on the PCR pid */
+static void tsmux_pcr_packet(guint8 *p, guint64 pcr, gboolean discontinuity)
+{
+	p[0] = 0x47;
+	p[1] = TSMUX_PID_PCR >> 8;
+	p[2] = TSMUX_PID_PCR & 0xFF;
+	p[3] = 0x20;	/* adaptation field only, the counter doesn't advance */
+	p[4] = TS_PACKET_SIZE - 5;
+	p[5] = 0x10 | (discontinuity ? 0x80 : 0);
+	p[6] = pcr >> 25;
+	p[7] = pcr >> 17;
+	p[8] = pcr >> 9;
+	p[9] = pcr >> 1;
+	p[10] = (pcr & 1) << 7 | 0x7E;
+	p[11] = 0;
+	memset(p + 12, 0xFF, TS_PACKET_SIZE - 12);
+}
+
+/* the PCR stream's timestamps teach the mux the ticks per packet */
+static void tsmux_pcr_rate(tsmux_t *mux, guint64 pcr, gboolean discontinuity)
+{
+	guint64 delta = (pcr - mux->rate_pcr) & PTS_MASK;
+	guint packets = mux->packets - mux->rate_packets;
+
+	if (mux->pcr_valid && !discontinuity) {
+		if (delta > PTS_WRAP / 2 || delta < TSMUX_PCR_RATE_SPAN)
+			return;
+		if (packets) {
+			guint64 rate = (delta << 16) / packets;
+			mux->pcr_rate = mux->pcr_rate ? (mux->pcr_rate * 7 + rate) / 8 : rate;
+		}
+	}
+	mux->rate_pcr = pcr;
+	mux->rate_packets = mux->packets;
+}
+
+/* the PCR after n more packets: from the last one sent it advances with the
+ * packets written. Ahead of the newest timestamp (after a long PES) it slows
+ * down and stops TSMUX_PCR_LEAD past it */
+static guint64 tsmux_pcr_clock(tsmux_t *mux, int n)
+{
+	guint64 lead = (mux->pcr - mux->pcr_limit + TSMUX_PCR_LEAD) & PTS_MASK;
+	guint64 rate = mux->pcr_rate;
+
+	if (lead < PTS_WRAP / 2)
+		rate = lead < TSMUX_PCR_LEAD ? rate * (TSMUX_PCR_LEAD - lead) / TSMUX_PCR_LEAD : 0;
+	return (mux->pcr + ((guint64)(mux->packets + n - mux->pcr_packets) * rate >> 16)) & PTS_MASK;
+}
+
+/* advances the PCR to the timestamp of a PES, returns TRUE when a PCR packet
+ * is due. The PCR follows the timestamps of the PCR stream, the other stream
+ * only keeps it within TSMUX_PCR_FOLLOW when the PCR stream pauses. A
+ * timestamp behind the running clock (reordered frames, the packets of a
+ * long PES) leaves it alone */
+static gboolean tsmux_pcr(tsmux_t *mux, guint64 ts, gboolean pcr_stream, gboolean *discontinuity)
+{
+	guint64 pcr = (ts - TSMUX_PCR_DELAY - (pcr_stream ? 0 : TSMUX_PCR_FOLLOW)) & PTS_MASK;
+	guint64 delta = (pcr - mux->pcr) & PTS_MASK;
+
+	*discontinuity = FALSE;
+	if (!mux->pcr_valid) {
+		if (!pcr_stream)
+			return FALSE;
+	}
+	else if (delta > TSMUX_PCR_JUMP && PTS_WRAP - delta > TSMUX_PCR_JUMP) {
+		if (!pcr_stream)
+			return FALSE;
+		*discontinuity = TRUE;
+	}
+
+	if (pcr_stream)
+		tsmux_pcr_rate(mux, pcr, *discontinuity);
+	if (!mux->pcr_valid || *discontinuity || ((pcr + TSMUX_PCR_LEAD - mux->pcr_limit) & PTS_MASK) < PTS_WRAP / 2)
+		mux->pcr_limit = (pcr + TSMUX_PCR_LEAD) & PTS_MASK;
+
+	if (mux->pcr_valid && !*discontinuity) {
+		if (((pcr - tsmux_pcr_clock(mux, 0)) & PTS_MASK) > PTS_WRAP / 2 || delta < TSMUX_PCR_INTERVAL)
+			return FALSE;
+		if (delta > TSMUX_PCR_STEP)
+			pcr = (mux->pcr + TSMUX_PCR_STEP) & PTS_MASK;
+	}
+	mux->pcr = pcr;
+	mux->pcr_valid = TRUE;
+	mux->pcr_packets = mux->packets;
+	return TRUE;
+}
+
+/* between the timestamps the PCR goes out every TSMUX_PCR_INTERVAL worth of
+ * packets, so long PES packets carry it too. n packets are not written yet */
+static gboolean tsmux_pcr_scheduled(tsmux_t *mux, int n)
+{
+	guint64 pcr;
+
+	if (!mux->pcr_valid || !mux->pcr_rate)
+		return FALSE;
+	if ((guint64)(mux->packets + n - mux->pcr_packets) * mux->pcr_rate < (guint64)TSMUX_PCR_INTERVAL << 16)
+		return FALSE;
+	pcr = tsmux_pcr_clock(mux, n);
+	if (pcr == mux->pcr)
+		return FALSE;
+	mux->pcr = pcr;
+	mux->pcr_packets = mux->packets + n;
+	return TRUE;
+}
+
+static guint64 tsmux_get_ts(const guint8 *h)
+{
+	return (guint64)(h[0] >> 1 & 7) << 30 | h[1] << 22 | (h[2] >> 1) << 15 | h[3] << 7 | h[4] >> 1;
+}
+
+/* the other sink might be stuck in a write on the full DVR device. Waits
+ * for the token and the control socket together, so flushes and unlocks get
+ * through. Returns 1 when one of them came first */
+static int tsmux_lock(tsmux_t *mux, int control_fd, volatile gint *no_write)
+{
+	struct pollfd pfd[2];
+	char token;
+
+	pfd[0].fd = control_fd;
+	pfd[0].events = POLLIN;
+	pfd[1].fd = mux->token[0];
+	pfd[1].events = POLLIN;
+
+	while (read(mux->token[0], &token, 1) != 1) {
+		if (errno != EAGAIN && errno != EINTR)
+			return -1;
+		if (write_state_get(no_write) & (WRITE_FLUSHING | WRITE_UNLOCKED))
+			return 1;
+		if (poll(pfd, 2, -1) < 0 && errno != EINTR)
+			return -1;
+		if (pfd[0].revents & POLLIN)
+			writer_read_commands(control_fd);
+	}
+	return 0;
+}
+
+static void tsmux_unlock(tsmux_t *mux)
+{
+	char token = 0;
+
+	while (write(mux->token[1], &token, 1) < 0 && errno == EINTR);
+}
+
+/* writes whole packets.. returns 1 when a flush or unlock aborted the write */
+static int tsmux_output(tsmux_t *mux, const guint8 *data, size_t len, int control_fd, volatile gint *no_write)
+{
+	struct pollfd pfd[2];
+	size_t done = 0;
+
+	pfd[0].fd = control_fd;
+	pfd[0].events = POLLIN;
+	pfd[1].fd = mux->fd;
+	pfd[1].events = POLLOUT;
+	mux->pending_len = 0;
+
+	while (done < len) {
+		ssize_t wr;
+		if (write_state_get(no_write) & (WRITE_FLUSHING | WRITE_UNLOCKED)) {
+			/* the paused decoders don't matter here, the demux keeps
+			 * the data.. only a flush or unlock drops it */
+			guint rest = (len - done) % TS_PACKET_SIZE;
+			memmove(mux->pending, data + done, rest);
+			mux->pending_len = rest;
+			GST_DEBUG ("skip %d bytes", (int)(len - done - rest));
+			return 1;
+		}
+		if (poll(pfd, 2, -1) < 0) {
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+		if (pfd[0].revents & POLLIN) {
+			writer_read_commands(control_fd);
+			continue;
+		}
+		if (!pfd[1].revents)
+			continue;
+		wr = write(mux->fd, data + done, len - done);
+		if (wr < 0) {
+			if (errno == EINTR || errno == EAGAIN)
+				continue;
+			return -3;
+		}
+		done += wr;
+	}
+	return 0;
+}
+
+static int tsmux_write_impl(tsmux_t *mux, int stream, const struct iovec *iov, int iovcnt, int control_fd, volatile gint *no_write)
+{
+	struct iovec payload[IOV_MAX_PES], *cur = payload;
+	guint8 header[PES_MIN_HEADER + 10];
+	size_t len = iov_length(iov, iovcnt), hlen = 0;
+	int i, n = 0, ret, pid = tsmux_pids[stream];
+	gboolean start = TRUE, discontinuity, psi_due;
+
+	if (iovcnt > IOV_MAX_PES) {
+		errno = EINVAL;
+		return -3;
+	}
+
+	ret = tsmux_lock(mux, control_fd, no_write);
+	if (ret)
+		return ret > 0 ? 0 : ret;
+
+	if (mux->pending_len) {
+		ret = tsmux_output(mux, mux->pending, mux->pending_len, control_fd, no_write);
+		if (ret)
+			goto out;
+	}
+
+	if (g_atomic_int_get(&mux->psi_changed)) {
+		GstRegistry *registry = gst_registry_get_default();
+		GST_OBJECT_LOCK(registry);
+		memcpy(mux->pmt_type, mux->stream_type, sizeof(mux->pmt_type));
+		g_atomic_int_set(&mux->psi_changed, 0);
+		GST_OBJECT_UNLOCK(registry);
+		++mux->psi_version;
+		mux->psi_sent = FALSE;
+	}
+
+	psi_due = !mux->psi_sent || mux->psi_packets >= TSMUX_PSI_PACKETS;
+
+	for (i = 0; i < iovcnt && hlen < sizeof(header); ++i) {
+		size_t cp = MIN(iov[i].iov_len, sizeof(header) - hlen);
+		memcpy(header + hlen, iov[i].iov_base, cp);
+		hlen += cp;
+	}
+	if (hlen >= PES_MIN_HEADER + 5 && header[7] & 0x80) {
+		guint64 ts = tsmux_get_ts(header + 9);
+		if ((header[7] & 0xC0) == 0xC0 && hlen >= PES_MIN_HEADER + 10)
+			ts = tsmux_get_ts(header + 14);
+		/* the PCR follows the video, audio only without it */
+		if (tsmux_pcr(mux, ts, stream == TSMUX_VIDEO || !mux->pmt_type[TSMUX_VIDEO], &discontinuity)) {
+			if (discontinuity || ((mux->pcr - mux->psi_pcr) & PTS_MASK) >= TSMUX_PSI_INTERVAL)
+				psi_due = TRUE;
+			if (psi_due)
+				mux->psi_pcr = mux->pcr;
+			tsmux_pcr_packet(mux->buf + n++ * TS_PACKET_SIZE, mux->pcr, discontinuity);
+		}
+	}
+
+	if (psi_due) {
+		tsmux_pat(mux, mux->buf + n++ * TS_PACKET_SIZE);
+		tsmux_pmt(mux, mux->buf + n++ * TS_PACKET_SIZE);
+		mux->psi_sent = TRUE;
+		mux->psi_packets = 0;
+	}
+
+	memcpy(payload, iov, iovcnt * sizeof(*iov));
+	while (len) {
+		guint8 *p;
+		size_t chunk = MIN(len, TS_PACKET_SIZE - 4), off = 4;
+
+		if (n < TSMUX_BATCH - 1 && tsmux_pcr_scheduled(mux, n))
+			tsmux_pcr_packet(mux->buf + n++ * TS_PACKET_SIZE, mux->pcr, FALSE);
+
+		p = mux->buf + n * TS_PACKET_SIZE;
+		p[0] = 0x47;
+		p[1] = (start ? 0x40 : 0) | pid >> 8;
+		p[2] = pid & 0xFF;
+		p[3] = 0x10 | mux->cc[stream]++ % 16;
+		if (chunk < TS_PACKET_SIZE - 4) {
+			/* stuffing in the adaptation field of the last packet */
+			p[3] |= 0x20;
+			p[4] = TS_PACKET_SIZE - 5 - chunk;
+			if (p[4]) {
+				p[5] = 0;
+				memset(p + 6, 0xFF, p[4] - 1);
+			}
+			off = 5 + p[4];
+		}
+		for (i = 0; i < chunk; ) {
+			size_t cp = MIN(cur->iov_len, chunk - i);
+			memcpy(p + off + i, cur->iov_base, cp);
+			i += cp;
+			iov_advance(&cur, &iovcnt, cp);
+		}
+		len -= chunk;
+		start = FALSE;
+		++mux->psi_packets;
+		if (++n == TSMUX_BATCH || !len) {
+			ret = tsmux_output(mux, mux->buf, n * TS_PACKET_SIZE, control_fd, no_write);
+			mux->packets += n;
+			n = 0;
+			if (ret)
+				break;
+		}
+	}
+
+out:
+	tsmux_unlock(mux);
+	return ret > 0 ? 0 : ret;
+}
+
+static void tsmux_set_stream_impl(tsmux_t *mux, int stream, guint8 stream_type)
+{
+	GstRegistry *registry = gst_registry_get_default();
+
+	GST_OBJECT_LOCK(registry);
+	if (mux->stream_type[stream] != stream_type) {
+		mux->stream_type[stream] = stream_type;
+		g_atomic_int_set(&mux->psi_changed, 1);
+	}
+	GST_OBJECT_UNLOCK(registry);
+}
+
+static void tsmux_release_impl(tsmux_t *mux, int stream)
+{
+	GstRegistry *registry = gst_registry_get_default();
+
+	GST_OBJECT_LOCK(registry);
+	mux->streams &= ~(1 << stream);
+	mux->stream_type[stream] = 0;
+	g_atomic_int_set(&mux->psi_changed, 1);
+	if (!--mux->refcount) {
+		if (mux->pcr_filter >= 0)
+			close(mux->pcr_filter);
+		close(mux->fd);
+		mux->pcr_filter = -1;
+		mux->fd = -1;
+	}
+	GST_OBJECT_UNLOCK(registry);
+}
+
+/* /dev/dvb/adapterN/dvrM -> /dev/dvb/adapterN/demuxM, NULL for plain files */
+static gchar *tsmux_demux_path(const gchar *location)
+{
+	const gchar *base = strrchr(location, '/');
+
+	base = base ? base + 1 : location;
+	if (strncmp(base, "dvr", 3))
+		return NULL;
+	return g_strdup_printf("%.*sdemux%s", (int)(base - location), location, base + 3);
+}
+
+/* routes a pid of the TS written to the DVR device to its decoder, returns
+ * the demux fd (to be closed when done) or -1 when the output is no DVR
+ * device or the filter can't be set */
+int tsmux_open_filter(const gchar *location, int stream)
+{
+	struct dmx_pes_filter_params params;
+	gchar *path = tsmux_demux_path(location);
+	int fd;
+
+	if (!path)
+		return -1;
+
+	fd = open(path, O_RDWR | O_NONBLOCK);
+	if (fd >= 0) {
+		memset(&params, 0, sizeof(params));
+		params.pid = tsmux_pids[stream];
+		params.input = DMX_IN_DVR;
+		params.output = DMX_OUT_DECODER;
+		params.pes_type = tsmux_pes_types[stream];
+		params.flags = DMX_IMMEDIATE_START;
+		if (ioctl(fd, DMX_SET_PES_FILTER, &params) < 0) {
+			GST_WARNING ("DMX_SET_PES_FILTER for pid 0x%x failed: %s", params.pid, g_strerror(errno));
+			close(fd);
+			fd = -1;
+		}
+	}
+	else
+		GST_WARNING ("can't open %s: %s", path, g_strerror(errno));
+
+	g_free(path);
+	return fd;
+}
+
+/* registers the stream with the process wide muxer writing to location,
+ * opens the output for the first stream */
+tsmux_t *tsmux_get(const gchar *location, int stream)
+{
+	GstRegistry *registry = gst_registry_get_default();
+	GQuark quark = g_quark_from_static_string(TSMUX_QUARK);
+	tsmux_t *mux;
+
+	GST_OBJECT_LOCK(registry);
+	mux = g_type_get_qdata(GST_TYPE_BASE_SINK, quark);
+	if (!mux) {
+		mux = g_new0(tsmux_t, 1);
+		if (pipe(mux->token) < 0) {
+			GST_WARNING ("can't create the mux token pipe: %s", g_strerror(errno));
+			g_free(mux);
+			goto fail;
+		}
+		fcntl(mux->token[0], F_SETFL, O_NONBLOCK);
+		fcntl(mux->token[1], F_SETFL, O_NONBLOCK);
+		tsmux_unlock(mux);
+		mux->write = tsmux_write_impl;
+		mux->set_stream = tsmux_set_stream_impl;
+		mux->release = tsmux_release_impl;
+		mux->fd = -1;
+		mux->pcr_filter = -1;
+		g_type_set_qdata(GST_TYPE_BASE_SINK, quark, mux);
+	}
+
+	if (mux->refcount && strcmp(mux->location, location)) {
+		GST_WARNING ("TS output already goes to %s", mux->location);
+		goto fail;
+	}
+	if (mux->streams & (1 << stream)) {
+		GST_WARNING ("TS output already has a stream %d", stream);
+		goto fail;
+	}
+	if (!mux->refcount) {
+		mux->fd = open(location, O_WRONLY | O_CREAT | O_TRUNC | O_NONBLOCK, 0644);
+		if (mux->fd < 0) {
+			GST_WARNING ("can't open %s: %s", location, g_strerror(errno));
+			goto fail;
+		}
+		g_free(mux->location);
+		mux->location = g_strdup(location);
+		mux->pcr_filter = tsmux_open_filter(location, TSMUX_PCR);
+		memset(mux->pmt_type, 0, sizeof(mux->pmt_type));
+		memset(mux->cc, 0, sizeof(mux->cc));
+		mux->pat_cc = mux->pmt_cc = 0;
+		mux->psi_sent = FALSE;
+		mux->psi_packets = 0;
+		mux->pcr_valid = FALSE;
+		mux->pcr_rate = 0;
+		mux->packets = 0;
+		mux->pending_len = 0;
+	}
+	++mux->refcount;
+	mux->streams |= 1 << stream;
+	mux->stream_type[stream] = 0;
+	GST_OBJECT_UNLOCK(registry);
+
+	return mux;
+fail:
+	GST_OBJECT_UNLOCK(registry);
+	return NULL;
+}
+
+void tsmux_release(tsmux_t *mux, int stream)
+{
+	mux->release(mux, stream);
+}
+
+/* stream_type as in the PMT, set when the caps are known */
+void tsmux_set_stream(tsmux_t *mux, int stream, guint8 stream_type)
+{
+	mux->set_stream(mux, stream, stream_type);
+}
+
+/* writes one complete PES packet, returns 0 also when it was dropped because
+ * of a flush or unlock, -1 on poll and -3 on write errors */
+int tsmux_write(tsmux_t *mux, int stream, const struct iovec *iov, int iovcnt, int control_fd, volatile gint *no_write)
+{
+	return mux->write(mux, stream, iov, iovcnt, control_fd, no_write);
+}
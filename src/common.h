@@ -0,0 +1,468 @@
+/*
+ * GStreamer DVB Media Sink
+ * Copyright 2006 Felix Domke <tmbinc@elitedvb.net>
+ * based on code by:
+ * Copyright 2005 Thomas Vander Stichele <thomas@apestaart.org>
+ * Copyright 2005 Ronald S. Bultje <rbultje@ronald.bitfreak.net>
+ * 
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ *
+ * Alternatively, the contents of this file may be used under the
+ * GNU Lesser General Public License Version 2.1 (the "LGPL"), in
+ * which case the following provisions apply instead of the ones
+ * mentioned above:
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU Library General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+#ifndef __COMMON_H__
+#define __COMMON_H__
+
+#include <string.h>
+#include <limits.h>
+#include <sys/uio.h>
+#include <gst/gst.h>
+
+G_BEGIN_DECLS
+
+/* sink write state (no_write): a bitmask which is only changed with the
+ * atomic helpers below, so the write loops can test it without a lock.
+ *   0                 running, data goes to the decoder
+ *   WRITE_FLUSHING    FLUSH_START .. FLUSH_STOP, data is dropped
+ *   WRITE_UNLOCKED    unlock() .. unlock_stop(), data is queued
+ *   WRITE_PAUSED      PLAYING_TO_PAUSED .. PAUSED_TO_PLAYING, data is queued
+ * Every change has to be followed by a wakeup of the waiting thread
+ * (SEND_COMMAND and writer_wakeup). */
+
+#define WRITE_FLUSHING	1
+#define WRITE_UNLOCKED	2
+#define WRITE_PAUSED	4
+#define WRITE_QUEUE	(WRITE_UNLOCKED | WRITE_PAUSED)
+
+#define write_state_get(state)	g_atomic_int_get(state)
+gint write_state_set(volatile gint *state, gint bits);
+gint write_state_clear(volatile gint *state, gint bits);
+
+/* pause queue: holds the data that can't be written to the decoder while the
+ * sink is paused or unlocked. The queue is a ring of chunk descriptors. Data
+ * owned by a GstBuffer is queued by reference (no copy); everything else
+ * (PES headers built on the stack, scratch buffers) is copied into a growable
+ * byte ring. Partially written data is simply popped by the number of bytes
+ * the driver accepted.
+ * Without a writer thread the queue is used by the streaming thread only and
+ * needs no lock. With a writer thread it is shared with the writer and
+ * protected by the object lock; 'filled' can be tested without it. The lock
+ * is taken to queue while paused or unlocked, to clear on a flush and by the
+ * writer for each (non-blocking) writev draining the queue after a resume.
+ * Playing with an empty queue, the ring handoff doesn't touch it. */
+
+#define QUEUE_DEFAULT_SIZE	(256*1024)
+#define QUEUE_DEFAULT_CHUNKS	64
+
+typedef struct queue_chunk
+{
+	GstBuffer *buffer;	/* NULL when the data lives in the byte ring */
+	const guint8 *data;	/* referenced data, unused for copied chunks */
+	size_t len;
+} queue_chunk_t;
+
+typedef struct queue
+{
+	guint8 *data;
+	size_t size;		/* allocated byte ring size */
+	size_t read;		/* offset of the first copied byte */
+	size_t copied;		/* number of bytes in the byte ring */
+
+	queue_chunk_t *chunks;
+	guint chunks_size;	/* allocated number of descriptors */
+	guint chunks_first;
+	guint chunks_count;
+
+	size_t bytes;		/* number of queued bytes (copied and referenced) */
+	volatile gint filled;	/* bytes != 0, for lock-free tests */
+
+	GstClockTime first_time;	/* timestamps of the oldest and newest queued data */
+	GstClockTime last_time;
+
+	/* watermarks, a zero limit means unlimited. Once the high watermark is
+	 * reached new data is blocked or dropped (leaky) until the sink resumes */
+	guint max_bytes;
+	guint64 max_time;
+	guint low_percent;	/* low watermark in percent of the limits */
+	gboolean leaky;
+	gboolean above_high;
+	guint64 dropped;
+} queue_t;
+
+#define QUEUE_DEFAULT_LOW_PERCENT 10
+
+/* queue_admit results */
+#define QUEUE_PUSH	0
+#define QUEUE_BLOCK	1
+#define QUEUE_DROP	2
+
+void queue_init(queue_t *queue);
+void queue_alloc(queue_t *queue, size_t size);
+void queue_free(queue_t *queue);
+void queue_clear(queue_t *queue);
+void queue_push(queue_t *queue, const guint8 *data, size_t len);
+void queue_push_buffer(queue_t *queue, GstBuffer *buffer, const guint8 *data, size_t len);
+void queue_pushv(queue_t *queue, const struct iovec *iov, int iovcnt, GstBuffer * const *owners, int nowners);
+void queue_pop(queue_t *queue, size_t len);
+#define queue_filled(queue)	g_atomic_int_get(&(queue)->filled)
+int queue_frontv(queue_t *queue, struct iovec *iov, int iovmax);
+void queue_stamp(queue_t *queue, GstClockTime timestamp);
+int queue_level(queue_t *queue);
+int queue_admit(queue_t *queue, gint no_write);
+void queue_notify(GstElement *sink, queue_t *queue);
+
+/* scatter-gather helpers for the writev based write path. A frame is collected
+ * as iovec array (PES header, codec data, payload, ...) and iov_advance is used
+ * to skip the bytes the driver accepted on partial writes */
+
+#define IOV_MAX_FRAME	8
+/* segments of one PES packet, writev takes up to IOV_MAX so a packet is only
+ * split at PES_MAX_LENGTH. Converted AVC has two per NAL unit */
+#ifdef IOV_MAX
+#define IOV_MAX_PES	IOV_MAX
+#else
+#define IOV_MAX_PES	1024
+#endif
+
+void iov_add(struct iovec *iov, int *iovcnt, const void *base, size_t len);
+size_t iov_length(const struct iovec *iov, int iovcnt);
+void iov_advance(struct iovec **iov, int *iovcnt, size_t bytes);
+
+/* PES packetizer: splits a payload into PES packets that fit the 16 bit
+ * length field instead of writing one unbounded packet. The first packet gets
+ * the header built by the sink (start code, stream id, flags, PTS/DTS), the
+ * following ones a minimal header of the same stream without timestamps, so
+ * the decoder can start on a large frame before all of it arrived. */
+
+#define PES_MAX_LENGTH	0xFFFF
+#define PES_MIN_HEADER	9
+#define PES_HEADER_LEN(header)	(PES_MIN_HEADER + (header)[8])
+
+typedef struct pes
+{
+	guint8 *header;		/* first header, the length field is filled in */
+	size_t header_len;
+	guint8 cont[PES_MIN_HEADER];	/* header of the following packets */
+	struct iovec *iov;	/* remaining payload, advanced in place */
+	int iovcnt;
+	int count;		/* packets returned so far */
+} pes_t;
+
+void pes_init(pes_t *pes, guint8 *header, size_t header_len, struct iovec *payload, int payloadcnt);
+int pes_next(pes_t *pes, struct iovec *out, int outmax);
+/* writes a 33 bit 90kHz timestamp in the 5 byte PES format, prefix is
+ * 0x21 (PTS only), 0x31 (PTS followed by DTS) or 0x11 (DTS) */
+void pes_put_timestamp(guint8 *out, guint8 prefix, guint64 ts);
+
+/* start code scanner of the video parsers: returns the offset of the first
+ * 00 00 01 at or after pos, len when there is none. Never reads data[len] or
+ * beyond, a returned offset has its three bytes inside the buffer, the code
+ * byte behind them may not be */
+size_t startcode_find(const guint8 *data, size_t len, size_t pos);
+
+/* MSB first bit reader/writer of the header parsers. Reading keeps up to 64
+ * bits in the cache, refilled by unaligned big endian loads; reads past the
+ * end return zeros and show up in bitstream_overread. Writing stores every
+ * completed byte, bitstream_flush pads the last one with zeros and no byte is
+ * stored beyond the end. get/put take at most 32 bits */
+
+typedef struct bitstream
+{
+	guint8 *data;		/* next byte to load / store */
+	const guint8 *end;
+	guint64 cache;		/* read: bits left aligned, write: pending bits right aligned */
+	int avail;		/* bits in the cache */
+	size_t pos;		/* bits read / written since init */
+	size_t size;		/* in bits */
+} bitstream_t;
+
+#define bitstream_tell(bit)	((bit)->pos)
+#define bitstream_overread(bit)	((bit)->pos > (bit)->size)
+
+static inline void bitstream_init(bitstream_t *bit, const void *buffer, size_t len, gboolean wr)
+{
+	(void)wr;	// the same state serves both directions
+	bit->data = (guint8*) buffer;
+	bit->end = bit->data + len;
+	bit->cache = 0;
+	bit->avail = 0;
+	bit->pos = 0;
+	bit->size = len * 8;
+}
+
+static inline void bitstream_refill(bitstream_t *bit)
+{
+	if (bit->end - bit->data >= 8) {
+		int bytes = (64 - bit->avail) >> 3;
+		guint64 val;
+		memcpy(&val, bit->data, 8);
+		val = GUINT64_FROM_BE(val) & (~G_GUINT64_CONSTANT(0) << (64 - bytes * 8));
+		bit->cache |= val >> bit->avail;
+		bit->data += bytes;
+		bit->avail += bytes * 8;
+	}
+	else {
+		while (bit->avail <= 56) {
+			guint64 byte = bit->data < bit->end ? *bit->data++ : 0;
+			bit->cache |= byte << (56 - bit->avail);
+			bit->avail += 8;
+		}
+	}
+}
+
+static inline guint32 bitstream_get(bitstream_t *bit, int bits)
+{
+	guint32 res;
+
+	if (bits <= 0)
+		return 0;
+	if (bit->avail < bits)
+		bitstream_refill(bit);
+	res = bit->cache >> (64 - bits);
+	bit->cache <<= bits;
+	bit->avail -= bits;
+	bit->pos += bits;
+	return res;
+}
+
+/* Exp-Golomb codes, the prefix is counted in the cache */
+static inline guint32 bitstream_get_ue(bitstream_t *bit)
+{
+	int zeros;
+
+	if (bit->avail < 32)
+		bitstream_refill(bit);
+	zeros = __builtin_clzll(bit->cache | 1);
+	if (zeros >= 31) {	// longest code of 32 bits, the bit behind the prefix is taken as 1
+		bitstream_get(bit, 32);
+		return 0x7FFFFFFF + bitstream_get(bit, 31);
+	}
+	bitstream_get(bit, zeros);
+	return bitstream_get(bit, zeros + 1) - 1;
+}
+
+static inline gint32 bitstream_get_se(bitstream_t *bit)
+{
+	guint32 k = bitstream_get_ue(bit);
+	return (k & 1) ? (gint32)((k + 1) / 2) : -(gint32)(k / 2);
+}
+
+static inline void bitstream_put(bitstream_t *bit, guint32 val, int bits)
+{
+	if (bits <= 0)
+		return;
+	bit->cache = (bit->cache << bits) | (val & ((G_GUINT64_CONSTANT(1) << bits) - 1));
+	bit->avail += bits;
+	bit->pos += bits;
+	while (bit->avail >= 8) {
+		bit->avail -= 8;
+		if (bit->data < bit->end)
+			*bit->data++ = bit->cache >> bit->avail;
+	}
+}
+
+static inline void bitstream_flush(bitstream_t *bit)
+{
+	if (bit->avail)
+		bitstream_put(bit, 0, 8 - bit->avail);
+}
+
+/* PTS mapping: PES timestamps only have 33 bits (26.5 hours at 90kHz).
+ * Buffer timestamps are written relative to a base taken from the segment
+ * start, rounded down to half the PTS range so all sinks of a pipeline pick
+ * the same one and a stream starting at a large offset does not wrap early.
+ * Decoder PTS readings are unwrapped against the last reading (or the last
+ * written timestamp) and mapped back to buffer time with the same base. */
+
+#define PTS_WRAP	(G_GUINT64_CONSTANT(1) << 33)
+#define PTS_MASK	(PTS_WRAP - 1)
+
+typedef struct pts_map
+{
+	guint64 base;		/* 90kHz, subtracted before writing */
+	gboolean base_valid;
+	gint64 written;		/* last written timestamp, relative to base, unwrapped */
+	gint64 read;		/* last decoder reading, relative to base, unwrapped */
+	gboolean written_valid;
+	gboolean read_valid;
+} pts_map_t;
+
+void pts_map_init(pts_map_t *map);
+void pts_map_segment(pts_map_t *map, GstClockTime start);
+guint64 pts_map_convert(const pts_map_t *map, GstClockTime ts);
+guint64 pts_map_write(pts_map_t *map, GstClockTime ts);
+GstClockTime pts_map_to_time(pts_map_t *map, guint64 pts);
+
+/* write pacing: the driver accepts whatever fits into its buffer and signals
+ * POLLOUT again as soon as a little space is free, which leads to streams of
+ * tiny writes once the buffer is full. The pacer learns the rate at which the
+ * driver drains its buffer (from consecutive partial writes) and after a
+ * partial write defers the next POLLOUT until about min_write bytes should be
+ * free again. The statistics are kept even with pacing disabled. */
+
+#define PACER_MAX_DELAY	(40 * GST_MSECOND)
+
+typedef struct pacer
+{
+	guint min_write;	/* 0 = no pacing */
+	GstClockTime last_write;	/* time of the last accepted write */
+	GstClockTime last_full;		/* time of the last partial write */
+	GstClockTime resume;	/* no POLLOUT before this time */
+	guint64 avg_accept;	/* moving averages: bytes per write */
+	guint64 avg_interval;	/* ns between writes */
+	guint64 rate;		/* drain rate in bytes per second */
+	guint64 writes;
+	guint64 partial_writes;
+	guint64 bytes;
+	guint64 deferrals;
+} pacer_t;
+
+void pacer_init(pacer_t *pacer);
+void pacer_written(pacer_t *pacer, size_t len, int written);
+int pacer_delay(pacer_t *pacer);
+GstStructure *pacer_stats(pacer_t *pacer);
+
+/* writer thread: render() only packetizes and hands the data over to a per sink
+ * thread which owns poll() and write() on the decoder device. The handoff is a
+ * lock-free single-producer/single-consumer ring of records (length, flush
+ * generation, payload). A flush is delivered in-band by bumping the generation:
+ * the writer drops older records and clears the decoder before it writes the
+ * first record of the new generation. Data which doesn't fit into the ring
+ * while the sink is paused or unlocked goes to the pause queue, which the
+ * writer drains after the ring. */
+
+#define WRITER_RING_SIZE	(512*1024)
+
+typedef struct writer
+{
+	/* set up by the sink before writer_start */
+	GstObject *sink;
+	int fd;			/* decoder device */
+	short events;		/* additional poll events (POLLPRI) passed to event_cb */
+	int control_read;	/* streaming thread waits on this for space in the ring */
+	int control_write;
+	volatile gint *no_write;	/* write state of the sink */
+	queue_t *queue;		/* pause queue, protected by the object lock */
+	pacer_t *pacer;		/* owned by the writer while it runs */
+	void (*flush_cb) (GstObject *sink);
+	void (*event_cb) (GstObject *sink);
+	gboolean video;		/* fd is the video decoder, see writer_video_ioctl */
+
+	GThread *thread;
+	struct reactor *reactor;	/* shared reactor instead of an own thread */
+	int wake[2];
+	guint8 *ring;
+	guint size;
+	volatile gint head;	/* written by the streaming thread only */
+	volatile gint tail;	/* written by the writer thread only */
+	volatile gint generation;
+	volatile gint running;
+	volatile gint sleeping;	/* writer is idle and must be woken up for new data */
+	volatile gint waiting;	/* streaming thread waits for space or drain */
+	volatile gint error;
+	guint cur_generation;	/* owned by the writer */
+	guint offset;		/* bytes of the front record which are already written */
+} writer_t;
+
+#define writer_running(writer)	((writer)->thread != NULL || (writer)->reactor != NULL)
+
+void writer_init(writer_t *writer);
+gboolean writer_start(writer_t *writer, gboolean shared);
+void writer_stop(writer_t *writer);
+void writer_wakeup(writer_t *writer);
+void writer_flush(writer_t *writer);
+int writer_push(writer_t *writer, struct iovec *iov, int iovcnt, GstBuffer * const *owners, int nowners);
+gboolean writer_drain(writer_t *writer);
+/* ioctl on the video decoder of a writer serviced by the shared reactor, for
+ * the trick modes of the audio sink. FALSE when there is none */
+gboolean writer_video_ioctl(unsigned long request, unsigned long arg);
+
+/* io_uring backend for the streaming thread write loop: one io_uring_enter
+ * submits a poll on the device linked to the writev of the frame and waits
+ * for it, for the control socket or for decoder events. The control and event
+ * polls stay armed between calls. Falls back (uring_setup fails) when the
+ * kernel or the build lacks io_uring. */
+
+typedef struct uring
+{
+	int fd;
+	void *sq_ptr, *cq_ptr, *sqes;
+	size_t sq_len, cq_len, sqes_len;
+	unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+	unsigned *cq_head, *cq_tail, *cq_mask;
+	void *cqes;
+	unsigned pending;	/* bitmask of requests in flight */
+} uring_t;
+
+#define uring_running(uring)	((uring)->fd >= 0)
+
+void uring_init(uring_t *uring);
+gboolean uring_setup(uring_t *uring);
+void uring_free(uring_t *uring);
+int uring_poll_writev(uring_t *uring, int control_fd, int fd, short events,
+	const struct iovec *iov, int iovcnt, short revents[2], int *written);
+
+/* MPEG-TS output: instead of writing PES to the decoders, both sinks hand
+ * their PES packets to one process wide muxer which writes a transport stream
+ * with PAT/PMT and PCR to the DVR device (or a file). The hardware demux then
+ * feeds the decoders and locks the STC to the PCR like for live broadcast.
+ * Shared between the plugins like the reactor. */
+
+#define TS_PACKET_SIZE	188
+
+#define TSMUX_VIDEO	0
+#define TSMUX_AUDIO	1
+#define TSMUX_STREAMS	2
+
+#define TSMUX_PID_PMT	0x100
+#define TSMUX_PID_VIDEO	0x101
+#define TSMUX_PID_AUDIO	0x102
+#define TSMUX_PID_PCR	0x1FF
+
+typedef struct tsmux tsmux_t;
+
+tsmux_t *tsmux_get(const gchar *location, int stream);
+void tsmux_release(tsmux_t *mux, int stream);
+void tsmux_set_stream(tsmux_t *mux, int stream, guint8 stream_type);
+int tsmux_write(tsmux_t *mux, int stream, const struct iovec *iov, int iovcnt, int control_fd, volatile gint *no_write);
+int tsmux_open_filter(const gchar *location, int stream);
+
+GST_DEBUG_CATEGORY_EXTERN (dvbsink_common_debug);
+
+G_END_DECLS
+
+#endif /* __COMMON_H__ */
@@ -65,6 +65,7 @@
 #include <string.h>
 #include <sys/ioctl.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
 #include <linux/dvb/audio.h>
 #include <linux/dvb/video.h>
 #include <fcntl.h>
@@ -104,6 +105,21 @@ G_STMT_START {						\
 #endif
 
 #define PROP_LOCATION 99
+#define PROP_QUEUE_SIZE 100
+#define PROP_WRITER_THREAD 101
+#define PROP_MAX_COALESCE_BYTES 102
+#define PROP_MAX_COALESCE_LATENCY 103
+#define PROP_IO_URING 104
+#define PROP_SHARED_REACTOR 105
+#define PROP_QUEUE_MAX_BYTES 106
+#define PROP_QUEUE_MAX_TIME 107
+#define PROP_QUEUE_LOW_PERCENT 108
+#define PROP_QUEUE_LEAKY 109
+#define PROP_MIN_WRITE_SIZE 110
+#define PROP_WRITE_STATS 111
+#define PROP_TS_OUTPUT 112
+
+#define COALESCE_DEFAULT_LATENCY (50 * GST_MSECOND)
 
 GST_DEBUG_CATEGORY_STATIC (dvbaudiosink_debug);
 #define GST_CAT_DEFAULT dvbaudiosink_debug
@@ -114,49 +130,6 @@ enum
 	LAST_SIGNAL
 };
 
-typedef struct bitstream
-{
-	guint8 *data;
-	guint8 last;
-	int avail;
-	int processed_bits;
-} bitstream_t;
-
-static void bitstream_init(bitstream_t *bit, const void *buffer, gboolean wr)
-{
-	bit->data = (guint8*) buffer;
-	if (wr) {
-		bit->avail = 0;
-		bit->last = 0;
-	}
-	else {
-		bit->processed_bits = 0;
-		bit->avail = 8;
-		bit->last = *bit->data++;
-	}
-}
-
-static unsigned long bitstream_get(bitstream_t *bit, int bits)
-{
-	unsigned long res=0;
-	bit->processed_bits += bits;
-	while (bits)
-	{
-		unsigned int d=bits;
-		if (!bit->avail) {
-			bit->last = *bit->data++;
-			bit->avail = 8;
-		}
-		if (d > bit->avail)
-			d=bit->avail;
-		res<<=d;
-		res|=(bit->last>>(bit->avail-d))&~(-1<<d);
-		bit->avail-=d;
-		bits-=d;
-	}
-	return res;
-}
-
 static guint gst_dvbaudiosink_signals[LAST_SIGNAL] = { 0 };
 
 static guint AdtsSamplingRates[] = { 96000, 88200, 64000, 48000, 44100, 32000, 24000, 22050, 16000, 12000, 11025, 8000, 7350, 0 };
@@ -214,7 +187,8 @@ GST_STATIC_PAD_TEMPLATE (
 );
 
 #define DEBUG_INIT(bla) \
-	GST_DEBUG_CATEGORY_INIT (dvbaudiosink_debug, "dvbaudiosink", 0, "dvbaudiosink element");
+	GST_DEBUG_CATEGORY_INIT (dvbaudiosink_debug, "dvbaudiosink", 0, "dvbaudiosink element"); \
+	GST_DEBUG_CATEGORY_INIT (dvbsink_common_debug, "dvbaudiosink_common", 0, "dvbaudiosink writer");
 
 GST_BOILERPLATE_FULL (GstDVBAudioSink, gst_dvbaudiosink, GstBaseSink, GST_TYPE_BASE_SINK, DEBUG_INIT);
 
@@ -361,7 +335,7 @@ static void parse_aac_codec_data(GstDVBAudioSink *self, const GValue *codec_data
 	gint rate = 0, ext_rate = -1;
 	gint obj_type, rate_idx, channel_config, ext_obj_type=0, ext_rate_idx=0, is_sbr=0, is_ps=0;
 	bitstream_t bs;
-	bitstream_init (&bs, h, 0);
+	bitstream_init (&bs, h, l, 0);
 
 	obj_type = get_audio_object_type(&bs);
 	GST_INFO_OBJECT (self, "(1)obj_type %d", obj_type);
@@ -438,7 +412,7 @@ static void parse_aac_codec_data(GstDVBAudioSink *self, const GValue *codec_data
 		break;
 	}
 
-	if (ext_obj_type != 5 && max_bits - bs.processed_bits >= 16) {
+	if (ext_obj_type != 5 && max_bits - bitstream_tell(&bs) >= 16) {
 		if (bitstream_get(&bs, 11) == 0x2b7) {
 			gint tmp_obj_type = get_audio_object_type(&bs);
 			GST_INFO_OBJECT (self, "(3)temp_obj_type %d", tmp_obj_type);
@@ -452,7 +426,7 @@ static void parse_aac_codec_data(GstDVBAudioSink *self, const GValue *codec_data
 						ext_rate = bitstream_get(&bs, 24);
 						GST_INFO_OBJECT (self, "(3)ext_rate %d", ext_rate);
 					}
-					if (max_bits - bs.processed_bits >= 12) {
+					if (max_bits - bitstream_tell(&bs) >= 12) {
 						if (bitstream_get(&bs, 11) == 0x548) {
 							is_ps = bitstream_get(&bs, 1);
 							GST_INFO_OBJECT (self, "(3)is_ps %d", is_ps);
@@ -568,7 +542,17 @@ done:
 }
 
 static int
-gst_dvbaudiosink_async_write(GstDVBAudioSink *self, unsigned char *data, unsigned int len);
+gst_dvbaudiosink_async_write(GstDVBAudioSink *self, GstBuffer *buffer, struct iovec *iov, int iovcnt);
+static void
+gst_dvbaudiosink_writer_flush(GstObject *sink);
+static void
+gst_dvbaudiosink_video_trickmode(GstDVBAudioSink *self, int repeat, int skip);
+static int
+gst_dvbaudiosink_coalesce_flush(GstDVBAudioSink *self);
+static void
+gst_dvbaudiosink_coalesce_start(GstDVBAudioSink *self);
+static void
+gst_dvbaudiosink_coalesce_stop(GstDVBAudioSink *self);
 
 /* initialize the plugin's class */
 static void
@@ -585,6 +569,65 @@ gst_dvbaudiosink_class_init (GstDVBAudioSinkClass *klass)
 		g_param_spec_string ("dump-filename", "Dump File Location",
 			"Filename that Packetized Elementary Stream will be written to", NULL,
 			G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+	g_object_class_install_property (gobject_class, PROP_QUEUE_SIZE,
+		g_param_spec_uint ("queue-size", "Pause queue size",
+			"Initial size in bytes of the queue holding data while paused (grows on demand)",
+			4096, G_MAXUINT, QUEUE_DEFAULT_SIZE,
+			G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+	g_object_class_install_property (gobject_class, PROP_WRITER_THREAD,
+		g_param_spec_boolean ("writer-thread", "Writer thread",
+			"Write to the decoder from a dedicated thread instead of the streaming thread",
+			FALSE, G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+	g_object_class_install_property (gobject_class, PROP_IO_URING,
+		g_param_spec_boolean ("io-uring", "io_uring",
+			"Use io_uring instead of poll and writev for the decoder writes (falls back to poll when not available)",
+			FALSE, G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+	g_object_class_install_property (gobject_class, PROP_SHARED_REACTOR,
+		g_param_spec_boolean ("shared-reactor", "Shared reactor",
+			"Write to the decoder from one thread shared by all dvb sinks of the process (implies writer-thread)",
+			FALSE, G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+	g_object_class_install_property (gobject_class, PROP_MAX_COALESCE_BYTES,
+		g_param_spec_uint ("max-coalesce-bytes", "Max coalesce bytes",
+			"Collect complete PES packets up to this many bytes and write them at once (0 = disabled)",
+			0, G_MAXINT, 0,
+			G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+	g_object_class_install_property (gobject_class, PROP_MAX_COALESCE_LATENCY,
+		g_param_spec_uint64 ("max-coalesce-latency", "Max coalesce latency",
+			"Write the collected PES packets once they span this much stream time in ns (0 = no limit)",
+			0, G_MAXUINT64, COALESCE_DEFAULT_LATENCY,
+			G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+	g_object_class_install_property (gobject_class, PROP_QUEUE_MAX_BYTES,
+		g_param_spec_uint ("queue-max-bytes", "Pause queue max bytes",
+			"High watermark of the pause queue in bytes (0 = unlimited)",
+			0, G_MAXUINT, 0,
+			G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+	g_object_class_install_property (gobject_class, PROP_QUEUE_MAX_TIME,
+		g_param_spec_uint64 ("queue-max-time", "Pause queue max time",
+			"High watermark of the pause queue in ns of stream time (0 = unlimited)",
+			0, G_MAXUINT64, 0,
+			G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+	g_object_class_install_property (gobject_class, PROP_QUEUE_LOW_PERCENT,
+		g_param_spec_uint ("queue-low-percent", "Pause queue low watermark",
+			"Level in percent of the high watermark below which the queue is reported as not full again",
+			0, 100, QUEUE_DEFAULT_LOW_PERCENT,
+			G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+	g_object_class_install_property (gobject_class, PROP_QUEUE_LEAKY,
+		g_param_spec_boolean ("queue-leaky", "Leaky pause queue",
+			"Drop new data when the pause queue is full instead of blocking",
+			FALSE, G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+	g_object_class_install_property (gobject_class, PROP_MIN_WRITE_SIZE,
+		g_param_spec_uint ("min-write-size", "Minimum write size",
+			"After the decoder accepted only part of a write, wait until about this many bytes should be free again at the learned drain rate (0 = write as soon as possible)",
+			0, G_MAXINT, 0,
+			G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+	g_object_class_install_property (gobject_class, PROP_WRITE_STATS,
+		g_param_spec_boxed ("write-stats", "Write statistics",
+			"Decoder write statistics and the learned drain rate",
+			GST_TYPE_STRUCTURE, G_PARAM_READABLE | G_PARAM_STATIC_STRINGS));
+	g_object_class_install_property (gobject_class, PROP_TS_OUTPUT,
+		g_param_spec_string ("ts-output", "TS output",
+			"Write an MPEG-TS to this DVR device (or file) instead of PES to the decoder, shared with the video sink (NULL = off)",
+			NULL, G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
 
 	gstbasesink_class->start = GST_DEBUG_FUNCPTR (gst_dvbaudiosink_start);
 	gstbasesink_class->stop = GST_DEBUG_FUNCPTR (gst_dvbaudiosink_stop);
@@ -624,10 +667,33 @@ gst_dvbaudiosink_init (GstDVBAudioSink *klass, GstDVBAudioSinkClass * gclass)
 	klass->temp_bytes = 0;
 
 	klass->no_write = 0;
-	klass->queue = NULL;
+	queue_init(&klass->queue);
+	klass->queue_size = QUEUE_DEFAULT_SIZE;
+	klass->use_writer_thread = FALSE;
+	klass->use_io_uring = FALSE;
+	klass->use_shared_reactor = FALSE;
+	uring_init(&klass->uring);
+	pacer_init(&klass->pacer);
+	pts_map_init(&klass->pts_map);
+	klass->max_coalesce_bytes = 0;
+	klass->max_coalesce_latency = COALESCE_DEFAULT_LATENCY;
+	klass->coalesce_data = NULL;
+	klass->coalesce_bytes = 0;
+	klass->coalesce_size = 0;
+	klass->coalesce_start = GST_CLOCK_TIME_NONE;
+	klass->coalesce_lock = g_mutex_new();
+	klass->coalesce_cond = g_cond_new();
+	klass->coalesce_thread = NULL;
+	klass->coalesce_running = FALSE;
+	klass->coalesce_deadline = GST_CLOCK_TIME_NONE;
+	writer_init(&klass->writer);
+	klass->writer.flush_cb = gst_dvbaudiosink_writer_flush;
 	klass->fd = -1;
 	klass->dump_fd = -1;
 	klass->dump_filename = NULL;
+	klass->ts_output = NULL;
+	klass->tsmux = NULL;
+	klass->ts_filter = -1;
 
 	gst_base_sink_set_sync (GST_BASE_SINK(klass), FALSE);
 	gst_base_sink_set_async_enabled (GST_BASE_SINK(klass), TRUE);
@@ -678,6 +744,16 @@ gst_dvbaudiosink_dispose (GObject * object)
 			self->dump_filename = NULL;
 	}
 
+	g_free(self->ts_output);
+	self->ts_output = NULL;
+
+	if (self->coalesce_lock) {
+		g_mutex_free(self->coalesce_lock);
+		g_cond_free(self->coalesce_cond);
+		self->coalesce_lock = NULL;
+		self->coalesce_cond = NULL;
+	}
+
 	G_OBJECT_CLASS (parent_class)->dispose (object);
 }
 
@@ -715,6 +791,61 @@ gst_dvbaudiosink_set_property (GObject * object, guint prop_id, const GValue * v
 		case PROP_LOCATION:
 		gst_dvbaudiosink_set_location (sink, g_value_get_string (value));
 		break;
+		case PROP_QUEUE_SIZE:
+		GST_OBJECT_LOCK(sink);
+		sink->queue_size = g_value_get_uint (value);
+		GST_OBJECT_UNLOCK(sink);
+		break;
+		case PROP_WRITER_THREAD:
+		sink->use_writer_thread = g_value_get_boolean (value);
+		break;
+		case PROP_IO_URING:
+		sink->use_io_uring = g_value_get_boolean (value);
+		break;
+		case PROP_SHARED_REACTOR:
+		sink->use_shared_reactor = g_value_get_boolean (value);
+		break;
+		case PROP_MAX_COALESCE_BYTES:
+		GST_OBJECT_LOCK(sink);
+		sink->max_coalesce_bytes = g_value_get_uint (value);
+		GST_OBJECT_UNLOCK(sink);
+		break;
+		case PROP_MAX_COALESCE_LATENCY:
+		GST_OBJECT_LOCK(sink);
+		sink->max_coalesce_latency = g_value_get_uint64 (value);
+		GST_OBJECT_UNLOCK(sink);
+		break;
+		case PROP_QUEUE_MAX_BYTES:
+		GST_OBJECT_LOCK(sink);
+		sink->queue.max_bytes = g_value_get_uint (value);
+		GST_OBJECT_UNLOCK(sink);
+		break;
+		case PROP_QUEUE_MAX_TIME:
+		GST_OBJECT_LOCK(sink);
+		sink->queue.max_time = g_value_get_uint64 (value);
+		GST_OBJECT_UNLOCK(sink);
+		break;
+		case PROP_QUEUE_LOW_PERCENT:
+		GST_OBJECT_LOCK(sink);
+		sink->queue.low_percent = g_value_get_uint (value);
+		GST_OBJECT_UNLOCK(sink);
+		break;
+		case PROP_QUEUE_LEAKY:
+		GST_OBJECT_LOCK(sink);
+		sink->queue.leaky = g_value_get_boolean (value);
+		GST_OBJECT_UNLOCK(sink);
+		break;
+		case PROP_MIN_WRITE_SIZE:
+		GST_OBJECT_LOCK(sink);
+		sink->pacer.min_write = g_value_get_uint (value);
+		GST_OBJECT_UNLOCK(sink);
+		break;
+		case PROP_TS_OUTPUT:
+		GST_OBJECT_LOCK(sink);
+		g_free(sink->ts_output);
+		sink->ts_output = g_strdup (g_value_get_string (value));
+		GST_OBJECT_UNLOCK(sink);
+		break;
 		default:
 		G_OBJECT_WARN_INVALID_PROPERTY_ID (object, prop_id, pspec);
 		break;
@@ -730,6 +861,47 @@ gst_dvbaudiosink_get_property (GObject * object, guint prop_id, GValue * value,
 		case PROP_LOCATION:
 		g_value_set_string (value, sink->dump_filename);
 		break;
+		case PROP_QUEUE_SIZE:
+		g_value_set_uint (value, sink->queue_size);
+		break;
+		case PROP_WRITER_THREAD:
+		g_value_set_boolean (value, sink->use_writer_thread);
+		break;
+		case PROP_IO_URING:
+		g_value_set_boolean (value, sink->use_io_uring);
+		break;
+		case PROP_SHARED_REACTOR:
+		g_value_set_boolean (value, sink->use_shared_reactor);
+		break;
+		case PROP_MAX_COALESCE_BYTES:
+		g_value_set_uint (value, sink->max_coalesce_bytes);
+		break;
+		case PROP_MAX_COALESCE_LATENCY:
+		g_value_set_uint64 (value, sink->max_coalesce_latency);
+		break;
+		case PROP_QUEUE_MAX_BYTES:
+		g_value_set_uint (value, sink->queue.max_bytes);
+		break;
+		case PROP_QUEUE_MAX_TIME:
+		g_value_set_uint64 (value, sink->queue.max_time);
+		break;
+		case PROP_QUEUE_LOW_PERCENT:
+		g_value_set_uint (value, sink->queue.low_percent);
+		break;
+		case PROP_QUEUE_LEAKY:
+		g_value_set_boolean (value, sink->queue.leaky);
+		break;
+		case PROP_MIN_WRITE_SIZE:
+		g_value_set_uint (value, sink->pacer.min_write);
+		break;
+		case PROP_WRITE_STATS:
+		g_value_take_boxed (value, pacer_stats(&sink->pacer));
+		break;
+		case PROP_TS_OUTPUT:
+		GST_OBJECT_LOCK(sink);
+		g_value_set_string (value, sink->ts_output);
+		GST_OBJECT_UNLOCK(sink);
+		break;
 		default:
 		G_OBJECT_WARN_INVALID_PROPERTY_ID (object, prop_id, pspec);
 		break;
@@ -741,19 +913,15 @@ gst_dvbaudiosink_get_decoder_time (GstDVBAudioSink *self)
 {
 	if (self->bypass != -1 && self->fd > -1) {
 		gint64 cur = 0;
-		static gint64 last_pos = 0;
+		GstClockTime time;
 
 		ioctl(self->fd, AUDIO_GET_PTS, &cur);
 
-		/* workaround until driver fixed */
-		if (cur)
-			last_pos = cur;
-		else
-			cur = last_pos;
-
-		cur *= 11111;
+		GST_OBJECT_LOCK(self);
+		time = pts_map_to_time(&self->pts_map, cur);
+		GST_OBJECT_UNLOCK(self);
 
-		return cur;
+		return time;
 	}
 	return GST_CLOCK_TIME_NONE;
 }
@@ -762,10 +930,9 @@ static gboolean
 gst_dvbaudiosink_unlock (GstBaseSink * basesink)
 {
 	GstDVBAudioSink *self = GST_DVBAUDIOSINK (basesink);
-	GST_OBJECT_LOCK(self);
-	self->no_write |= 2;
-	GST_OBJECT_UNLOCK(self);
+	write_state_set(&self->no_write, WRITE_UNLOCKED);
 	SEND_COMMAND (self, CONTROL_STOP);
+	writer_wakeup(&self->writer);
 	GST_DEBUG_OBJECT (basesink, "unlock");
 	return TRUE;
 }
@@ -774,13 +941,35 @@ static gboolean
 gst_dvbaudiosink_unlock_stop (GstBaseSink * basesink)
 {
 	GstDVBAudioSink *self = GST_DVBAUDIOSINK (basesink);
-	GST_OBJECT_LOCK(self);
-	self->no_write &= ~2;
-	GST_OBJECT_UNLOCK(self);
+	write_state_clear(&self->no_write, WRITE_UNLOCKED);
+	writer_wakeup(&self->writer);
 	GST_DEBUG_OBJECT (basesink, "unlock_stop");
 	return TRUE;
 }
 
+/* stream_type of the PMT for a bypass mode, the demux only goes by pid */
+static guint8 gst_dvbaudiosink_ts_stream_type(int bypass)
+{
+	switch (bypass) {
+	case 0x1:
+	case 0xA:
+		return 0x03;	// MPEG audio
+	case 0xb:
+		return 0x0F;	// AAC ADTS
+	case 0x9:
+		return 0x11;	// AAC LATM
+	case 0x0:
+		return 0x81;	// AC3
+	case 0x7:
+		return 0x87;	// E-AC3
+	case 0x2:
+		return 0x82;	// DTS
+	case 0x6:
+		return 0x80;	// LPCM
+	default:
+		return 0x06;
+	}
+}
 
 static gboolean
 gst_dvbaudiosink_set_caps (GstBaseSink * basesink, GstCaps * caps)
@@ -1053,51 +1242,11 @@ gst_dvbaudiosink_set_caps (GstBaseSink * basesink, GstCaps * caps)
 // 		return FALSE;
 	}
 	self->bypass = bypass;
+	if (self->tsmux)
+		tsmux_set_stream(self->tsmux, TSMUX_AUDIO, gst_dvbaudiosink_ts_stream_type(bypass));
 	return TRUE;
 }
 
-static void
-queue_push(queue_entry_t **queue_base, guint8 *data, size_t len)
-{
-	queue_entry_t *entry = malloc(sizeof(queue_entry_t)+len);
-	queue_entry_t *last = *queue_base;
-	guint8 *d = (guint8*)(entry+1);
-	memcpy(d, data, len);
-	entry->bytes = len;
-	entry->offset = 0;
-	if (!last)
-		*queue_base = entry;
-	else {
-		while(last->next)
-			last = last->next;
-		last->next = entry;
-	}
-	entry->next = NULL;
-}
-
-static void
-queue_pop(queue_entry_t **queue_base)
-{
-	queue_entry_t *base = *queue_base;
-	*queue_base = base->next;
-	free(base);
-}
-
-static int
-queue_front(queue_entry_t **queue_base, guint8 **data, size_t *bytes)
-{
-	if (!*queue_base) {
-		*bytes = 0;
-		*data = 0;
-	}
-	else {
-		queue_entry_t *entry = *queue_base;
-		*bytes = entry->bytes - entry->offset;
-		*data = ((guint8*)(entry+1))+entry->offset;
-	}
-	return *bytes;
-}
-
 static gboolean
 gst_dvbaudiosink_event (GstBaseSink * sink, GstEvent * event)
 {
@@ -1108,18 +1257,27 @@ gst_dvbaudiosink_event (GstBaseSink * sink, GstEvent * event)
 	switch (GST_EVENT_TYPE (event)) {
 	case GST_EVENT_FLUSH_START:
 		GST_OBJECT_LOCK(self);
-		self->no_write |= 1;
+		write_state_set(&self->no_write, WRITE_FLUSHING);
+		self->coalesce_bytes = 0;
 		GST_OBJECT_UNLOCK(self);
 		SEND_COMMAND (self, CONTROL_STOP);
+		writer_wakeup(&self->writer);
 		break;
 	case GST_EVENT_FLUSH_STOP:
-		ioctl(self->fd, AUDIO_CLEAR_BUFFER);
+		if (!writer_running(&self->writer))
+			ioctl(self->fd, AUDIO_CLEAR_BUFFER);
+		/* without a writer thread the coalesce timer may use the queue */
+		g_mutex_lock(self->coalesce_lock);
 		GST_OBJECT_LOCK(self);
-		while(self->queue)
-			queue_pop(&self->queue);
+		queue_clear(&self->queue);
+		self->coalesce_bytes = 0;
 		self->timestamp = GST_CLOCK_TIME_NONE;
-		self->no_write &= ~1;
+		pts_map_init(&self->pts_map);
+		write_state_clear(&self->no_write, WRITE_FLUSHING);
+		writer_flush(&self->writer);
 		GST_OBJECT_UNLOCK(self);
+		g_mutex_unlock(self->coalesce_lock);
+		queue_notify(GST_ELEMENT(self), &self->queue);
 		break;
 	case GST_EVENT_EOS:
 	{
@@ -1129,13 +1287,27 @@ gst_dvbaudiosink_event (GstBaseSink * sink, GstEvent * event)
 		if (self->fd < 0)
 			break;
 
+		switch (gst_dvbaudiosink_coalesce_flush(self)) {
+		case -1:
+		case -3:
+			GST_WARNING_OBJECT (self, "failed to write coalesced data: %s", g_strerror (errno));
+			ret=FALSE;
+			break;
+		default:
+			break;
+		}
+
 		pfd[0].fd = READ_SOCKET(self);
 		pfd[0].events = POLLIN;
 		pfd[1].fd = self->fd;
 		pfd[1].events = POLLIN;
 
 		GST_PAD_PREROLL_UNLOCK (sink->sinkpad);
-		while (1) {
+		if (!writer_drain(&self->writer)) {
+			GST_DEBUG_OBJECT (self, "wait EOS aborted!!\n");
+			ret=FALSE;
+		}
+		while (ret) {
 			retval = poll(pfd, 2, 250);
 			if (retval < 0) {
 				perror("poll in EVENT_EOS");
@@ -1174,17 +1346,15 @@ gst_dvbaudiosink_event (GstBaseSink * sink, GstEvent * event)
 		GST_DEBUG_OBJECT (self, "GST_EVENT_NEWSEGMENT rate=%f applied_rate=%f\n", rate, applied_rate);
 
 		if (fmt == GST_FORMAT_TIME) {
-			int video_fd = open("/dev/dvb/adapter0/video0", O_RDWR);
-			if (video_fd >= 0) {
-				if ( rate > 1 )
-					skip = (int) rate;
-				else if ( rate < 1 )
-					repeat = 1.0/rate;
-				ioctl(video_fd, VIDEO_SLOWMOTION, repeat);
-				ioctl(video_fd, VIDEO_FAST_FORWARD, skip);
-//				gst_segment_set_newsegment_full (&dec->segment, update, rate, applied_rate, dformat, cur, stop, time);
-				close(video_fd);
-			}
+			GST_OBJECT_LOCK(self);
+			pts_map_segment(&self->pts_map, cur);
+			GST_OBJECT_UNLOCK(self);
+			if ( rate > 1 )
+				skip = (int) rate;
+			else if ( rate < 1 )
+				repeat = 1.0/rate;
+			gst_dvbaudiosink_video_trickmode(self, repeat, skip);
+//			gst_segment_set_newsegment_full (&dec->segment, update, rate, applied_rate, dformat, cur, stop, time);
 		}
 		break;
 	}
@@ -1196,42 +1366,140 @@ gst_dvbaudiosink_event (GstBaseSink * sink, GstEvent * event)
 	return ret;
 }
 
-#define ASYNC_WRITE(data, len) do { \
-		switch(gst_dvbaudiosink_async_write(self, data, len)) { \
+/* the trick modes are set on the video decoder.. through the video sink's
+ * writer when the shared reactor services it, else on a device of our own */
+static void
+gst_dvbaudiosink_video_trickmode(GstDVBAudioSink *self, int repeat, int skip)
+{
+	int video_fd;
+
+	if (writer_video_ioctl(VIDEO_SLOWMOTION, repeat)) {
+		writer_video_ioctl(VIDEO_FAST_FORWARD, skip);
+		return;
+	}
+	video_fd = open("/dev/dvb/adapter0/video0", O_RDWR);
+	if (video_fd >= 0) {
+		ioctl(video_fd, VIDEO_SLOWMOTION, repeat);
+		ioctl(video_fd, VIDEO_FAST_FORWARD, skip);
+		close(video_fd);
+	}
+}
+
+/* called from the writer thread */
+static void
+gst_dvbaudiosink_writer_flush(GstObject *sink)
+{
+	ioctl(GST_DVBAUDIOSINK (sink)->fd, AUDIO_CLEAR_BUFFER);
+}
+
+/* the coalesce timer thread writes too, so the lock is taken around every
+ * write of the streaming thread */
+#define ASYNC_WRITE(iov, iovcnt) do { \
+		int _ret; \
+		g_mutex_lock(self->coalesce_lock); \
+		_ret = gst_dvbaudiosink_async_write(self, buffer, iov, iovcnt); \
+		g_mutex_unlock(self->coalesce_lock); \
+		switch(_ret) { \
 		case -1: goto poll_error; \
 		case -3: goto write_error; \
 		default: break; \
 		} \
 	} while(0)
 
+/* writes the whole iovec array with writev.. the array is modified to keep
+ * track of partial writes. Data of 'buffer' is queued by reference while
+ * paused, everything else (PES header, temp_buffer) is copied */
 static int
-gst_dvbaudiosink_async_write(GstDVBAudioSink *self, unsigned char *data, unsigned int len)
+gst_dvbaudiosink_async_write(GstDVBAudioSink *self, GstBuffer *buffer, struct iovec *iov, int iovcnt)
 {
-	unsigned int written=0;
 	struct pollfd pfd[2];
+	short revents[2];
+	gboolean queued;
+	gint no_write;
+	int wr, delay;
+
+	if (writer_running(&self->writer)) {
+		if (self->dump_fd > 0 && !(write_state_get(&self->no_write) & WRITE_FLUSHING))
+			writev(self->dump_fd, iov, iovcnt);
+		return writer_push(&self->writer, iov, iovcnt, &buffer, 1);
+	}
 
 	pfd[0].fd = READ_SOCKET(self);
 	pfd[0].events = POLLIN;
 	pfd[1].fd = self->fd;
 	pfd[1].events = POLLOUT;
 
-	do {
+	iov_advance(&iov, &iovcnt, 0); // skip empty segments
+
+	while (iovcnt) {
 loop_start:
-		if (self->no_write & 1) {
-			GST_DEBUG_OBJECT (self, "skip %d bytes", len - written);
+		no_write = write_state_get(&self->no_write);
+		if (no_write & WRITE_FLUSHING) {
+			GST_DEBUG_OBJECT (self, "skip %d bytes", (int)iov_length(iov, iovcnt));
 			break;
 		}
-		else if (self->no_write & 6) {
+		else if (no_write & WRITE_QUEUE) {
 			// directly push to queue
-			GST_OBJECT_LOCK(self);
-			queue_push(&self->queue, data + written, len - written);
-			GST_OBJECT_UNLOCK(self);
-			GST_DEBUG_OBJECT (self, "pushed %d bytes to queue", len - written);
+			int admit = queue_admit(&self->queue, no_write);
+			if (admit == QUEUE_PUSH) {
+				queue_pushv(&self->queue, iov, iovcnt, &buffer, 1);
+				if (buffer)
+					queue_stamp(&self->queue, GST_BUFFER_TIMESTAMP(buffer));
+			}
+			if (admit == QUEUE_BLOCK) {
+				/* over the high watermark, wait for a state change */
+				GST_DEBUG_OBJECT (self, "queue full, wait for resume");
+				if (poll(pfd, 1, -1) == -1 && errno != EINTR)
+					return -1;
+				if (pfd[0].revents & POLLIN) {
+					gchar command;
+					int res;
+					do
+						READ_COMMAND (self, command, res);
+					while (res >= 0);
+				}
+				goto loop_start;
+			}
+			if (admit == QUEUE_DROP)
+				GST_DEBUG_OBJECT (self, "queue full, dropped %d bytes", (int)iov_length(iov, iovcnt));
+			else {
+				GST_DEBUG_OBJECT (self, "pushed %d bytes to queue", (int)iov_length(iov, iovcnt));
+				queue_notify(GST_ELEMENT(self), &self->queue);
+			}
 			break;
 		}
 		else
-			GST_LOG_OBJECT (self, "going into poll, have %d bytes to write", len - written);
-		if (poll(pfd, 2, -1) == -1) {
+			GST_LOG_OBJECT (self, "going into poll, have %d bytes to write", (int)iov_length(iov, iovcnt));
+		/* the decoder buffer was full, give it time to drain */
+		delay = pacer_delay(&self->pacer);
+		pfd[1].events = delay ? 0 : POLLOUT;
+		if (uring_running(&self->uring) && !delay) {
+			/* the data is only written directly when nothing is queued */
+			queued = queue_filled(&self->queue);
+			switch (uring_poll_writev(&self->uring, pfd[0].fd, pfd[1].fd, 0,
+				queued ? NULL : iov, iovcnt, revents, &wr)) {
+			case -1:
+				return -1;
+			case 1:
+				/* pending commands show up again in the next iteration */
+				if (wr >= 0 || errno == EAGAIN)
+					pacer_written(&self->pacer, iov_length(iov, iovcnt), MAX(wr, 0));
+				if (wr < 0) {
+					if (errno == EINTR || errno == EAGAIN)
+						continue;
+					return -3;
+				}
+				if ( self->dump_fd > 0 )
+						writev(self->dump_fd, iov, iovcnt);
+				iov_advance(&iov, &iovcnt, wr);
+				continue;
+			default:
+				pfd[0].revents = revents[0];
+				pfd[1].revents = revents[1];
+				break;
+			}
+		}
+		else if (poll(pfd, 2, delay ? delay : -1) == -1) {
 			if (errno == EINTR)
 				continue;
 			return -1;
@@ -1250,38 +1518,36 @@ loop_start:
 			}
 		}
 		if (pfd[1].revents & POLLOUT) {
-			size_t queue_entry_size;
-			guint8 *queue_data;
-			GST_OBJECT_LOCK(self);
-			if (queue_front(&self->queue, &queue_data, &queue_entry_size)) {
-				int wr = write(self->fd, queue_data, queue_entry_size);
+			struct iovec qiov[IOV_MAX_FRAME];
+			int qiovcnt;
+			qiovcnt = queue_frontv(&self->queue, qiov, IOV_MAX_FRAME);
+			if (qiovcnt) {
+				int wr = writev(self->fd, qiov, qiovcnt);
+				if (wr >= 0 || errno == EAGAIN)
+					pacer_written(&self->pacer, iov_length(qiov, qiovcnt), MAX(wr, 0));
 				if ( self->dump_fd > 0 )
-						write(self->dump_fd, queue_data, queue_entry_size);
+						writev(self->dump_fd, qiov, qiovcnt);
 				if (wr < 0) {
 					switch (errno) {
 						case EINTR:
 						case EAGAIN:
 							break;
 						default:
-							GST_OBJECT_UNLOCK(self);
 							return -3;
 					}
 				}
-				else if (wr == queue_entry_size) {
-					queue_pop(&self->queue);
-					GST_DEBUG_OBJECT (self, "written %d queue bytes... pop entry", wr);
-				}
 				else {
-					self->queue->offset += wr;
-					GST_DEBUG_OBJECT (self, "written %d queue bytes... update offset", wr);
+					queue_pop(&self->queue, wr);
+					GST_DEBUG_OBJECT (self, "written %d queue bytes... %d left", wr, (int)self->queue.bytes);
+					queue_notify(GST_ELEMENT(self), &self->queue);
 				}
-				GST_OBJECT_UNLOCK(self);
 				continue;
 			}
-			GST_OBJECT_UNLOCK(self);
-			int wr = write(self->fd, data+written, len - written);
+			wr = writev(self->fd, iov, iovcnt);
+			if (wr >= 0 || errno == EAGAIN)
+				pacer_written(&self->pacer, iov_length(iov, iovcnt), MAX(wr, 0));
 			if ( self->dump_fd > 0 )
-					write(self->dump_fd, data+written, len - written);
+					writev(self->dump_fd, iov, iovcnt);
 			if (wr < 0) {
 				switch (errno) {
 					case EINTR:
@@ -1291,13 +1557,200 @@ loop_start:
 						return -3;
 				}
 			}
-			written += wr;
+			iov_advance(&iov, &iovcnt, wr);
 		}
-	} while (written != len);
+	}
 
 	return 0;
 }
 
+/* append one complete PES packet to the coalescing buffer.. returns TRUE when
+ * the collected packets have to be written now */
+static gboolean
+gst_dvbaudiosink_coalesce_push(GstDVBAudioSink *self, GstBuffer *buffer, struct iovec *iov, int iovcnt)
+{
+	GstClockTime timestamp = GST_BUFFER_TIMESTAMP(buffer);
+	GstClockTime duration = GST_BUFFER_DURATION(buffer);
+	size_t len = iov_length(iov, iovcnt);
+	gboolean flush;
+	int i;
+
+	if (!self->coalesce_thread && self->max_coalesce_latency)
+		gst_dvbaudiosink_coalesce_start(self);
+
+	g_mutex_lock(self->coalesce_lock);
+	GST_OBJECT_LOCK(self);
+	if (self->coalesce_bytes + len > self->coalesce_size) {
+		size_t size = MAX(self->coalesce_size, self->max_coalesce_bytes);
+		while (size < self->coalesce_bytes + len)
+			size *= 2;
+		self->coalesce_data = g_realloc(self->coalesce_data, size);
+		self->coalesce_size = size;
+	}
+	if (!self->coalesce_bytes) {
+		self->coalesce_start = timestamp;
+		/* the timestamps only tell when the next packet is due, the timer
+		 * enforces the budget when the next packet is late */
+		if (self->coalesce_thread) {
+			self->coalesce_deadline = gst_util_get_timestamp() + self->max_coalesce_latency;
+			g_cond_signal(self->coalesce_cond);
+		}
+	}
+	for (i = 0; i < iovcnt; ++i) {
+		memcpy(self->coalesce_data + self->coalesce_bytes, iov[i].iov_base, iov[i].iov_len);
+		self->coalesce_bytes += iov[i].iov_len;
+	}
+	flush = self->coalesce_bytes >= self->max_coalesce_bytes;
+	if (!flush && self->max_coalesce_latency && self->coalesce_start != GST_CLOCK_TIME_NONE &&
+		timestamp != GST_CLOCK_TIME_NONE && duration != GST_CLOCK_TIME_NONE)
+		flush = timestamp + duration >= self->coalesce_start + self->max_coalesce_latency;
+	GST_OBJECT_UNLOCK(self);
+	g_mutex_unlock(self->coalesce_lock);
+
+	return flush;
+}
+
+/* write the collected PES packets, called with the coalesce lock held.. the
+ * storage is only written with that lock, so it can be used without the
+ * object lock once coalesce_bytes was reset */
+static int
+gst_dvbaudiosink_coalesce_write(GstDVBAudioSink *self)
+{
+	struct iovec iov[1];
+	int iovcnt = 0;
+
+	GST_OBJECT_LOCK(self);
+	iov_add(iov, &iovcnt, self->coalesce_data, self->coalesce_bytes);
+	self->coalesce_bytes = 0;
+	self->coalesce_deadline = GST_CLOCK_TIME_NONE;
+	GST_OBJECT_UNLOCK(self);
+
+	if (!iovcnt)
+		return 0;
+	GST_LOG_OBJECT (self, "write %d coalesced bytes", (int)iov[0].iov_len);
+	return gst_dvbaudiosink_async_write(self, NULL, iov, iovcnt);
+}
+
+static int
+gst_dvbaudiosink_coalesce_flush(GstDVBAudioSink *self)
+{
+	int ret;
+
+	g_mutex_lock(self->coalesce_lock);
+	ret = gst_dvbaudiosink_coalesce_write(self);
+	g_mutex_unlock(self->coalesce_lock);
+
+	return ret;
+}
+
+/* flushes the collected packets when max-coalesce-latency passed in wall
+ * clock time without the next packet arriving */
+static gpointer
+gst_dvbaudiosink_coalesce_timer(gpointer data)
+{
+	GstDVBAudioSink *self = GST_DVBAUDIOSINK (data);
+
+	g_mutex_lock(self->coalesce_lock);
+	while (self->coalesce_running) {
+		GstClockTime now;
+
+		if (self->coalesce_deadline == GST_CLOCK_TIME_NONE) {
+			g_cond_wait(self->coalesce_cond, self->coalesce_lock);
+			continue;
+		}
+		now = gst_util_get_timestamp();
+		if (now < self->coalesce_deadline) {
+			GTimeVal tv;
+			g_get_current_time(&tv);
+			g_time_val_add(&tv, (self->coalesce_deadline - now) / GST_USECOND);
+			g_cond_timed_wait(self->coalesce_cond, self->coalesce_lock, &tv);
+			continue;
+		}
+		if (write_state_get(&self->no_write)) {
+			/* paused or flushing, the state change takes care of the
+			 * packets, look again later */
+			self->coalesce_deadline = now + self->max_coalesce_latency;
+			continue;
+		}
+		GST_LOG_OBJECT (self, "coalesce deadline passed");
+		if (gst_dvbaudiosink_coalesce_write(self) < 0)
+			GST_WARNING_OBJECT (self, "failed to write coalesced data: %s", g_strerror (errno));
+	}
+	g_mutex_unlock(self->coalesce_lock);
+
+	return NULL;
+}
+
+static void
+gst_dvbaudiosink_coalesce_start(GstDVBAudioSink *self)
+{
+	GError *err = NULL;
+
+	self->coalesce_running = TRUE;
+	self->coalesce_deadline = GST_CLOCK_TIME_NONE;
+	self->coalesce_thread = g_thread_create(gst_dvbaudiosink_coalesce_timer, self, TRUE, &err);
+	if (!self->coalesce_thread) {
+		/* the budget is still checked against the buffer timestamps */
+		GST_WARNING_OBJECT (self, "failed to create coalesce timer thread: %s", err->message);
+		g_error_free(err);
+		self->coalesce_running = FALSE;
+	}
+}
+
+static void
+gst_dvbaudiosink_coalesce_stop(GstDVBAudioSink *self)
+{
+	if (!self->coalesce_thread)
+		return;
+	g_mutex_lock(self->coalesce_lock);
+	self->coalesce_running = FALSE;
+	g_cond_signal(self->coalesce_cond);
+	g_mutex_unlock(self->coalesce_lock);
+	g_thread_join(self->coalesce_thread);
+	self->coalesce_thread = NULL;
+}
+
+/* move the collected PES packets to the pause queue, called with the object
+ * lock held when the sink is paused */
+static void
+gst_dvbaudiosink_coalesce_queue(GstDVBAudioSink *self)
+{
+	if (self->coalesce_bytes) {
+		queue_push(&self->queue, self->coalesce_data, self->coalesce_bytes);
+		GST_DEBUG_OBJECT (self, "moved %d coalesced bytes to queue", (int)self->coalesce_bytes);
+		self->coalesce_bytes = 0;
+	}
+}
+
+#define COALESCE_FLUSH() do { \
+		switch(gst_dvbaudiosink_coalesce_flush(self)) { \
+		case -1: goto poll_error; \
+		case -3: goto write_error; \
+		default: break; \
+		} \
+	} while(0)
+
+#define TS_WRITE(iov, iovcnt) do { \
+		switch(tsmux_write(self->tsmux, TSMUX_AUDIO, iov, iovcnt, READ_SOCKET(self), &self->no_write)) { \
+		case -1: goto poll_error; \
+		case -3: goto write_error; \
+		default: break; \
+		} \
+	} while(0)
+
+/* coalescing might have been switched off with packets still collected */
+#define PES_WRITE(iov, iovcnt) do { \
+		if (self->tsmux) \
+			TS_WRITE(iov, iovcnt); \
+		else if (!self->max_coalesce_bytes) { \
+			if (self->coalesce_bytes) \
+				COALESCE_FLUSH(); \
+			ASYNC_WRITE(iov, iovcnt); \
+		} \
+		else if (gst_dvbaudiosink_coalesce_push(self, buffer, iov, iovcnt)) \
+			COALESCE_FLUSH(); \
+	} while(0)
+
 static GstFlowReturn
 gst_dvbaudiosink_render (GstBaseSink * sink, GstBuffer * buffer)
 {
@@ -1311,6 +1764,9 @@ gst_dvbaudiosink_render (GstBaseSink * sink, GstBuffer * buffer)
 	int num_blocks = self->block_align ? size / self->block_align : 1;
 
 	size_t pes_header_size;
+	struct iovec iov[2], pes_iov[3];
+	int iovcnt, pes_iovcnt;
+	pes_t pes;
 //	int i=0;
 
 	/* LPCM workaround.. we also need the first two byte of the lpcm header.. (substreamid and num of frames) 
@@ -1362,42 +1818,32 @@ gst_dvbaudiosink_render (GstBaseSink * sink, GstBuffer * buffer)
 next_chunk:
 		/* do we have a timestamp? */
 	if (timestamp != GST_CLOCK_TIME_NONE) {
-		unsigned long long pts = timestamp * 9LL / 100000 /* convert ns to 90kHz */;
+		unsigned long long pts;
+
+		GST_OBJECT_LOCK(self);
+		pts = pts_map_write(&self->pts_map, timestamp);
+		GST_OBJECT_UNLOCK(self);
 
 		pes_header[6] = 0x80;
 
-		pes_header[9]  = 0x21 | ((pts >> 29) & 0xE);
-		pes_header[10] = pts >> 22;
-		pes_header[11] = 0x01 | ((pts >> 14) & 0xFE);
-		pes_header[12] = pts >> 7;
-		pes_header[13] = 0x01 | ((pts << 1) & 0xFE);
+		pes_put_timestamp(pes_header + 9, 0x21, pts);
 
 		if (hwtype == DM7025) {  // DM7025 needs DTS in PES header
 			int64_t dts = pts; // what to use as DTS-PTS offset?
-			pes_header[4] = (size + 13) >> 8;
-			pes_header[5] = (size + 13) & 0xFF;
 			pes_header[7] = 0xC0;
 			pes_header[8] = 10;
 			pes_header[9] |= 0x10;
 
-			pes_header[14] = 0x11 | ((dts >> 29) & 0xE);
-			pes_header[15] = dts >> 22;
-			pes_header[16] = 0x01 | ((dts >> 14) & 0xFE);
-			pes_header[17] = dts >> 7;
-			pes_header[18] = 0x01 | ((dts << 1) & 0xFE);
+			pes_put_timestamp(pes_header + 14, 0x11, dts);
 			pes_header_size = 19;
 		}
 		else {
-			pes_header[4] = (size + 8) >> 8;
-			pes_header[5] = (size + 8) & 0xFF;
 			pes_header[7] = 0x80;
 			pes_header[8] = 5;
 			pes_header_size = 14;
 		}
 	}
 	else {
-		pes_header[4] = (size + 3) >> 8;
-		pes_header[5] = (size + 3) & 0xFF;
 		pes_header[6] = 0x80;
 		pes_header[7] = 0x00;
 		pes_header[8] = 0;
@@ -1433,11 +1879,17 @@ next_chunk:
 	}
 
 	if (!self->temp_buffer || self->temp_bytes == self->block_align) {
-		ASYNC_WRITE(pes_header, pes_header_size);
+		/* the payload starts with the ADTS header behind the PES header */
+		iovcnt = 0;
+		iov_add(iov, &iovcnt, pes_header + PES_HEADER_LEN(pes_header), pes_header_size - PES_HEADER_LEN(pes_header));
 		if (!self->temp_buffer)
-			ASYNC_WRITE(data, size);
-		else {
-			ASYNC_WRITE(GST_BUFFER_DATA(self->temp_buffer), GST_BUFFER_SIZE(self->temp_buffer));
+			iov_add(iov, &iovcnt, data, size);
+		else
+			iov_add(iov, &iovcnt, GST_BUFFER_DATA(self->temp_buffer), GST_BUFFER_SIZE(self->temp_buffer));
+		pes_init(&pes, pes_header, PES_HEADER_LEN(pes_header), iov, iovcnt);
+		while ((pes_iovcnt = pes_next(&pes, pes_iov, G_N_ELEMENTS(pes_iov))))
+			PES_WRITE(pes_iov, pes_iovcnt);
+		if (self->temp_buffer) {
 			self->temp_bytes = 0;
 			if (self->bypass == 0xf) {
 				self->timestamp += 30*1000000; // always 30ms per chunk
@@ -1490,6 +1942,10 @@ gst_dvbaudiosink_start (GstBaseSink * basesink)
 	fcntl (READ_SOCKET (self), F_SETFL, O_NONBLOCK);
 	fcntl (WRITE_SOCKET (self), F_SETFL, O_NONBLOCK);
 
+	queue_alloc(&self->queue, self->queue_size);
+	pacer_init(&self->pacer);
+	pts_map_init(&self->pts_map);
+
 	return TRUE;
 	/* ERRORS */
 socket_pair:
@@ -1507,25 +1963,35 @@ gst_dvbaudiosink_stop (GstBaseSink * basesink)
 
 	GST_DEBUG_OBJECT (self, "stop");
 
-	if (self->fd >= 0) {
-		int video_fd = open("/dev/dvb/adapter0/video0", O_RDWR);
+	gst_dvbaudiosink_coalesce_stop(self);
+	writer_stop(&self->writer);
+	uring_free(&self->uring);
 
+	if (self->fd >= 0) {
 		ioctl(self->fd, AUDIO_STOP);
 		ioctl(self->fd, AUDIO_SELECT_SOURCE, AUDIO_SOURCE_DEMUX);
-
-		if ( video_fd > 0 ) {
-			ioctl(video_fd, VIDEO_SLOWMOTION, 0);
-			ioctl(video_fd, VIDEO_FAST_FORWARD, 0);
-			close (video_fd);
-		}
+		gst_dvbaudiosink_video_trickmode(self, 0, 0);
 		close(self->fd);
 	}
 
 	if (self->dump_fd > 0)
 		close(self->dump_fd);
 
-	while(self->queue)
-		queue_pop(&self->queue);
+	if (self->tsmux) {
+		tsmux_release(self->tsmux, TSMUX_AUDIO);
+		self->tsmux = NULL;
+	}
+	if (self->ts_filter >= 0) {
+		close(self->ts_filter);
+		self->ts_filter = -1;
+	}
+
+	queue_free(&self->queue);
+
+	g_free(self->coalesce_data);
+	self->coalesce_data = NULL;
+	self->coalesce_bytes = 0;
+	self->coalesce_size = 0;
 
 	if (self->temp_buffer)
 		gst_buffer_unref(self->temp_buffer);
@@ -1550,9 +2016,7 @@ gst_dvbaudiosink_change_state (GstElement * element, GstStateChange transition)
 		break;
 	case GST_STATE_CHANGE_READY_TO_PAUSED:
 		GST_DEBUG_OBJECT (self,"GST_STATE_CHANGE_READY_TO_PAUSED");
-		GST_OBJECT_LOCK(self);
-		self->no_write |= 4;
-		GST_OBJECT_UNLOCK(self);
+		write_state_set(&self->no_write, WRITE_PAUSED);
 
 		if (self->dump_filename)
 				self->dump_fd = open(self->dump_filename, O_RDWR|O_CREAT, 0555);
@@ -1560,17 +2024,43 @@ gst_dvbaudiosink_change_state (GstElement * element, GstStateChange transition)
 		self->fd = open("/dev/dvb/adapter0/audio0", O_RDWR|O_NONBLOCK);
 
 		if (self->fd) {
-			ioctl(self->fd, AUDIO_SELECT_SOURCE, AUDIO_SOURCE_MEMORY);
+			GST_OBJECT_LOCK(self);
+			if (self->ts_output && self->fd >= 0) {
+				self->tsmux = tsmux_get(self->ts_output, TSMUX_AUDIO);
+				if (self->tsmux)
+					self->ts_filter = tsmux_open_filter(self->ts_output, TSMUX_AUDIO);
+				else
+					GST_ELEMENT_WARNING (self, RESOURCE, OPEN_WRITE, (NULL), ("can't write TS to %s, using PES output", self->ts_output));
+			}
+			GST_OBJECT_UNLOCK(self);
+			ioctl(self->fd, AUDIO_SELECT_SOURCE, self->ts_filter >= 0 ? AUDIO_SOURCE_DEMUX : AUDIO_SOURCE_MEMORY);
 			ioctl(self->fd, AUDIO_PLAY);
 			ioctl(self->fd, AUDIO_PAUSE);
+
+			if (self->tsmux)
+				GST_INFO_OBJECT (self, "TS output to %s", self->ts_output);
+			else if ((self->use_writer_thread || self->use_shared_reactor) && self->fd >= 0) {
+				self->writer.sink = GST_OBJECT (self);
+				self->writer.fd = self->fd;
+				self->writer.control_read = READ_SOCKET(self);
+				self->writer.control_write = WRITE_SOCKET(self);
+				self->writer.no_write = &self->no_write;
+				self->writer.queue = &self->queue;
+				self->writer.pacer = &self->pacer;
+				if (!writer_start(&self->writer, self->use_shared_reactor))
+					GST_WARNING_OBJECT (self, "failed to start writer thread, writing from the streaming thread");
+			}
+			if (self->use_io_uring && !self->tsmux && !writer_running(&self->writer) && !uring_setup(&self->uring))
+				GST_INFO_OBJECT (self, "io_uring not available (%s), using poll", g_strerror(errno));
 		}
 		break;
 	case GST_STATE_CHANGE_PAUSED_TO_PLAYING:
 		GST_DEBUG_OBJECT (self,"GST_STATE_CHANGE_PAUSED_TO_PLAYING");
 		ioctl(self->fd, AUDIO_CONTINUE);
-		GST_OBJECT_LOCK(self);
-		self->no_write &= ~4;
-		GST_OBJECT_UNLOCK(self);
+		write_state_clear(&self->no_write, WRITE_PAUSED);
+		/* wake a render blocked on the full pause queue */
+		SEND_COMMAND (self, CONTROL_STOP);
+		writer_wakeup(&self->writer);
 		break;
 	default:
 		break;
@@ -1581,14 +2071,23 @@ gst_dvbaudiosink_change_state (GstElement * element, GstStateChange transition)
 	switch (transition) {
 	case GST_STATE_CHANGE_PLAYING_TO_PAUSED:
 		GST_DEBUG_OBJECT (self,"GST_STATE_CHANGE_PLAYING_TO_PAUSED");
-		GST_OBJECT_LOCK(self);
-		self->no_write |= 4;
-		GST_OBJECT_UNLOCK(self);
+		write_state_set(&self->no_write, WRITE_PAUSED);
+		/* only the writer thread drains the pause queue on resume by itself.
+		 * Without it the queue belongs to the streaming thread, which writes
+		 * the collected packets with the next ones */
+		if (writer_running(&self->writer)) {
+			GST_OBJECT_LOCK(self);
+			gst_dvbaudiosink_coalesce_queue(self);
+			GST_OBJECT_UNLOCK(self);
+		}
 		ioctl(self->fd, AUDIO_PAUSE);
 		SEND_COMMAND (self, CONTROL_STOP);
+		writer_wakeup(&self->writer);
 		break;
 	case GST_STATE_CHANGE_PAUSED_TO_READY:
 		GST_DEBUG_OBJECT (self,"GST_STATE_CHANGE_PAUSED_TO_READY");
+		writer_stop(&self->writer);
+		uring_free(&self->uring);
 		break;
 	case GST_STATE_CHANGE_READY_TO_NULL:
 		GST_DEBUG_OBJECT (self,"GST_STATE_CHANGE_READY_TO_NULL");
@@ -50,6 +50,8 @@
 #include <gst/gst.h>
 #include <gst/base/gstbasesink.h>
 
+#include "common.h"
+
 G_BEGIN_DECLS
 
 /* #defines don't like whitespacey bits */
@@ -70,13 +72,6 @@ typedef struct _GstDVBAudioSink		GstDVBAudioSink;
 typedef struct _GstDVBAudioSinkClass	GstDVBAudioSinkClass;
 typedef struct _GstDVBAudioSinkPrivate	GstDVBAudioSinkPrivate;
 
-typedef struct queue_entry
-{
-	struct queue_entry *next;
-	size_t bytes;
-	size_t offset;
-} queue_entry_t;
-
 struct _GstDVBAudioSink
 {
 	GstBaseSink element;
@@ -97,9 +92,40 @@ struct _GstDVBAudioSink
 	int skip;
 	int bypass;
 
-	int no_write;
-
-	queue_entry_t *queue;
+	volatile gint no_write;
+
+	queue_t queue;
+	guint queue_size;
+
+	writer_t writer;
+	gboolean use_writer_thread;
+	gboolean use_shared_reactor;
+
+	uring_t uring;
+	gboolean use_io_uring;
+
+	pacer_t pacer;
+	pts_map_t pts_map;
+
+	/* MPEG-TS output to the DVR device instead of PES to the decoder */
+	gchar *ts_output;
+	tsmux_t *tsmux;
+	int ts_filter;		/* demux PES filter feeding the decoder */
+
+	/* PES packet coalescing, the buffer is protected by the object lock.
+	 * coalesce_lock serializes the writes with the timer thread, which
+	 * flushes the collected packets at coalesce_deadline (monotonic) */
+	guint max_coalesce_bytes;
+	GstClockTime max_coalesce_latency;
+	guint8 *coalesce_data;
+	size_t coalesce_bytes;
+	size_t coalesce_size;
+	GstClockTime coalesce_start;
+	GMutex *coalesce_lock;
+	GCond *coalesce_cond;
+	GThread *coalesce_thread;
+	gboolean coalesce_running;
+	GstClockTime coalesce_deadline;
 
 	GstClockTime timestamp;
 };
@@ -108,7 +134,7 @@ struct _GstDVBAudioSinkClass
 {
 	GstBaseSinkClass parent_class;
 	gint64 (*get_decoder_time) (GstDVBAudioSink *sink);
-	int (*async_write) (GstDVBAudioSink *sink, unsigned char *data, unsigned int size);
+	int (*async_write) (GstDVBAudioSink *sink, GstBuffer *buffer, struct iovec *iov, int iovcnt);
 };
 
 GType gst_dvbaudiosink_get_type (void);
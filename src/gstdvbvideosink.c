@@ -63,6 +63,7 @@
 #include <stdint.h>
 #include <sys/ioctl.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
 #include <linux/dvb/video.h>
 #include <fcntl.h>
 #include <poll.h>
@@ -77,71 +78,21 @@
 #define VIDEO_GET_PTS              _IOR('o', 57, gint64)
 #endif
 
-struct bitstream
-{
-	guint8 *data;
-	guint8 last;
-	int avail;
-};
-
-static void bitstream_init(struct bitstream *bit, const void *buffer, gboolean wr)
-{
-	bit->data = (guint8*) buffer;
-	if (wr) {
-		bit->avail = 0;
-		bit->last = 0;
-	}
-	else {
-		bit->avail = 8;
-		bit->last = *bit->data++;
-	}
-}
-
-static unsigned long bitstream_get(struct bitstream *bit, int bits)
-{
-	unsigned long res=0;
-	while (bits)
-	{
-		unsigned int d=bits;
-		if (!bit->avail) {
-			bit->last = *bit->data++;
-			bit->avail = 8;
-		}
-		if (d > bit->avail)
-			d=bit->avail;
-		res<<=d;
-		res|=(bit->last>>(bit->avail-d))&~(-1<<d);
-		bit->avail-=d;
-		bits-=d;
-	}
-	return res;
-}
-
-static void bitstream_put(struct bitstream *bit, unsigned long val, int bits)
-{
-	while (bits)
-	{
-		bit->last |= ((val & (1 << (bits-1))) ? 1 : 0) << (7 - bit->avail);
-		if (++bit->avail == 8) {
-			*bit->data = bit->last;
-			++bit->data;
-			bit->last = 0;
-			bit->avail = 0;
-		}
-		--bits;
-	}
-}
-
 static unsigned int Vc1ParseSeqHeader( GstDVBVideoSink *self, struct bitstream *bit );
 static unsigned int Vc1ParseEntryPointHeader( GstDVBVideoSink *self, struct bitstream *bit );
 static unsigned char Vc1GetFrameType( GstDVBVideoSink *self, struct bitstream *bit );
 static unsigned char Vc1GetBFractionVal( GstDVBVideoSink *self, struct bitstream *bit );
 static unsigned char Vc1GetNrOfFramesFromBFractionVal( unsigned char ucBFVal );
-static unsigned char Vc1HandleStreamBuffer( GstDVBVideoSink *self, unsigned char *data, int flags );
+static unsigned char Vc1HandleStreamBuffer( GstDVBVideoSink *self, unsigned char *data, unsigned int len, int flags );
 
 #define cVC1NoBufferDataAvailable	0
 #define cVC1BufferDataAvailable		1
 
+#define COALESCE_DEFAULT_LATENCY (50 * GST_MSECOND)
+
+#define GST_TYPE_DVBVIDEOSINK_HEADER_POLICY (gst_dvbvideosink_header_policy_get_type())
+static GType gst_dvbvideosink_header_policy_get_type (void);
+
 /* We add a control socket as in fdsrc to make it shutdown quickly when it's blocking on the fd.
  * Poll is used to determine when the fd is ready for use. When the element state is changed,
  * it happens from another thread while fdsink is poll'ing on the fd. The state-change thread 
@@ -185,6 +136,27 @@ enum
 	LAST_SIGNAL
 };
 
+enum
+{
+	PROP_0,
+	PROP_QUEUE_SIZE,
+	PROP_WRITER_THREAD,
+	PROP_IO_URING,
+	PROP_SHARED_REACTOR,
+	PROP_QUEUE_MAX_BYTES,
+	PROP_QUEUE_MAX_TIME,
+	PROP_QUEUE_LOW_PERCENT,
+	PROP_QUEUE_LEAKY,
+	PROP_MIN_WRITE_SIZE,
+	PROP_WRITE_STATS,
+	PROP_DTS_CODECS,
+	PROP_TS_OUTPUT,
+	PROP_MAX_COALESCE_BYTES,
+	PROP_MAX_COALESCE_LATENCY,
+	PROP_HEADER_POLICY,
+	PROP_HEADER_STATS
+};
+
 static guint gst_dvb_videosink_signals[LAST_SIGNAL] = { 0 };
 
 static GstStaticPadTemplate sink_factory_bcm7400 =
@@ -305,11 +277,15 @@ GST_STATIC_PAD_TEMPLATE (
 );
 
 #define DEBUG_INIT(bla) \
-	GST_DEBUG_CATEGORY_INIT (dvbvideosink_debug, "dvbvideosink", 0, "dvbvideosink element");
+	GST_DEBUG_CATEGORY_INIT (dvbvideosink_debug, "dvbvideosink", 0, "dvbvideosink element"); \
+	GST_DEBUG_CATEGORY_INIT (dvbsink_common_debug, "dvbvideosink_common", 0, "dvbvideosink writer");
 
 GST_BOILERPLATE_FULL (GstDVBVideoSink, gst_dvbvideosink, GstBaseSink,
 	GST_TYPE_BASE_SINK, DEBUG_INIT);
 
+static void gst_dvbvideosink_set_property (GObject * object, guint prop_id, const GValue * value, GParamSpec * pspec);
+static void gst_dvbvideosink_get_property (GObject * object, guint prop_id, GValue * value, GParamSpec * pspec);
+
 static gboolean gst_dvbvideosink_start (GstBaseSink * sink);
 static gboolean gst_dvbvideosink_stop (GstBaseSink * sink);
 static gboolean gst_dvbvideosink_event (GstBaseSink * sink, GstEvent * event);
@@ -317,9 +293,18 @@ static GstFlowReturn gst_dvbvideosink_render (GstBaseSink * sink, GstBuffer * bu
 static gboolean gst_dvbvideosink_set_caps (GstBaseSink * sink, GstCaps * caps);
 static gboolean gst_dvbvideosink_unlock (GstBaseSink * basesink);
 static gboolean gst_dvbvideosink_unlock_stop (GstBaseSink * basesink);
+static void gst_dvbvideosink_writer_event (GstObject * sink);
+static void gst_dvbvideosink_writer_flush (GstObject * sink);
 static void gst_dvbvideosink_dispose (GObject * object);
 static GstStateChangeReturn gst_dvbvideosink_change_state (GstElement * element, GstStateChange transition);
 static gint64 gst_dvbvideosink_get_decoder_time (GstDVBVideoSink *self);
+static void gst_dvbvideosink_h264_au_clear (GstDVBVideoSink *self);
+static GstFlowReturn gst_dvbvideosink_h264_au_push (GstDVBVideoSink *self);
+static void gst_dvbvideosink_h264_sps (GstDVBVideoSink *self, const guint8 *data, unsigned int len);
+static void gst_dvbvideosink_h264_field_clear (GstDVBVideoSink *self);
+static GstFlowReturn gst_dvbvideosink_h264_field_push (GstDVBVideoSink *self);
+static int gst_dvbvideosink_coalesce_flush (GstBaseSink * sink, GstDVBVideoSink *self);
+static void gst_dvbvideosink_infer_reset (GstDVBVideoSink *self);
 
 typedef enum { DM7025, DM800, DM8000, DM500HD, DM800SE, DM7020HD, DM7080, DM820 } hardware_type_t;
 
@@ -414,6 +399,83 @@ gst_dvbvideosink_class_init (GstDVBVideoSinkClass *klass)
 	GstElementClass *element_class = GST_ELEMENT_CLASS (klass);
 
 	gobject_class->dispose = GST_DEBUG_FUNCPTR (gst_dvbvideosink_dispose);
+	gobject_class->set_property = GST_DEBUG_FUNCPTR (gst_dvbvideosink_set_property);
+	gobject_class->get_property = GST_DEBUG_FUNCPTR (gst_dvbvideosink_get_property);
+	g_object_class_install_property (gobject_class, PROP_QUEUE_SIZE,
+		g_param_spec_uint ("queue-size", "Pause queue size",
+			"Initial size in bytes of the queue holding data while paused (grows on demand)",
+			4096, G_MAXUINT, QUEUE_DEFAULT_SIZE,
+			G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+	g_object_class_install_property (gobject_class, PROP_WRITER_THREAD,
+		g_param_spec_boolean ("writer-thread", "Writer thread",
+			"Write to the decoder from a dedicated thread instead of the streaming thread",
+			FALSE, G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+	g_object_class_install_property (gobject_class, PROP_IO_URING,
+		g_param_spec_boolean ("io-uring", "io_uring",
+			"Use io_uring instead of poll and writev for the decoder writes (falls back to poll when not available)",
+			FALSE, G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+	g_object_class_install_property (gobject_class, PROP_SHARED_REACTOR,
+		g_param_spec_boolean ("shared-reactor", "Shared reactor",
+			"Write to the decoder from one thread shared by all dvb sinks of the process (implies writer-thread)",
+			FALSE, G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+	g_object_class_install_property (gobject_class, PROP_QUEUE_MAX_BYTES,
+		g_param_spec_uint ("queue-max-bytes", "Pause queue max bytes",
+			"High watermark of the pause queue in bytes (0 = unlimited)",
+			0, G_MAXUINT, 0,
+			G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+	g_object_class_install_property (gobject_class, PROP_QUEUE_MAX_TIME,
+		g_param_spec_uint64 ("queue-max-time", "Pause queue max time",
+			"High watermark of the pause queue in ns of stream time (0 = unlimited)",
+			0, G_MAXUINT64, 0,
+			G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+	g_object_class_install_property (gobject_class, PROP_QUEUE_LOW_PERCENT,
+		g_param_spec_uint ("queue-low-percent", "Pause queue low watermark",
+			"Level in percent of the high watermark below which the queue is reported as not full again",
+			0, 100, QUEUE_DEFAULT_LOW_PERCENT,
+			G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+	g_object_class_install_property (gobject_class, PROP_QUEUE_LEAKY,
+		g_param_spec_boolean ("queue-leaky", "Leaky pause queue",
+			"Drop new data when the pause queue is full instead of blocking",
+			FALSE, G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+	g_object_class_install_property (gobject_class, PROP_MIN_WRITE_SIZE,
+		g_param_spec_uint ("min-write-size", "Minimum write size",
+			"After the decoder accepted only part of a write, wait until about this many bytes should be free again at the learned drain rate (0 = write as soon as possible)",
+			0, G_MAXINT, 0,
+			G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+	g_object_class_install_property (gobject_class, PROP_WRITE_STATS,
+		g_param_spec_boxed ("write-stats", "Write statistics",
+			"Decoder write statistics and the learned drain rate",
+			GST_TYPE_STRUCTURE, G_PARAM_READABLE | G_PARAM_STATIC_STRINGS));
+	g_object_class_install_property (gobject_class, PROP_DTS_CODECS,
+		g_param_spec_string ("dts-codecs", "DTS codecs",
+			"Comma separated list of codecs (mpeg1, mpeg2, h264, mpeg4, ...) which get a DTS in their PES headers. "
+			"VC-1 and packed DivX/Xvid go out with the timestamp of the previous frame and never get one",
+			NULL, G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+	g_object_class_install_property (gobject_class, PROP_TS_OUTPUT,
+		g_param_spec_string ("ts-output", "TS output",
+			"Write an MPEG-TS with PCR to this DVR device (or file) instead of PES to the decoder, shared with the audio sink (NULL = off)",
+			NULL, G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+
+	g_object_class_install_property (gobject_class, PROP_MAX_COALESCE_BYTES,
+		g_param_spec_uint ("max-coalesce-bytes", "Max coalesce bytes",
+			"Collect the PES packets of small VP6, Spark and MPEG-4 part 2 frames up to this many bytes and write them at once (0 = disabled)",
+			0, G_MAXINT, 0,
+			G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+	g_object_class_install_property (gobject_class, PROP_MAX_COALESCE_LATENCY,
+		g_param_spec_uint64 ("max-coalesce-latency", "Max coalesce latency",
+			"Write the collected frames once they span this much stream time in ns (0 = no limit)",
+			0, G_MAXUINT64, COALESCE_DEFAULT_LATENCY,
+			G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+
+	g_object_class_install_property (gobject_class, PROP_HEADER_POLICY,
+		g_param_spec_enum ("header-policy", "Header policy",
+			"When the codec data is sent to the decoder again",
+			GST_TYPE_DVBVIDEOSINK_HEADER_POLICY, HEADER_POLICY_AUTO,
+			G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+	g_object_class_install_property (gobject_class, PROP_HEADER_STATS,
+		g_param_spec_boxed ("header-stats", "Header statistics",
+			"Codec data injections, their bytes and the injections saved by the header policy",
+			GST_TYPE_STRUCTURE, G_PARAM_READABLE | G_PARAM_STATIC_STRINGS));
 
 	gstbasesink_class->start = GST_DEBUG_FUNCPTR (gst_dvbvideosink_start);
 	gstbasesink_class->stop = GST_DEBUG_FUNCPTR (gst_dvbvideosink_stop);
@@ -436,7 +498,98 @@ gst_dvbvideosink_class_init (GstDVBVideoSinkClass *klass)
 	klass->get_decoder_time = gst_dvbvideosink_get_decoder_time;
 }
 
-#define H264_BUFFER_SIZE (64*1024+2048)
+/* indexed by t_codec_type */
+static const char *const codec_names[] = {
+	"mpeg1", "mpeg2", "h264", "divx311", "divx4", "mpeg4", "vc1", "vc1-sm", "spark", "vp6", "vp8"
+};
+
+static guint gst_dvbvideosink_parse_codecs(GstDVBVideoSink *self, const gchar *str)
+{
+	guint mask = 0;
+	while (str && *str) {
+		const gchar *end = strchr(str, ',');
+		size_t len = end ? (size_t)(end - str) : strlen(str);
+		unsigned int i;
+		while (len && *str == ' ') {
+			++str;
+			--len;
+		}
+		while (len && str[len-1] == ' ')
+			--len;
+		for (i = 0; i < G_N_ELEMENTS(codec_names); ++i) {
+			if (len == strlen(codec_names[i]) && !strncmp(str, codec_names[i], len)) {
+				mask |= 1 << i;
+				break;
+			}
+		}
+		if (len && i == G_N_ELEMENTS(codec_names))
+			GST_WARNING_OBJECT(self, "unknown codec '%.*s' in dts-codecs", (int)len, str);
+		str = end ? end + 1 : NULL;
+	}
+	return mask;
+}
+
+/* forget the decode timeline, on new caps also the learned reorder depth */
+static void gst_dvbvideosink_dts_reset(GstDVBVideoSink *self, gboolean reorder)
+{
+	self->dts_count = 0;
+	self->dts_last = GST_CLOCK_TIME_NONE;
+	if (reorder) {
+		self->dts_reorder = DTS_DEFAULT_REORDER;
+		self->dts_duration = GST_CLOCK_TIME_NONE;
+	}
+}
+
+/* 0.10 buffers carry no decode timestamp, so estimate it from the PTS
+ * order: the number of already received frames presented after this one
+ * gives the reorder depth. The DTS advances one frame duration per buffer
+ * and never passes the PTS of this frame or of the frames still pending. */
+static GstClockTime gst_dvbvideosink_dts(GstDVBVideoSink *self, GstClockTime pts, GstClockTime duration)
+{
+	guint i, n = MIN(self->dts_count, DTS_WINDOW), later = 0;
+	GstClockTime dts, delay, lower = pts;
+
+	for (i = 0; i < n; ++i) {
+		GstClockTime prev = self->dts_window[i];
+		GstClockTime delta = prev > pts ? prev - pts : pts - prev;
+		if (prev > pts)
+			++later;
+		if (delta && delta < self->dts_duration)
+			self->dts_duration = delta;
+	}
+	if (later > self->dts_reorder) {
+		GST_INFO_OBJECT(self, "reorder depth %u", later);
+		self->dts_reorder = later;
+	}
+	if (GST_CLOCK_TIME_IS_VALID(duration) && duration)
+		self->dts_duration = duration;
+
+	self->dts_window[self->dts_count++ % DTS_WINDOW] = pts;
+	n = MIN(self->dts_count, MIN(self->dts_reorder + 1, DTS_WINDOW));
+	for (i = 1; i <= n; ++i) {
+		GstClockTime prev = self->dts_window[(self->dts_count - i) % DTS_WINDOW];
+		if (prev < lower)
+			lower = prev;
+	}
+
+	/* no DTS until the frame rate is known */
+	if (!GST_CLOCK_TIME_IS_VALID(self->dts_duration) || self->dts_count < DTS_WARMUP)
+		return GST_CLOCK_TIME_NONE;
+
+	delay = self->dts_reorder * self->dts_duration;
+	lower = lower > delay ? lower - delay : 0;
+	if (!GST_CLOCK_TIME_IS_VALID(self->dts_last))
+		dts = lower;
+	else
+		dts = MAX(self->dts_last + self->dts_duration, lower);
+	if (dts > pts)
+		dts = pts;
+	/* the decode order must stay monotonic, rather send no DTS at all */
+	if (GST_CLOCK_TIME_IS_VALID(self->dts_last) && dts <= self->dts_last)
+		return GST_CLOCK_TIME_NONE;
+	self->dts_last = dts;
+	return dts;
+}
 
 /* initialize the new element
  * instantiate pads and add them to element
@@ -449,7 +602,21 @@ gst_dvbvideosink_init (GstDVBVideoSink *klass, GstDVBVideoSinkClass * gclass)
 	FILE *f = fopen("/proc/stb/vmpeg/0/fallback_framerate", "r");
 	klass->dec_running = FALSE;
 	klass->must_send_header = 1;
-	klass->h264_buffer = NULL;
+	klass->header_policy = HEADER_POLICY_AUTO;
+	klass->h264_iov = NULL;
+	klass->h264_iov_size = 0;
+	klass->h264_nal_aligned = -1;
+	klass->h264_detect_count = 0;
+	klass->h264_au = gst_adapter_new();
+	klass->h264_au_timestamp = GST_CLOCK_TIME_NONE;
+	klass->h264_au_vcl = FALSE;
+	klass->h264_au_output = FALSE;
+	klass->h264_frame_mbs_only = -1;
+	klass->h264_log2_max_frame_num = 4;
+	klass->h264_separate_colour_plane = FALSE;
+	klass->h264_field = NULL;
+	klass->h264_field_pair = NULL;
+	klass->h264_field_output = FALSE;
 	klass->h264_nal_len_size = 0;
 	klass->codec_data = NULL;
 	klass->codec_type = CT_H264;
@@ -460,7 +627,37 @@ gst_dvbvideosink_init (GstDVBVideoSink *klass, GstDVBVideoSinkClass * gclass)
 
 	klass->ucPrevFramePicType = 0;
 	klass->no_write = 0;
-	klass->queue = NULL;
+	queue_init(&klass->queue);
+	klass->queue_size = QUEUE_DEFAULT_SIZE;
+	klass->use_writer_thread = FALSE;
+	klass->use_io_uring = FALSE;
+	klass->use_shared_reactor = FALSE;
+	uring_init(&klass->uring);
+	pacer_init(&klass->pacer);
+	pts_map_init(&klass->pts_map);
+	klass->dts_codecs = 0;
+	klass->dts_codecs_str = NULL;
+	gst_dvbvideosink_dts_reset(klass, TRUE);
+	klass->es_prefix_len = 0;
+	klass->codec_prefix = NULL;
+	klass->codec_prefix_len = 0;
+	klass->infer_duration = GST_CLOCK_TIME_NONE;
+	klass->infer_framed = FALSE;
+	gst_dvbvideosink_infer_reset(klass);
+	klass->max_coalesce_bytes = 0;
+	klass->max_coalesce_latency = COALESCE_DEFAULT_LATENCY;
+	klass->coalesce_data = NULL;
+	klass->coalesce_bytes = 0;
+	klass->coalesce_size = 0;
+	klass->coalesce_start = GST_CLOCK_TIME_NONE;
+	klass->ts_output = NULL;
+	klass->tsmux = NULL;
+	klass->ts_filter = -1;
+	writer_init(&klass->writer);
+	klass->writer.video = TRUE;
+	klass->writer.events = POLLPRI;
+	klass->writer.event_cb = gst_dvbvideosink_writer_event;
+	klass->writer.flush_cb = gst_dvbvideosink_writer_flush;
 	klass->fd = -1;
 
 	klass->ucVC1_PULLDOWN = 0;
@@ -517,26 +714,178 @@ static void gst_dvbvideosink_dispose (GObject * object)
 
 	GST_DEBUG_OBJECT(self, "state in dispose %d, pending %d", state, pending);
 
+	g_free(self->dts_codecs_str);
+	self->dts_codecs_str = NULL;
+	g_free(self->ts_output);
+	self->ts_output = NULL;
+
+	if (self->h264_au) {
+		g_object_unref(self->h264_au);
+		self->h264_au = NULL;
+	}
+
 	G_OBJECT_CLASS (parent_class)->dispose (object);
 }
 
+static void
+gst_dvbvideosink_set_property (GObject * object, guint prop_id, const GValue * value, GParamSpec * pspec)
+{
+	GstDVBVideoSink *self = GST_DVBVIDEOSINK (object);
+
+	switch (prop_id) {
+		case PROP_QUEUE_SIZE:
+		GST_OBJECT_LOCK(self);
+		self->queue_size = g_value_get_uint (value);
+		GST_OBJECT_UNLOCK(self);
+		break;
+		case PROP_WRITER_THREAD:
+		self->use_writer_thread = g_value_get_boolean (value);
+		break;
+		case PROP_IO_URING:
+		self->use_io_uring = g_value_get_boolean (value);
+		break;
+		case PROP_SHARED_REACTOR:
+		self->use_shared_reactor = g_value_get_boolean (value);
+		break;
+		case PROP_QUEUE_MAX_BYTES:
+		GST_OBJECT_LOCK(self);
+		self->queue.max_bytes = g_value_get_uint (value);
+		GST_OBJECT_UNLOCK(self);
+		break;
+		case PROP_QUEUE_MAX_TIME:
+		GST_OBJECT_LOCK(self);
+		self->queue.max_time = g_value_get_uint64 (value);
+		GST_OBJECT_UNLOCK(self);
+		break;
+		case PROP_QUEUE_LOW_PERCENT:
+		GST_OBJECT_LOCK(self);
+		self->queue.low_percent = g_value_get_uint (value);
+		GST_OBJECT_UNLOCK(self);
+		break;
+		case PROP_QUEUE_LEAKY:
+		GST_OBJECT_LOCK(self);
+		self->queue.leaky = g_value_get_boolean (value);
+		GST_OBJECT_UNLOCK(self);
+		break;
+		case PROP_MIN_WRITE_SIZE:
+		GST_OBJECT_LOCK(self);
+		self->pacer.min_write = g_value_get_uint (value);
+		GST_OBJECT_UNLOCK(self);
+		break;
+		case PROP_DTS_CODECS:
+		GST_OBJECT_LOCK(self);
+		g_free(self->dts_codecs_str);
+		self->dts_codecs_str = g_strdup (g_value_get_string (value));
+		self->dts_codecs = gst_dvbvideosink_parse_codecs(self, self->dts_codecs_str);
+		GST_OBJECT_UNLOCK(self);
+		break;
+		case PROP_TS_OUTPUT:
+		GST_OBJECT_LOCK(self);
+		g_free(self->ts_output);
+		self->ts_output = g_strdup (g_value_get_string (value));
+		GST_OBJECT_UNLOCK(self);
+		break;
+		case PROP_MAX_COALESCE_BYTES:
+		GST_OBJECT_LOCK(self);
+		self->max_coalesce_bytes = g_value_get_uint (value);
+		GST_OBJECT_UNLOCK(self);
+		break;
+		case PROP_MAX_COALESCE_LATENCY:
+		GST_OBJECT_LOCK(self);
+		self->max_coalesce_latency = g_value_get_uint64 (value);
+		GST_OBJECT_UNLOCK(self);
+		break;
+		case PROP_HEADER_POLICY:
+		self->header_policy = g_value_get_enum (value);
+		break;
+		default:
+		G_OBJECT_WARN_INVALID_PROPERTY_ID (object, prop_id, pspec);
+		break;
+	}
+}
+
+static void
+gst_dvbvideosink_get_property (GObject * object, guint prop_id, GValue * value, GParamSpec * pspec)
+{
+	GstDVBVideoSink *self = GST_DVBVIDEOSINK (object);
+
+	switch (prop_id) {
+		case PROP_QUEUE_SIZE:
+		g_value_set_uint (value, self->queue_size);
+		break;
+		case PROP_WRITER_THREAD:
+		g_value_set_boolean (value, self->use_writer_thread);
+		break;
+		case PROP_IO_URING:
+		g_value_set_boolean (value, self->use_io_uring);
+		break;
+		case PROP_SHARED_REACTOR:
+		g_value_set_boolean (value, self->use_shared_reactor);
+		break;
+		case PROP_QUEUE_MAX_BYTES:
+		g_value_set_uint (value, self->queue.max_bytes);
+		break;
+		case PROP_QUEUE_MAX_TIME:
+		g_value_set_uint64 (value, self->queue.max_time);
+		break;
+		case PROP_QUEUE_LOW_PERCENT:
+		g_value_set_uint (value, self->queue.low_percent);
+		break;
+		case PROP_QUEUE_LEAKY:
+		g_value_set_boolean (value, self->queue.leaky);
+		break;
+		case PROP_MIN_WRITE_SIZE:
+		g_value_set_uint (value, self->pacer.min_write);
+		break;
+		case PROP_WRITE_STATS:
+		g_value_take_boxed (value, pacer_stats(&self->pacer));
+		break;
+		case PROP_DTS_CODECS:
+		GST_OBJECT_LOCK(self);
+		g_value_set_string (value, self->dts_codecs_str);
+		GST_OBJECT_UNLOCK(self);
+		break;
+		case PROP_TS_OUTPUT:
+		GST_OBJECT_LOCK(self);
+		g_value_set_string (value, self->ts_output);
+		GST_OBJECT_UNLOCK(self);
+		break;
+		case PROP_MAX_COALESCE_BYTES:
+		g_value_set_uint (value, self->max_coalesce_bytes);
+		break;
+		case PROP_MAX_COALESCE_LATENCY:
+		g_value_set_uint64 (value, self->max_coalesce_latency);
+		break;
+		case PROP_HEADER_POLICY:
+		g_value_set_enum (value, self->header_policy);
+		break;
+		case PROP_HEADER_STATS:
+		GST_OBJECT_LOCK(self);
+		g_value_take_boxed (value, gst_structure_new ("headerStats",
+			"injected", G_TYPE_UINT64, self->header_injected,
+			"injected-bytes", G_TYPE_UINT64, self->header_injected_bytes,
+			"skipped", G_TYPE_UINT64, self->header_skipped, NULL));
+		GST_OBJECT_UNLOCK(self);
+		break;
+		default:
+		G_OBJECT_WARN_INVALID_PROPERTY_ID (object, prop_id, pspec);
+		break;
+	}
+}
+
 static gint64 gst_dvbvideosink_get_decoder_time (GstDVBVideoSink *self)
 {
 	if (self->dec_running && self->fd > -1) {
 		gint64 cur = 0;
-		static gint64 last_pos = 0;
+		GstClockTime time;
 
 		ioctl(self->fd, VIDEO_GET_PTS, &cur);
 
-		/* workaround until driver fixed */
-		if (cur)
-			last_pos = cur;
-		else
-			cur = last_pos;
-
-		cur *= 11111;
+		GST_OBJECT_LOCK(self);
+		time = pts_map_to_time(&self->pts_map, cur);
+		GST_OBJECT_UNLOCK(self);
 
-		return cur;
+		return time;
 	}
 	return GST_CLOCK_TIME_NONE;
 }
@@ -544,10 +893,9 @@ static gint64 gst_dvbvideosink_get_decoder_time (GstDVBVideoSink *self)
 static gboolean gst_dvbvideosink_unlock (GstBaseSink * basesink)
 {
 	GstDVBVideoSink *self = GST_DVBVIDEOSINK (basesink);
-	GST_OBJECT_LOCK(self);
-	self->no_write |= 2;
-	GST_OBJECT_UNLOCK(self);
+	write_state_set(&self->no_write, WRITE_UNLOCKED);
 	SEND_COMMAND (self, CONTROL_STOP);
+	writer_wakeup(&self->writer);
 	GST_DEBUG_OBJECT (basesink, "unlock");
 	return TRUE;
 }
@@ -555,52 +903,12 @@ static gboolean gst_dvbvideosink_unlock (GstBaseSink * basesink)
 static gboolean gst_dvbvideosink_unlock_stop (GstBaseSink * basesink)
 {
 	GstDVBVideoSink *self = GST_DVBVIDEOSINK (basesink);
-	GST_OBJECT_LOCK(self);
-	self->no_write &= ~2;
-	GST_OBJECT_UNLOCK(self);
+	write_state_clear(&self->no_write, WRITE_UNLOCKED);
+	writer_wakeup(&self->writer);
 	GST_DEBUG_OBJECT (basesink, "unlock_stop");
 	return TRUE;
 }
 
-void queue_push(queue_entry_t **queue_base, guint8 *data, size_t len)
-{
-	queue_entry_t *entry = malloc(sizeof(queue_entry_t)+len);
-	queue_entry_t *last = *queue_base;
-	guint8 *d = (guint8*)(entry+1);
-	memcpy(d, data, len);
-	entry->bytes = len;
-	entry->offset = 0;
-	if (!last)
-		*queue_base = entry;
-	else {
-		while(last->next)
-			last = last->next;
-		last->next = entry;
-	}
-	entry->next = NULL;
-}
-
-void queue_pop(queue_entry_t **queue_base)
-{
-	queue_entry_t *base = *queue_base;
-	*queue_base = base->next;
-	free(base);
-}
-
-int queue_front(queue_entry_t **queue_base, guint8 **data, size_t *bytes)
-{
-	if (!*queue_base) {
-		*bytes = 0;
-		*data = 0;
-	}
-	else {
-		queue_entry_t *entry = *queue_base;
-		*bytes = entry->bytes - entry->offset;
-		*data = ((guint8*)(entry+1))+entry->offset;
-	}
-	return *bytes;
-}
-
 static gboolean
 gst_dvbvideosink_event (GstBaseSink * sink, GstEvent * event)
 {
@@ -611,20 +919,32 @@ gst_dvbvideosink_event (GstBaseSink * sink, GstEvent * event)
 	switch (GST_EVENT_TYPE (event)) {
 	case GST_EVENT_FLUSH_START:
 		GST_OBJECT_LOCK(self);
-		self->no_write |= 1;
+		write_state_set(&self->no_write, WRITE_FLUSHING);
+		self->coalesce_bytes = 0;
 		GST_OBJECT_UNLOCK(self);
 		SEND_COMMAND (self, CONTROL_STOP);
+		writer_wakeup(&self->writer);
 		break;
 	case GST_EVENT_FLUSH_STOP:
-		ioctl(self->fd, VIDEO_CLEAR_BUFFER);
+		/* with a writer thread the decoder buffer is cleared by the writer,
+		 * after it dropped the data queued before the flush */
+		if (!writer_running(&self->writer))
+			ioctl(self->fd, VIDEO_CLEAR_BUFFER);
 		GST_OBJECT_LOCK(self);
 		self->must_send_header = 1;
 		if (hwtype == DM7025)
 			++self->must_send_header;  // we must send the sequence header twice on dm7025... 
-		while (self->queue)
-			queue_pop(&self->queue);
-		self->no_write &= ~1;
+		queue_clear(&self->queue);
+		self->coalesce_bytes = 0;
+		pts_map_init(&self->pts_map);
+		write_state_clear(&self->no_write, WRITE_FLUSHING);
+		writer_flush(&self->writer);
 		GST_OBJECT_UNLOCK(self);
+		gst_dvbvideosink_dts_reset(self, FALSE);
+		gst_dvbvideosink_infer_reset(self);
+		gst_dvbvideosink_h264_au_clear(self);
+		gst_dvbvideosink_h264_field_clear(self);
+		queue_notify(GST_ELEMENT(self), &self->queue);
 		break;
 	case GST_EVENT_EOS:
 	{
@@ -634,197 +954,1336 @@ gst_dvbvideosink_event (GstBaseSink * sink, GstEvent * event)
 		if (self->fd < 0)
 			break;
 
-		pfd[0].fd = READ_SOCKET(self);
-		pfd[0].events = POLLIN;
-		pfd[1].fd = self->fd;
-		pfd[1].events = POLLIN;
+		if (gst_dvbvideosink_h264_au_push(self) != GST_FLOW_OK)
+			GST_DEBUG_OBJECT (self, "failed to write the last access unit");
+		if (gst_dvbvideosink_h264_field_push(self) != GST_FLOW_OK)
+			GST_DEBUG_OBJECT (self, "failed to write the last field");
+		if (gst_dvbvideosink_coalesce_flush(sink, self))
+			GST_WARNING_OBJECT (self, "failed to write coalesced data: %s", g_strerror (errno));
+
+		pfd[0].fd = READ_SOCKET(self);
+		pfd[0].events = POLLIN;
+		pfd[1].fd = self->fd;
+		pfd[1].events = POLLIN;
+
+		GST_PAD_PREROLL_UNLOCK (sink->sinkpad);
+		if (!writer_drain(&self->writer)) {
+			GST_DEBUG_OBJECT (self, "wait EOS aborted!!\n");
+			ret=FALSE;
+		}
+		while (ret) {
+			retval = poll(pfd, 2, 250);
+			if (retval < 0) {
+				perror("poll in EVENT_EOS");
+				ret=FALSE;
+				break;
+			}
+
+			if (pfd[0].revents & POLLIN) {
+				GST_DEBUG_OBJECT (self, "wait EOS aborted!!\n");
+				ret=FALSE;
+				break;
+			}
+
+			if (pfd[1].revents & POLLIN) {
+				GST_DEBUG_OBJECT (self, "got buffer empty from driver!\n");
+				break;
+			}
+
+			if (sink->flushing) {
+				GST_DEBUG_OBJECT (self, "wait EOS flushing!!\n");
+				ret=FALSE;
+				break;
+			}
+		}
+		GST_PAD_PREROLL_LOCK (sink->sinkpad);
+
+		break;
+	}
+	case GST_EVENT_NEWSEGMENT:{
+		GstFormat fmt;
+		gboolean update;
+		gdouble rate, applied_rate;
+		gint64 cur, stop, time;
+		int skip = 0, repeat = 0;
+		gst_event_parse_new_segment_full (event, &update, &rate, &applied_rate,	&fmt, &cur, &stop, &time);
+		GST_DEBUG_OBJECT (self, "GST_EVENT_NEWSEGMENT rate=%f applied_rate=%f\n", rate, applied_rate);
+		
+		if (fmt == GST_FORMAT_TIME)
+		{	
+			GST_OBJECT_LOCK(self);
+			pts_map_segment(&self->pts_map, cur);
+			GST_OBJECT_UNLOCK(self);
+			/* untimestamped frames start at the segment */
+			if (self->infer_next == GST_CLOCK_TIME_NONE)
+				self->infer_next = cur;
+			if (self->infer_display == GST_CLOCK_TIME_NONE)
+				self->infer_display = cur;
+			if ( rate > 1 )
+				skip = (int) rate;
+			else if ( rate < 1 )
+				repeat = 1.0/rate;
+
+			ret = ioctl(self->fd, VIDEO_SLOWMOTION, repeat) < 0 ? FALSE : TRUE;
+			ret = ioctl(self->fd, VIDEO_FAST_FORWARD, skip) < 0 ? FALSE : TRUE;
+// 			gst_segment_set_newsegment_full (&dec->segment, update, rate, applied_rate, dformat, cur, stop, time);
+		}
+		break;
+	}
+
+	default:
+		break;
+	}
+
+	return ret;
+}
+
+static void gst_dvbvideosink_handle_event(GstDVBVideoSink *self)
+{
+	GstStructure *s;
+	GstMessage *msg;
+	struct video_event evt;
+	if (ioctl(self->fd, VIDEO_GET_EVENT, &evt) < 0)
+		g_warning ("failed to ioctl VIDEO_GET_EVENT!");
+	else {
+		GST_INFO_OBJECT (self, "VIDEO_EVENT %d", evt.type);
+		if (evt.type == VIDEO_EVENT_SIZE_CHANGED) {
+			s = gst_structure_new ("eventSizeChanged",
+				"aspect_ratio", G_TYPE_INT, evt.u.size.aspect_ratio == 0 ? 2 : 3,
+				"width", G_TYPE_INT, evt.u.size.w,
+				"height", G_TYPE_INT, evt.u.size.h, NULL);
+			msg = gst_message_new_element (GST_OBJECT (self), s);
+			gst_element_post_message (GST_ELEMENT (self), msg);
+		} else if (evt.type == VIDEO_EVENT_FRAME_RATE_CHANGED) {
+			self->framerate = evt.u.frame_rate;
+			GST_INFO_OBJECT(self, "decoder framerate %d", self->framerate);
+			s = gst_structure_new ("eventFrameRateChanged",
+				"frame_rate", G_TYPE_INT, evt.u.frame_rate, NULL);
+			msg = gst_message_new_element (GST_OBJECT (self), s);
+			gst_element_post_message (GST_ELEMENT (self), msg);
+		} else if (evt.type == 16 /*VIDEO_EVENT_PROGRESSIVE_CHANGED*/) {
+			s = gst_structure_new ("eventProgressiveChanged",
+				"progressive", G_TYPE_INT, evt.u.frame_rate, NULL);
+			msg = gst_message_new_element (GST_OBJECT (self), s);
+			gst_element_post_message (GST_ELEMENT (self), msg);
+		} else
+			g_warning ("unhandled DVBAPI Video Event %d", evt.type);
+	}
+}
+
+/* called from the writer thread */
+static void gst_dvbvideosink_writer_event(GstObject *sink)
+{
+	gst_dvbvideosink_handle_event(GST_DVBVIDEOSINK (sink));
+}
+
+static void gst_dvbvideosink_writer_flush(GstObject *sink)
+{
+	ioctl(GST_DVBVIDEOSINK (sink)->fd, VIDEO_CLEAR_BUFFER);
+}
+
+/* writes the whole iovec array (one frame) with writev.. the array is modified
+ * to keep track of partial writes */
+static int AsyncWrite(GstBaseSink * sink, GstDVBVideoSink *self, GstBuffer *buffer, struct iovec *iov, int iovcnt)
+{
+	struct pollfd pfd[2];
+	short revents[2];
+	gboolean queued;
+	gint no_write;
+	int uring_ret = 0, wr = 0, delay;
+	/* buffers whose data may be queued by reference while paused.. not the
+	 * h264 scratch buffer, it is rewritten for every frame */
+	GstBuffer *owners[4] = { buffer, self->prev_frame, self->codec_data, self->h264_field_pair };
+
+	if (writer_running(&self->writer))
+		return writer_push(&self->writer, iov, iovcnt, owners, 4);
+
+	pfd[0].fd = READ_SOCKET(self);
+	pfd[0].events = POLLIN;
+	pfd[1].fd = self->fd;
+	pfd[1].events = POLLOUT | POLLPRI;
+
+	iov_advance(&iov, &iovcnt, 0); // skip empty segments
+
+	while (iovcnt) {
+loop_start:
+		no_write = write_state_get(&self->no_write);
+		if (no_write & WRITE_FLUSHING) {
+			GST_DEBUG_OBJECT (self, "skip %d bytes", (int)iov_length(iov, iovcnt));
+			break;
+		}
+		else if (no_write & WRITE_QUEUE) {
+			// directly push to queue
+			int admit = queue_admit(&self->queue, no_write);
+			if (admit == QUEUE_PUSH) {
+				queue_pushv(&self->queue, iov, iovcnt, owners, 4);
+				if (buffer)
+					queue_stamp(&self->queue, GST_BUFFER_TIMESTAMP(buffer));
+			}
+			if (admit == QUEUE_BLOCK) {
+				/* over the high watermark, wait for a state change */
+				GST_DEBUG_OBJECT (self, "queue full, wait for resume");
+				if (poll(pfd, 1, -1) == -1 && errno != EINTR)
+					return -1;
+				if (pfd[0].revents & POLLIN) {
+					gchar command;
+					int res;
+					do
+						READ_COMMAND (self, command, res);
+					while (res >= 0);
+				}
+				goto loop_start;
+			}
+			if (admit == QUEUE_DROP)
+				GST_DEBUG_OBJECT (self, "queue full, dropped %d bytes", (int)iov_length(iov, iovcnt));
+			else {
+				GST_DEBUG_OBJECT (self, "pushed %d bytes to queue", (int)iov_length(iov, iovcnt));
+				queue_notify(GST_ELEMENT(self), &self->queue);
+			}
+			break;
+		}
+		else
+			GST_LOG_OBJECT (self, "going into poll, have %d bytes to write", (int)iov_length(iov, iovcnt));
+		/* the decoder buffer was full, give it time to drain */
+		delay = pacer_delay(&self->pacer);
+		pfd[1].events = delay ? POLLPRI : POLLOUT | POLLPRI;
+		if (uring_running(&self->uring) && !delay) {
+			/* the frame is only written directly when nothing is queued */
+			queued = queue_filled(&self->queue);
+			uring_ret = uring_poll_writev(&self->uring, pfd[0].fd, pfd[1].fd, POLLPRI,
+				queued ? NULL : iov, iovcnt, revents, &wr);
+			if (uring_ret == -1)
+				return -1;
+			if (uring_ret == 1) {
+				/* commands and events are level triggered and show up again
+				 * in the next iteration */
+				if (wr >= 0 || errno == EAGAIN)
+					pacer_written(&self->pacer, iov_length(iov, iovcnt), MAX(wr, 0));
+				if (wr < 0) {
+					if (errno == EINTR || errno == EAGAIN)
+						continue;
+					return -3;
+				}
+				iov_advance(&iov, &iovcnt, wr);
+				continue;
+			}
+			pfd[0].revents = revents[0];
+			pfd[1].revents = revents[1];
+		}
+		else if (poll(pfd, 2, delay ? delay : -1) == -1) {
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+		if (pfd[0].revents & POLLIN) {
+			/* read all stop commands */
+			while (TRUE) {
+				gchar command;
+				int res;
+				READ_COMMAND (self, command, res);
+				if (res < 0) {
+					GST_DEBUG_OBJECT (self, "no more commands");
+					/* no more commands */
+					goto loop_start;
+				}
+			}
+		}
+		if (pfd[1].revents & POLLPRI)
+			gst_dvbvideosink_handle_event(self);
+		if (pfd[1].revents & POLLOUT) {
+			struct iovec qiov[IOV_MAX_FRAME];
+			int qiovcnt;
+			qiovcnt = queue_frontv(&self->queue, qiov, IOV_MAX_FRAME);
+			if (qiovcnt) {
+				int wr = writev(self->fd, qiov, qiovcnt);
+				if (wr >= 0 || errno == EAGAIN)
+					pacer_written(&self->pacer, iov_length(qiov, qiovcnt), MAX(wr, 0));
+				if (wr < 0) {
+					switch (errno) {
+						case EINTR:
+						case EAGAIN:
+							break;
+						default:
+							return -3;
+					}
+				}
+				else {
+					queue_pop(&self->queue, wr);
+					GST_DEBUG_OBJECT (self, "written %d queue bytes... %d left", wr, (int)self->queue.bytes);
+					queue_notify(GST_ELEMENT(self), &self->queue);
+				}
+				continue;
+			}
+			wr = writev(self->fd, iov, iovcnt);
+			if (wr >= 0 || errno == EAGAIN)
+				pacer_written(&self->pacer, iov_length(iov, iovcnt), MAX(wr, 0));
+			if (wr < 0) {
+				switch (errno) {
+					case EINTR:
+					case EAGAIN:
+						continue;
+					default:
+						return -3;
+				}
+			}
+			iov_advance(&iov, &iovcnt, wr);
+		}
+	}
+
+	return 0;
+}
+
+static gboolean gst_dvbvideosink_coalesce_codec(GstDVBVideoSink *self)
+{
+	switch (self->codec_type) {
+	case CT_VP6:
+	case CT_SPARK:
+	case CT_MPEG4_PART2:
+	case CT_DIVX4:
+		return TRUE;
+	default:
+		return FALSE;
+	}
+}
+
+/* append one complete PES packet to the coalescing buffer */
+static void gst_dvbvideosink_coalesce_push(GstDVBVideoSink *self, GstBuffer *buffer, const struct iovec *iov, int iovcnt)
+{
+	size_t len = iov_length(iov, iovcnt);
+	int i;
+
+	GST_OBJECT_LOCK(self);
+	if (self->coalesce_bytes + len > self->coalesce_size) {
+		size_t size = MAX(self->coalesce_size, self->max_coalesce_bytes);
+		while (size < self->coalesce_bytes + len)
+			size *= 2;
+		self->coalesce_data = g_realloc(self->coalesce_data, size);
+		self->coalesce_size = size;
+	}
+	if (!self->coalesce_bytes)
+		self->coalesce_start = buffer ? GST_BUFFER_TIMESTAMP(buffer) : GST_CLOCK_TIME_NONE;
+	for (i = 0; i < iovcnt; ++i) {
+		memcpy(self->coalesce_data + self->coalesce_bytes, iov[i].iov_base, iov[i].iov_len);
+		self->coalesce_bytes += iov[i].iov_len;
+	}
+	GST_OBJECT_UNLOCK(self);
+}
+
+/* TRUE when the collected frames have to be written after the one in buffer */
+static gboolean gst_dvbvideosink_coalesce_full(GstDVBVideoSink *self, GstBuffer *buffer)
+{
+	GstClockTime end = buffer ? GST_BUFFER_TIMESTAMP(buffer) : GST_CLOCK_TIME_NONE;
+	gboolean flush;
+
+	if (end != GST_CLOCK_TIME_NONE && GST_BUFFER_DURATION(buffer) != GST_CLOCK_TIME_NONE)
+		end += GST_BUFFER_DURATION(buffer);
+
+	GST_OBJECT_LOCK(self);
+	flush = self->coalesce_bytes >= self->max_coalesce_bytes;
+	if (!flush && self->max_coalesce_latency && self->coalesce_start != GST_CLOCK_TIME_NONE &&
+		end != GST_CLOCK_TIME_NONE)
+		flush = end >= self->coalesce_start + self->max_coalesce_latency;
+	GST_OBJECT_UNLOCK(self);
+
+	return flush;
+}
+
+/* write the collected PES packets.. the storage is only written by the
+ * streaming thread, so it can be used without the lock once coalesce_bytes
+ * was reset */
+static int gst_dvbvideosink_coalesce_flush(GstBaseSink * sink, GstDVBVideoSink *self)
+{
+	struct iovec iov[1];
+	int iovcnt = 0;
+
+	GST_OBJECT_LOCK(self);
+	iov_add(iov, &iovcnt, self->coalesce_data, self->coalesce_bytes);
+	self->coalesce_bytes = 0;
+	GST_OBJECT_UNLOCK(self);
+
+	if (!iovcnt)
+		return 0;
+	GST_LOG_OBJECT (self, "write %d coalesced bytes", (int)iov[0].iov_len);
+	return AsyncWrite(sink, self, NULL, iov, iovcnt);
+}
+
+/* writes the payload as PES packets, the first one gets the header
+ * in pes_header and is preceded by prefix (complete PES packets of
+ * their own) in the same write */
+static int PesWrite(GstBaseSink * sink, GstDVBVideoSink *self, GstBuffer *buffer, const struct iovec *prefix, guint8 *pes_header, struct iovec *payload, int payloadcnt)
+{
+	struct iovec iov[IOV_MAX_PES];
+	int iovcnt, ret, first = 0;
+	pes_t pes;
+
+	if (self->tsmux) {
+		/* the muxer takes one PES at a time */
+		if (prefix && (ret = tsmux_write(self->tsmux, TSMUX_VIDEO, prefix, 1, READ_SOCKET(self), &self->no_write)))
+			return ret;
+		pes_init(&pes, pes_header, PES_HEADER_LEN(pes_header), payload, payloadcnt);
+		while ((iovcnt = pes_next(&pes, iov, IOV_MAX_PES)))
+			if ((ret = tsmux_write(self->tsmux, TSMUX_VIDEO, iov, iovcnt, READ_SOCKET(self), &self->no_write)))
+				return ret;
+		return 0;
+	}
+
+	/* coalescing might have been switched off with frames still collected */
+	if (self->max_coalesce_bytes && !prefix && gst_dvbvideosink_coalesce_codec(self)) {
+		pes_init(&pes, pes_header, PES_HEADER_LEN(pes_header), payload, payloadcnt);
+		while ((iovcnt = pes_next(&pes, iov, IOV_MAX_PES)))
+			gst_dvbvideosink_coalesce_push(self, buffer, iov, iovcnt);
+		if (gst_dvbvideosink_coalesce_full(self, buffer))
+			return gst_dvbvideosink_coalesce_flush(sink, self);
+		return 0;
+	}
+	if (self->coalesce_bytes && (ret = gst_dvbvideosink_coalesce_flush(sink, self)))
+		return ret;
+
+	if (prefix)
+		iov_add(iov, &first, prefix->iov_base, prefix->iov_len);
+	pes_init(&pes, pes_header, PES_HEADER_LEN(pes_header), payload, payloadcnt);
+	while ((iovcnt = pes_next(&pes, iov + first, IOV_MAX_PES - first))) {
+		ret = AsyncWrite(sink, self, buffer, iov, first + iovcnt);
+		if (ret)
+			return ret;
+		first = 0;
+	}
+	return 0;
+}
+
+#define PES_WRITE(prefix, payload, payloadcnt) do { \
+		switch(PesWrite(sink, self, buffer, prefix, pes_header, payload, payloadcnt)) { \
+		case -1: goto poll_error; \
+		case -3: goto write_error; \
+		default: break; \
+		} \
+	} while(0)
+
+static void gst_dvbvideosink_infer_reset(GstDVBVideoSink *self)
+{
+	self->infer_next = GST_CLOCK_TIME_NONE;
+	self->infer_gop = GST_CLOCK_TIME_NONE;
+	self->infer_display = GST_CLOCK_TIME_NONE;
+}
+
+static void gst_dvbvideosink_infer_caps(GstDVBVideoSink *self, const GstStructure *structure)
+{
+	gint numerator, denominator;
+	gboolean framed = FALSE, parsed = FALSE;
+
+	self->infer_duration = GST_CLOCK_TIME_NONE;
+	if (gst_structure_get_fraction(structure, "framerate", &numerator, &denominator) && numerator > 0 && denominator > 0)
+		self->infer_duration = gst_util_uint64_scale(GST_SECOND, denominator, numerator);
+	gst_structure_get_boolean(structure, "framed", &framed);
+	gst_structure_get_boolean(structure, "parsed", &parsed);
+	self->infer_framed = framed || parsed;
+}
+
+static GstClockTime gst_dvbvideosink_frame_duration(GstDVBVideoSink *self)
+{
+	if (self->infer_duration != GST_CLOCK_TIME_NONE)
+		return self->infer_duration;
+	if (self->framerate > 0)	// from the decoder, in 1/1000 Hz
+		return gst_util_uint64_scale(GST_SECOND, 1000, self->framerate);
+	return GST_CLOCK_TIME_NONE;
+}
+
+/* temporal reference of the first picture when the buffer starts with a
+ * start code, -1 otherwise. gop tells whether a GOP header comes first */
+static gint gst_dvbvideosink_mpeg_picture(const guint8 *data, unsigned int len, gboolean *gop)
+{
+	unsigned int pos;
+
+	*gop = FALSE;
+	if (len < 4 || data[0] || data[1] || data[2] != 1)
+		return -1;
+	for (pos = 0; (pos = startcode_find(data, len, pos)) + 5 < len; pos += 3) {
+		if (data[pos + 3] == 0xB8)
+			*gop = TRUE;
+		else if (data[pos + 3] == 0x00)
+			return data[pos + 4] << 2 | data[pos + 5] >> 6;
+	}
+	return -1;
+}
+
+/* returns the timestamp for the buffer, inferred from the frame rate when it
+ * has none. MPEG-1/2 pictures get it from their temporal reference, which
+ * also works with B-frames. The decode order of other codecs says nothing
+ * about the display order, they only get it on keyframes and the decoder
+ * interpolates the frames in between. Timestamped buffers are tracked too */
+static GstClockTime gst_dvbvideosink_infer_pts(GstDVBVideoSink *self, GstBuffer *buffer, const guint8 *data, unsigned int len)
+{
+	GstClockTime ts = GST_BUFFER_TIMESTAMP(buffer);
+	GstClockTime duration = gst_dvbvideosink_frame_duration(self);
+
+	if (duration == GST_CLOCK_TIME_NONE)
+		return ts;
+
+	if (self->codec_type == CT_MPEG1 || self->codec_type == CT_MPEG2) {
+		gboolean gop;
+		gint tr = gst_dvbvideosink_mpeg_picture(data, len, &gop);
+		if (tr < 0)	// not frame aligned
+			return ts;
+		if (gop && self->infer_display != GST_CLOCK_TIME_NONE)
+			self->infer_gop = self->infer_display;
+		if (ts != GST_CLOCK_TIME_NONE)
+			self->infer_gop = ts > tr * duration ? ts - tr * duration : 0;
+		else if (self->infer_gop != GST_CLOCK_TIME_NONE)
+			ts = self->infer_gop + tr * duration;
+		if (ts != GST_CLOCK_TIME_NONE && (self->infer_display == GST_CLOCK_TIME_NONE || ts + duration > self->infer_display))
+			self->infer_display = ts + duration;
+		return ts;
+	}
+
+	if (ts != GST_CLOCK_TIME_NONE) {
+		self->infer_next = ts + duration;
+		return ts;
+	}
+	if (!self->infer_framed || self->infer_next == GST_CLOCK_TIME_NONE)
+		return ts;
+	ts = self->infer_next;
+	self->infer_next += duration;
+	return GST_BUFFER_FLAG_IS_SET(buffer, GST_BUFFER_FLAG_DELTA_UNIT) ? GST_CLOCK_TIME_NONE : ts;
+}
+
+static GType gst_dvbvideosink_header_policy_get_type(void)
+{
+	static GType type = 0;
+	static const GEnumValue values[] = {
+		{ HEADER_POLICY_AUTO, "Per hardware (random-access on DM7025 and DM8000)", "auto" },
+		{ HEADER_POLICY_RANDOM_ACCESS, "At every random access point without in-band headers", "random-access" },
+		{ HEADER_POLICY_DISCONTINUITY, "After discontinuities, until the decoder has seen it", "discontinuity" },
+		{ 0, NULL, NULL }
+	};
+
+	if (!type)
+		type = g_enum_register_static("GstDVBVideoSinkHeaderPolicy", values);
+	return type;
+}
+
+static t_header_policy gst_dvbvideosink_header_policy(GstDVBVideoSink *self)
+{
+	if (self->header_policy != HEADER_POLICY_AUTO)
+		return self->header_policy;
+	return hwtype == DM7025 || hwtype == DM8000 ? HEADER_POLICY_RANDOM_ACCESS : HEADER_POLICY_DISCONTINUITY;
+}
+
+/* a random access point without parameter sets in the stream.. the decoder
+ * has the codec data since the last discontinuity unless must_send_header
+ * is still set */
+static void gst_dvbvideosink_header_random_access(GstDVBVideoSink *self)
+{
+	if (gst_dvbvideosink_header_policy(self) == HEADER_POLICY_RANDOM_ACCESS) {
+		GST_INFO_OBJECT(self, "send seq header");
+		self->must_send_header = 1;
+	}
+	else if (!self->must_send_header) {
+		GST_OBJECT_LOCK(self);
+		++self->header_skipped;
+		GST_OBJECT_UNLOCK(self);
+	}
+}
+
+/* TRUE when the frame brings its own sequence header / VOL in front of the
+ * picture, the codec data doesn't have to be injected then. VC-1 is not
+ * checked, its frames go out one render late */
+static gboolean gst_dvbvideosink_header_inband(GstDVBVideoSink *self, const guint8 *data, unsigned int len)
+{
+	guint8 first, last, picture;
+	unsigned int pos;
+
+	if (gst_dvbvideosink_header_policy(self) != HEADER_POLICY_DISCONTINUITY)
+		return FALSE;
+
+	switch (self->codec_type) {
+	case CT_MPEG1:
+	case CT_MPEG2:
+		first = last = 0xB3;
+		picture = 0x00;
+		break;
+	case CT_MPEG4_PART2:
+	case CT_DIVX4:
+		first = 0x20;	// video object layer
+		last = 0x2F;
+		picture = 0xB6;
+		break;
+	default:
+		return FALSE;
+	}
+
+	len = MIN(len, HEADER_SCAN_MAX);
+	for (pos = 0; (pos = startcode_find(data, len, pos)) + 3 < len; pos += 3) {
+		if (data[pos + 3] >= first && data[pos + 3] <= last)
+			return TRUE;
+		if (data[pos + 3] == picture)
+			break;
+	}
+	return FALSE;
+}
+
+static void gst_dvbvideosink_header_injected(GstDVBVideoSink *self, guint len)
+{
+	GST_OBJECT_LOCK(self);
+	++self->header_injected;
+	self->header_injected_bytes += len;
+	GST_OBJECT_UNLOCK(self);
+}
+
+/* start codes of a DivX/Xvid buffer the packed bitstream handling looks at
+ * (VOL, user data, VOP), collected in one pass. pos is behind the code byte */
+#define STARTCODE_INDEX_MAX	16
+
+struct startcode_index
+{
+	unsigned int count;
+	unsigned int pos[STARTCODE_INDEX_MAX];
+	guint8 code[STARTCODE_INDEX_MAX];
+};
+
+static void gst_dvbvideosink_startcode_index(struct startcode_index *index, const guint8 *data, unsigned int len)
+{
+	unsigned int pos = 0;
+
+	index->count = 0;
+	while (index->count < STARTCODE_INDEX_MAX && (pos = startcode_find(data, len, pos) + 3) < len) {
+		guint8 code = data[pos++];
+		if ((code & 0xF0) != 0x20 && code != 0xB2 && code != 0xB6)
+			continue;
+		index->pos[index->count] = pos;
+		index->code[index->count++] = code;
+	}
+}
+
+/* length of the "DivX<version>b<build>p" user data of a packed bitstream,
+ * 0 when it is something else */
+static unsigned int gst_dvbvideosink_divx_packed(const guint8 *data, unsigned int len)
+{
+	unsigned int pos = 4, start;
+
+	if (len < 4 || memcmp(data, "DivX", 4))
+		return 0;
+	for (start = pos; pos < len && data[pos] >= '0' && data[pos] <= '9'; ++pos);
+	if (pos == start || pos >= len || (data[pos] | 0x20) != 'b')
+		return 0;
+	for (start = ++pos; pos < len && data[pos] >= '0' && data[pos] <= '9'; ++pos);
+	if (pos == start || pos >= len || (data[pos] | 0x20) != 'p')
+		return 0;
+	return pos + 1;
+}
+
+/* stream_type of the PMT, private data for what ISO 13818-1 doesn't cover */
+static guint8 gst_dvbvideosink_ts_stream_type(t_codec_type codec_type)
+{
+	switch (codec_type) {
+	case CT_MPEG1:
+		return 0x01;
+	case CT_MPEG2:
+		return 0x02;
+	case CT_MPEG4_PART2:
+	case CT_DIVX4:
+		return 0x10;
+	case CT_H264:
+		return 0x1B;
+	case CT_VC1:
+	case CT_VC1_SIMPLE_MAIN:
+		return 0xEA;
+	default:
+		return 0x06;
+	}
+}
+
+static const guint8 pes_template[] = { 0x00, 0x00, 0x01, 0xE0, 0x00, 0x00, 0x80, 0x80, 0x05 };
+
+/* build the bytes sent in front of each frame once per stream, render
+ * then only picks them and patches the frame length */
+static void gst_dvbvideosink_build_templates(GstDVBVideoSink *self)
+{
+	const guint8 *codec_data;
+	guint codec_data_len;
+
+	g_free(self->codec_prefix);
+	self->codec_prefix = NULL;
+	self->codec_prefix_len = 0;
+	self->es_prefix_len = 0;
+
+	if (self->codec_data) {
+		switch (self->codec_type) {
+		case CT_MPEG4_PART2:
+			memcpy(self->es_prefix, "\x00\x00\x01", 3);
+			self->es_prefix_len = 3;
+			break;
+		case CT_VC1:
+		case CT_VC1_SIMPLE_MAIN:
+			memcpy(self->es_prefix, "\x00\x00\x01\x0d", 4);
+			self->es_prefix_len = 4;
+			break;
+		case CT_DIVX311:
+			memcpy(self->es_prefix, "\x00\x00\x01\xb6", 4);
+			self->es_prefix_len = 4;
+			break;
+		default:
+			break;
+		}
+	}
+	else if (self->codec_type == CT_VP8 || self->codec_type == CT_VP6 || self->codec_type == CT_SPARK) {
+		memset(self->es_prefix, 0, sizeof(self->es_prefix));
+		memcpy(self->es_prefix, "BCMV", 4);
+		self->es_prefix_len = self->codec_type == CT_VP6 ? 11 : 10;
+	}
+
+	// MPEG1/2 codec data is inserted in front of the GOP, the DivX 3.11 one is a PES of its own
+	if (!self->codec_data || self->codec_type == CT_MPEG1 || self->codec_type == CT_MPEG2 || self->codec_type == CT_DIVX311)
+		return;
+
+	codec_data = GST_BUFFER_DATA (self->codec_data);
+	codec_data_len = GST_BUFFER_SIZE (self->codec_data);
+	if (self->codec_type == CT_VC1) {
+		codec_data += 1;
+		codec_data_len -= 1;
+	}
+	self->codec_prefix_len = codec_data_len + self->es_prefix_len;
+	self->codec_prefix = g_malloc(self->codec_prefix_len);
+	memcpy(self->codec_prefix, codec_data, codec_data_len);
+	memcpy(self->codec_prefix + codec_data_len, self->es_prefix, self->es_prefix_len);
+}
+
+/* offset of the header byte of the first NAL, single is set when the buffer
+ * holds just this NAL. -1 when the buffer does not start with a NAL */
+static int gst_dvbvideosink_h264_nal(GstDVBVideoSink *self, const guint8 *data, unsigned int len, gboolean *single)
+{
+	unsigned int pos, i, nal_len = 0;
+
+	if (self->h264_nal_len_size) {
+		pos = self->h264_nal_len_size;
+		if (len <= pos)
+			return -1;
+		for (i = 0; i < pos; ++i)
+			nal_len = (nal_len << 8) | data[i];
+		*single = pos + nal_len >= len;
+		return pos;
+	}
+
+	if (len < 4 || data[0] || data[1])
+		return -1;
+	if (data[2] == 1)
+		pos = 3;
+	else if (!data[2] && data[3] == 1)
+		pos = 4;
+	else
+		return -1;
+	if (pos >= len)
+		return -1;
+	*single = startcode_find(data, len, pos + 1) + 2 >= len;
+	return pos;
+}
+
+static void gst_dvbvideosink_h264_au_clear(GstDVBVideoSink *self)
+{
+	if (self->h264_au)
+		gst_adapter_clear(self->h264_au);
+	self->h264_au_timestamp = GST_CLOCK_TIME_NONE;
+	self->h264_au_vcl = FALSE;
+}
+
+/* writes the pending access unit as one buffer */
+static GstFlowReturn gst_dvbvideosink_h264_au_push(GstDVBVideoSink *self)
+{
+	guint avail = self->h264_au ? gst_adapter_available(self->h264_au) : 0;
+	GstFlowReturn ret;
+	GstBuffer *au;
+
+	if (!avail)
+		return GST_FLOW_OK;
+
+	/* the adapter hands out the upstream buffer itself when it holds just that */
+	au = gst_buffer_make_metadata_writable(gst_adapter_take_buffer(self->h264_au, avail));
+	GST_BUFFER_TIMESTAMP(au) = self->h264_au_timestamp;
+	GST_BUFFER_DURATION(au) = GST_CLOCK_TIME_NONE;
+	self->h264_au_timestamp = GST_CLOCK_TIME_NONE;
+	self->h264_au_vcl = FALSE;
+
+	self->h264_au_output = TRUE;
+	ret = gst_dvbvideosink_render(GST_BASE_SINK(self), au);
+	self->h264_au_output = FALSE;
+	gst_buffer_unref(au);
+	return ret;
+}
+
+/* renders buffer as it is, after what was collected before */
+static GstFlowReturn gst_dvbvideosink_h264_au_bypass(GstDVBVideoSink *self, GstBuffer *buffer)
+{
+	GstFlowReturn ret = gst_dvbvideosink_h264_au_push(self);
+	if (ret != GST_FLOW_OK)
+		return ret;
+	self->h264_au_output = TRUE;
+	ret = gst_dvbvideosink_render(GST_BASE_SINK(self), buffer);
+	self->h264_au_output = FALSE;
+	return ret;
+}
+
+/* one NAL per buffer (RTP, some HLS parsers): collect the NALs of an access
+ * unit and write them in one PES. A new access unit starts with a new
+ * timestamp, an AUD, or after a slice with an SPS, PPS, SEI or the first
+ * slice (first_mb_in_slice 0) of the next picture. */
+static GstFlowReturn gst_dvbvideosink_h264_aggregate(GstDVBVideoSink *self, GstBuffer *buffer)
+{
+	const guint8 *data = GST_BUFFER_DATA(buffer);
+	unsigned int len = GST_BUFFER_SIZE(buffer);
+	GstClockTime timestamp = GST_BUFFER_TIMESTAMP(buffer);
+	gboolean single = FALSE, vcl, boundary;
+	GstFlowReturn ret = GST_FLOW_OK;
+	int pos = gst_dvbvideosink_h264_nal(self, data, len, &single);
+	int type;
+
+	if (pos < 0)
+		return gst_dvbvideosink_h264_au_bypass(self, buffer);
+	type = data[pos] & 0x1F;
+	vcl = type == 1 || type == 5;
+
+	if (self->h264_nal_aligned < 0) {
+		if (!single)
+			self->h264_nal_aligned = 0;
+		else if (!vcl)  // a whole access unit never is a lone SPS, PPS, SEI or AUD
+			self->h264_nal_aligned = 1;
+		else if (++self->h264_detect_count >= H264_DETECT_BUFFERS)
+			self->h264_nal_aligned = 0;
+		if (self->h264_nal_aligned >= 0)
+			GST_INFO_OBJECT(self, "H264 input is %s aligned", self->h264_nal_aligned ? "NAL" : "access unit");
+		if (!self->h264_nal_aligned)
+			return gst_dvbvideosink_h264_au_bypass(self, buffer);
+	}
+
+	boundary = type == 9 ||
+		(GST_CLOCK_TIME_IS_VALID(timestamp) && GST_CLOCK_TIME_IS_VALID(self->h264_au_timestamp) && timestamp != self->h264_au_timestamp) ||
+		(self->h264_au_vcl && ((type >= 6 && type <= 8) || (vcl && (unsigned int)pos + 1 < len && (data[pos+1] & 0x80))));
+	if (boundary)
+		ret = gst_dvbvideosink_h264_au_push(self);
+
+	if (!GST_CLOCK_TIME_IS_VALID(self->h264_au_timestamp))
+		self->h264_au_timestamp = timestamp;
+	if (vcl)
+		self->h264_au_vcl = TRUE;
+	gst_adapter_push(self->h264_au, gst_buffer_ref(buffer));
+	return ret;
+}
+
+/* copies the start of a NAL payload without emulation prevention bytes,
+ * the rest of out is zeroed so parsing past the end reads zeros */
+static unsigned int h264_unescape(guint8 *out, unsigned int outlen, const guint8 *data, unsigned int len)
+{
+	unsigned int i, n = 0, zeros = 0;
+	for (i = 0; i < len && n < outlen; ++i) {
+		if (zeros >= 2 && data[i] == 3) {
+			zeros = 0;
+			continue;
+		}
+		zeros = data[i] ? 0 : zeros + 1;
+		out[n++] = data[i];
+	}
+	memset(out + n, 0, outlen - n);
+	return n;
+}
+
+/* the SPS fields needed to read field_pic_flag from slice headers, data
+ * starts behind the NAL header */
+static void gst_dvbvideosink_h264_sps(GstDVBVideoSink *self, const guint8 *data, unsigned int len)
+{
+	guint8 rbsp[512];
+	struct bitstream bit;
+	unsigned int profile, chroma_format_idc = 1, i;
+
+	bitstream_init(&bit, rbsp, h264_unescape(rbsp, sizeof(rbsp), data, len), 0);
+	profile = bitstream_get(&bit, 8);
+	bitstream_get(&bit, 16); // constraint flags, level
+	bitstream_get_ue(&bit); // seq_parameter_set_id
+	self->h264_separate_colour_plane = FALSE;
+	if (profile == 100 || profile == 110 || profile == 122 || profile == 244 || profile == 44 ||
+			profile == 83 || profile == 86 || profile == 118 || profile == 128 || profile == 138 ||
+			profile == 139 || profile == 134 || profile == 135) {
+		chroma_format_idc = bitstream_get_ue(&bit);
+		if (chroma_format_idc == 3)
+			self->h264_separate_colour_plane = bitstream_get(&bit, 1);
+		bitstream_get_ue(&bit); // bit_depth_luma_minus8
+		bitstream_get_ue(&bit); // bit_depth_chroma_minus8
+		bitstream_get(&bit, 1); // qpprime_y_zero_transform_bypass_flag
+		if (bitstream_get(&bit, 1)) { // seq_scaling_matrix_present_flag
+			for (i = 0; i < (chroma_format_idc != 3 ? 8 : 12); ++i) {
+				if (bitstream_get(&bit, 1)) {
+					int j, last = 8, next = 8, size = i < 6 ? 16 : 64;
+					for (j = 0; j < size && next; ++j) {
+						next = (last + bitstream_get_se(&bit) + 256) % 256;
+						if (next)
+							last = next;
+					}
+				}
+			}
+		}
+	}
+	self->h264_log2_max_frame_num = bitstream_get_ue(&bit) + 4;
+	switch (bitstream_get_ue(&bit)) { // pic_order_cnt_type
+	case 0:
+		bitstream_get_ue(&bit); // log2_max_pic_order_cnt_lsb_minus4
+		break;
+	case 1:
+	{
+		unsigned long cycle;
+		bitstream_get(&bit, 1); // delta_pic_order_always_zero_flag
+		bitstream_get_se(&bit); // offset_for_non_ref_pic
+		bitstream_get_se(&bit); // offset_for_top_to_bottom_field
+		cycle = bitstream_get_ue(&bit);
+		while (cycle-- && cycle < 256)
+			bitstream_get_se(&bit);
+		break;
+	}
+	default:
+		break;
+	}
+	bitstream_get_ue(&bit); // max_num_ref_frames
+	bitstream_get(&bit, 1); // gaps_in_frame_num_value_allowed_flag
+	bitstream_get_ue(&bit); // pic_width_in_mbs_minus1
+	bitstream_get_ue(&bit); // pic_height_in_map_units_minus1
+	if (self->h264_log2_max_frame_num > 16) {
+		GST_WARNING_OBJECT(self, "broken SPS, no field pairing");
+		self->h264_frame_mbs_only = 1;
+		return;
+	}
+	self->h264_frame_mbs_only = bitstream_get(&bit, 1);
+	GST_INFO_OBJECT(self, "H264 SPS: profile %d, %s", profile, self->h264_frame_mbs_only ? "frames only" : "field coding possible");
+}
+
+/* the next NAL unit at or behind *pos, in AVC or byte stream format. Returns
+ * the offset of the NAL header or -1 when there is none, *pos is set behind
+ * the NAL unit. Empty ones are skipped */
+static gint gst_dvbvideosink_h264_next_nal(GstDVBVideoSink *self, const guint8 *data, unsigned int len, unsigned int *pos)
+{
+	unsigned int nal, nal_len, i;
+
+	if (!self->h264_nal_len_size) {
+		nal = startcode_find(data, len, *pos) + 3;
+		if (nal >= len)
+			return -1;
+		*pos = startcode_find(data, len, nal);
+		return nal;
+	}
+	do {
+		if (*pos + self->h264_nal_len_size >= len)
+			return -1;
+		for (nal_len = 0, i = 0; i < (unsigned int)self->h264_nal_len_size; ++i)
+			nal_len = (nal_len << 8) | data[(*pos)++];
+		nal = *pos;
+		*pos = MIN(len, nal + nal_len);
+	} while (!nal_len);
+	return nal;
+}
+
+/* looks for the first slice of the buffer, parsing SPS on the way.
+ * Returns 1 for a field (frame_num and bottom are set), 0 for a frame,
+ * -1 when there is no slice */
+static int gst_dvbvideosink_h264_field(GstDVBVideoSink *self, const guint8 *data, unsigned int len, guint *frame_num, gboolean *bottom)
+{
+	unsigned int pos = 0;
+	gint nal;
+
+	while ((nal = gst_dvbvideosink_h264_next_nal(self, data, len, &pos)) >= 0) {
+		unsigned int type = data[nal] & 0x1F;
+		if (type == 7)
+			gst_dvbvideosink_h264_sps(self, data + nal + 1, pos - nal - 1);
+		else if (type == 1 || type == 5) {
+			guint8 rbsp[32];
+			struct bitstream bit;
+			if (self->h264_frame_mbs_only)	// also no SPS yet
+				return 0;
+			bitstream_init(&bit, rbsp, h264_unescape(rbsp, sizeof(rbsp), data + nal + 1, pos - nal - 1), 0);
+			bitstream_get_ue(&bit); // first_mb_in_slice
+			bitstream_get_ue(&bit); // slice_type
+			bitstream_get_ue(&bit); // pic_parameter_set_id
+			if (self->h264_separate_colour_plane)
+				bitstream_get(&bit, 2);
+			*frame_num = bitstream_get(&bit, self->h264_log2_max_frame_num);
+			if (!bitstream_get(&bit, 1)) // field_pic_flag
+				return 0;
+			*bottom = bitstream_get(&bit, 1);
+			return 1;
+		}
+	}
+	return -1;
+}
+
+/* id of a SPS, SPS extension or PPS NAL unit, -1 when it is none or broken.
+ * sps_id is the SPS it belongs to */
+static gint h264_ps_id(const guint8 *nal, unsigned int len, guint *sps_id)
+{
+	guint8 rbsp[8];
+	struct bitstream bit;
+	guint id;
+
+	if (len < 2)
+		return -1;
+	bitstream_init(&bit, rbsp, h264_unescape(rbsp, sizeof(rbsp), nal + 1, len - 1), 0);
+	switch (nal[0] & 0x1F) {
+	case 7:
+		bitstream_get(&bit, 24); // profile, constraint flags, level
+		id = *sps_id = bitstream_get_ue(&bit);
+		break;
+	case 13:
+		id = *sps_id = bitstream_get_ue(&bit);
+		break;
+	case 8:
+		id = bitstream_get_ue(&bit);
+		*sps_id = bitstream_get_ue(&bit);
+		if (id >= H264_MAX_PPS)
+			return -1;
+		break;
+	default:
+		return -1;
+	}
+	if (bitstream_overread(&bit) || *sps_id >= H264_MAX_SPS)
+		return -1;
+	return id;
+}
+
+/* the decoders take level 4.1 at most (baseline, main, extended and high
+ * profile). Returns the original level when it was patched, 0 otherwise */
+static guint8 h264_level_patch(guint8 *sps, unsigned int len)
+{
+	static const guint8 profiles[] = { 66, 77, 88, 100 };
+	guint8 level;
+	unsigned int i;
+
+	if (len < 4 || sps[0] != 0x67 || sps[3] <= 0x29)
+		return 0;
+	for (i = 0; i < G_N_ELEMENTS(profiles) && sps[1] != profiles[i]; ++i);
+	if (i == G_N_ELEMENTS(profiles))
+		return 0;
+	level = sps[3];
+	sps[3] = 0x29; // level 4.1
+	return level;
+}
+
+/* keeps a copy of the parameter set, SPS with the level patched like the
+ * ones from avcC */
+static void gst_dvbvideosink_h264_ps_store(GstDVBVideoSink *self, const guint8 *nal, unsigned int len)
+{
+	GstBuffer **slot, *ps;
+	guint sps_id;
+	guint8 level = 0;
+	gint id = h264_ps_id(nal, len, &sps_id);
+
+	if (id < 0) {
+		GST_DEBUG_OBJECT(self, "broken parameter set, type %d", nal[0] & 0x1F);
+		return;
+	}
+	switch (nal[0] & 0x1F) {
+	case 7:
+		slot = &self->h264_sps[id];
+		break;
+	case 13:
+		slot = &self->h264_sps_ext[id];
+		break;
+	default:
+		slot = &self->h264_pps[id];
+		break;
+	}
+
+	ps = gst_buffer_new_and_alloc(len);
+	memcpy(GST_BUFFER_DATA(ps), nal, len);
+	if ((nal[0] & 0x1F) == 7)
+		level = h264_level_patch(GST_BUFFER_DATA(ps), len);
+	if (*slot && GST_BUFFER_SIZE(*slot) == len && !memcmp(GST_BUFFER_DATA(*slot), GST_BUFFER_DATA(ps), len)) {
+		gst_buffer_unref(ps);
+		return;
+	}
+	if (level)
+		GST_INFO_OBJECT (self, "H264 SPS %d profile %d@%d.%d patched down to 4.1!", id, nal[1], level / 10, level % 10);
+	GST_DEBUG_OBJECT(self, "parameter set type %d, id %d", nal[0] & 0x1F, id);
+	if (*slot)
+		gst_buffer_unref(*slot);
+	*slot = ps;
+}
+
+static void gst_dvbvideosink_h264_ps_clear(GstDVBVideoSink *self)
+{
+	unsigned int i;
+
+	for (i = 0; i < H264_MAX_SPS; ++i) {
+		if (self->h264_sps[i])
+			gst_buffer_unref(self->h264_sps[i]);
+		if (self->h264_sps_ext[i])
+			gst_buffer_unref(self->h264_sps_ext[i]);
+		self->h264_sps[i] = self->h264_sps_ext[i] = NULL;
+	}
+	for (i = 0; i < H264_MAX_PPS; ++i) {
+		if (self->h264_pps[i])
+			gst_buffer_unref(self->h264_pps[i]);
+		self->h264_pps[i] = NULL;
+	}
+}
+
+/* count entries of one avcC parameter set list into the cache */
+static gboolean gst_dvbvideosink_h264_avcc_sets(GstDVBVideoSink *self, const guint8 *data, unsigned int len, unsigned int *pos, unsigned int count)
+{
+	while (count--) {
+		unsigned int nal_len;
+		if (*pos + 2 > len)
+			return FALSE;
+		nal_len = (data[*pos] << 8) | data[*pos + 1];
+		*pos += 2;
+		if (!nal_len || *pos + nal_len > len)
+			return FALSE;
+		if ((data[*pos] & 0x1F) == 7)
+			gst_dvbvideosink_h264_sps(self, data + *pos + 1, nal_len - 1);
+		gst_dvbvideosink_h264_ps_store(self, data + *pos, nal_len);
+		*pos += nal_len;
+	}
+	return TRUE;
+}
+
+/* all parameter sets of the avcC record into the cache, the SPS extensions
+ * of the high profiles included */
+static gboolean gst_dvbvideosink_h264_avcc(GstDVBVideoSink *self, const guint8 *data, unsigned int len)
+{
+	unsigned int pos = 6;
+
+	if (len <= 7) {
+		GST_WARNING_OBJECT (self, "codec_data to short(1)");
+		return FALSE;
+	}
+	if (data[0] != 1) {
+		GST_WARNING_OBJECT (self, "wrong avcC version %d!", data[0]);
+		return FALSE;
+	}
+	if (!gst_dvbvideosink_h264_avcc_sets(self, data, len, &pos, data[5] & 0x1F) || pos >= len) {
+		GST_WARNING_OBJECT (self, "codec_data to short(2)");
+		return FALSE;
+	}
+	++pos;
+	if (!gst_dvbvideosink_h264_avcc_sets(self, data, len, &pos, data[pos - 1])) {
+		GST_WARNING_OBJECT (self, "codec_data to short(3)");
+		return FALSE;
+	}
+	// chroma format, bit depths and the SPS extensions, often left out
+	if ((data[1] == 100 || data[1] == 110 || data[1] == 122 || data[1] == 144) && pos + 4 <= len) {
+		pos += 4;
+		if (!gst_dvbvideosink_h264_avcc_sets(self, data, len, &pos, data[pos - 1]))
+			GST_WARNING_OBJECT (self, "codec_data to short(4)");
+	}
+	return TRUE;
+}
+
+/* appends the parameter set with a start code */
+static unsigned int h264_ps_put(guint8 *out, GstBuffer *ps)
+{
+	if (!ps)
+		return 0;
+	memcpy(out, "\x00\x00\x00\x01", 4);
+	memcpy(out + 4, GST_BUFFER_DATA(ps), GST_BUFFER_SIZE(ps));
+	return 4 + GST_BUFFER_SIZE(ps);
+}
 
-		GST_PAD_PREROLL_UNLOCK (sink->sinkpad);
-		while (1) {
-			retval = poll(pfd, 2, 250);
-			if (retval < 0) {
-				perror("poll in EVENT_EOS");
-				ret=FALSE;
-				break;
-			}
+/* the whole cache in byte stream format, NULL when it has no SPS or no PPS */
+static GstBuffer *gst_dvbvideosink_h264_ps_buffer(GstDVBVideoSink *self)
+{
+	GstBuffer **sets[] = { self->h264_sps, self->h264_sps_ext, self->h264_pps };
+	const unsigned int count[] = { H264_MAX_SPS, H264_MAX_SPS, H264_MAX_PPS };
+	unsigned int len[3] = { 0, 0, 0 }, i, j, pos = 0;
+	GstBuffer *buffer;
+
+	for (i = 0; i < 3; ++i)
+		for (j = 0; j < count[i]; ++j)
+			if (sets[i][j])
+				len[i] += 4 + GST_BUFFER_SIZE(sets[i][j]);
+	if (!len[0] || !len[2])
+		return NULL;
+	buffer = gst_buffer_new_and_alloc(len[0] + len[1] + len[2]);
+	for (i = 0; i < 3; ++i)
+		for (j = 0; j < count[i]; ++j)
+			pos += h264_ps_put(GST_BUFFER_DATA(buffer) + pos, sets[i][j]);
+	return buffer;
+}
 
-			if (pfd[0].revents & POLLIN) {
-				GST_DEBUG_OBJECT (self, "wait EOS aborted!!\n");
-				ret=FALSE;
-				break;
-			}
+/* stores the parameter sets in front of the first slice of the buffer.
+ * Returns the PPS id of the slice, -1 when there is none. intra is set for
+ * IDR and I/SI slices, inband when the buffer brings its SPS and PPS itself */
+static gint gst_dvbvideosink_h264_ps_scan(GstDVBVideoSink *self, const guint8 *data, unsigned int len, gboolean *inband, gboolean *intra)
+{
+	gboolean sps = FALSE, pps = FALSE;
+	unsigned int pos = 0;
+	gint nal;
+
+	while ((nal = gst_dvbvideosink_h264_next_nal(self, data, len, &pos)) >= 0) {
+		unsigned int type = data[nal] & 0x1F;
+		if (type == 7 || type == 8 || type == 13) {
+			gst_dvbvideosink_h264_ps_store(self, data + nal, pos - nal);
+			sps |= type == 7;
+			pps |= type == 8;
+		}
+		else if (type == 1 || type == 5) {
+			guint8 rbsp[16];
+			struct bitstream bit;
+			guint slice_type, id;
+			bitstream_init(&bit, rbsp, h264_unescape(rbsp, sizeof(rbsp), data + nal + 1, pos - nal - 1), 0);
+			bitstream_get_ue(&bit); // first_mb_in_slice
+			slice_type = bitstream_get_ue(&bit) % 5;
+			id = bitstream_get_ue(&bit); // pic_parameter_set_id
+			*intra = type == 5 || slice_type == 2 || slice_type == 4;
+			*inband = sps && pps;
+			return MIN(id, H264_MAX_PPS);
+		}
+	}
+	return -1;
+}
 
-			if (pfd[1].revents & POLLIN) {
-				GST_DEBUG_OBJECT (self, "got buffer empty from driver!\n");
-				break;
-			}
+/* keeps the parameter sets of the buffer. When the decoder needs them again
+ * and the buffer starts an IDR or I picture without its own, codec_prefix is
+ * set to the SPS (with extension) and PPS the picture refers to and TRUE is
+ * returned. Other pictures and unknown sets fall back to the whole codec
+ * data */
+static gboolean gst_dvbvideosink_h264_ps_update(GstDVBVideoSink *self, const guint8 *data, unsigned int len)
+{
+	GstBuffer *sps, *ext, *pps = NULL;
+	gboolean inband = FALSE, intra = FALSE;
+	gint id = gst_dvbvideosink_h264_ps_scan(self, data, len, &inband, &intra);
+	guint sps_id = 0;
+	unsigned int pos;
 
-			if (sink->flushing) {
-				GST_DEBUG_OBJECT (self, "wait EOS flushing!!\n");
-				ret=FALSE;
-				break;
-			}
-		}
-		GST_PAD_PREROLL_LOCK (sink->sinkpad);
+	if (!self->must_send_header || id < 0)
+		return FALSE;
+	self->must_send_header = 0;
 
-		break;
+	if (inband) {
+		GST_DEBUG_OBJECT(self, "parameter sets in band, not injected");
+		GST_OBJECT_LOCK(self);
+		++self->header_skipped;
+		GST_OBJECT_UNLOCK(self);
+		return FALSE;
 	}
-	case GST_EVENT_NEWSEGMENT:{
-		GstFormat fmt;
-		gboolean update;
-		gdouble rate, applied_rate;
-		gint64 cur, stop, time;
-		int skip = 0, repeat = 0;
-		gst_event_parse_new_segment_full (event, &update, &rate, &applied_rate,	&fmt, &cur, &stop, &time);
-		GST_DEBUG_OBJECT (self, "GST_EVENT_NEWSEGMENT rate=%f applied_rate=%f\n", rate, applied_rate);
-		
-		if (fmt == GST_FORMAT_TIME)
-		{	
-			if ( rate > 1 )
-				skip = (int) rate;
-			else if ( rate < 1 )
-				repeat = 1.0/rate;
 
-			ret = ioctl(self->fd, VIDEO_SLOWMOTION, repeat) < 0 ? FALSE : TRUE;
-			ret = ioctl(self->fd, VIDEO_FAST_FORWARD, skip) < 0 ? FALSE : TRUE;
-// 			gst_segment_set_newsegment_full (&dec->segment, update, rate, applied_rate, dformat, cur, stop, time);
-		}
-		break;
+	if (intra && id < H264_MAX_PPS)
+		pps = self->h264_pps[id];
+	if (!pps || h264_ps_id(GST_BUFFER_DATA(pps), GST_BUFFER_SIZE(pps), &sps_id) < 0 || !(sps = self->h264_sps[sps_id])) {
+		GST_DEBUG_OBJECT(self, "%s picture with PPS %d, send the whole codec data", intra ? "intra" : "inter", id);
+		gst_dvbvideosink_build_templates(self);
+		return self->codec_prefix_len != 0;
 	}
-
-	default:
-		break;
+	ext = self->h264_sps_ext[sps_id];
+
+	g_free(self->codec_prefix);
+	self->codec_prefix_len = 4 + GST_BUFFER_SIZE(sps) + (ext ? 4 + GST_BUFFER_SIZE(ext) : 0) + 4 + GST_BUFFER_SIZE(pps) + self->es_prefix_len;
+	self->codec_prefix = g_malloc(self->codec_prefix_len);
+	pos = h264_ps_put(self->codec_prefix, sps);
+	pos += h264_ps_put(self->codec_prefix + pos, ext);
+	pos += h264_ps_put(self->codec_prefix + pos, pps);
+	memcpy(self->codec_prefix + pos, self->es_prefix, self->es_prefix_len);
+	GST_DEBUG_OBJECT(self, "intra picture with PPS %d, SPS %d: send %d bytes of parameter sets", id, sps_id, (int)pos);
+	return TRUE;
+}
+static void gst_dvbvideosink_h264_field_clear(GstDVBVideoSink *self)
+{
+	if (self->h264_field) {
+		gst_buffer_unref(self->h264_field);
+		self->h264_field = NULL;
 	}
+}
 
+/* renders buffer without aggregating or pairing it */
+static GstFlowReturn gst_dvbvideosink_h264_render_direct(GstDVBVideoSink *self, GstBuffer *buffer)
+{
+	gboolean au_output = self->h264_au_output, field_output = self->h264_field_output;
+	GstFlowReturn ret;
+	self->h264_au_output = self->h264_field_output = TRUE;
+	ret = gst_dvbvideosink_render(GST_BASE_SINK(self), buffer);
+	self->h264_au_output = au_output;
+	self->h264_field_output = field_output;
 	return ret;
 }
 
-#define ASYNC_WRITE(data, len) do { \
-		switch(AsyncWrite(sink, self, data, len)) { \
-		case -1: goto poll_error; \
-		case -3: goto write_error; \
-		default: break; \
-		} \
-	} while(0)
+/* a field without its pair is written alone */
+static GstFlowReturn gst_dvbvideosink_h264_field_push(GstDVBVideoSink *self)
+{
+	GstBuffer *field = self->h264_field;
+	GstFlowReturn ret;
+	if (!field)
+		return GST_FLOW_OK;
+	self->h264_field = NULL;
+	ret = gst_dvbvideosink_h264_render_direct(self, field);
+	gst_buffer_unref(field);
+	return ret;
+}
 
-static int AsyncWrite(GstBaseSink * sink, GstDVBVideoSink *self, unsigned char *data, unsigned int len)
+/* PAFF streams remuxed into MKV carry one field per buffer, keep the first
+ * field until the second one (same frame_num, other parity) arrived and
+ * write both in one PES with the timestamp of the first. The first field is
+ * rendered, the second one follows in h264_field_pair without copying */
+static GstFlowReturn gst_dvbvideosink_h264_pair_fields(GstDVBVideoSink *self, GstBuffer *buffer)
 {
-	unsigned int written=0;
-	struct pollfd pfd[2];
+	guint frame_num = 0;
+	gboolean bottom = FALSE;
+	GstFlowReturn ret;
+	int field = gst_dvbvideosink_h264_field(self, GST_BUFFER_DATA(buffer), GST_BUFFER_SIZE(buffer), &frame_num, &bottom);
+
+	if (self->h264_field) {
+		if (field == 1 && frame_num == self->h264_field_frame_num && bottom != self->h264_field_bottom) {
+			/* only the metadata is copied for the duration of the pair */
+			GstBuffer *pair = gst_buffer_make_metadata_writable(self->h264_field);
+			self->h264_field = NULL;
+			if (GST_BUFFER_DURATION_IS_VALID(pair) && GST_BUFFER_DURATION_IS_VALID(buffer))
+				GST_BUFFER_DURATION(pair) += GST_BUFFER_DURATION(buffer);
+			else
+				GST_BUFFER_DURATION(pair) = GST_CLOCK_TIME_NONE;
+			self->h264_field_pair = buffer;
+			ret = gst_dvbvideosink_h264_render_direct(self, pair);
+			self->h264_field_pair = NULL;
+			gst_buffer_unref(pair);
+			return ret;
+		}
+		ret = gst_dvbvideosink_h264_field_push(self);
+		if (ret != GST_FLOW_OK)
+			return ret;
+	}
 
-	pfd[0].fd = READ_SOCKET(self);
-	pfd[0].events = POLLIN;
-	pfd[1].fd = self->fd;
-	pfd[1].events = POLLOUT | POLLPRI;
+	if (field == 1) {
+		self->h264_field = gst_buffer_ref(buffer);
+		self->h264_field_frame_num = frame_num;
+		self->h264_field_bottom = bottom;
+		return GST_FLOW_OK;
+	}
+	return gst_dvbvideosink_h264_render_direct(self, buffer);
+}
 
-	do {
-loop_start:
-		if (self->no_write & 1) {
-			GST_DEBUG_OBJECT (self, "skip %d bytes", len - written);
-			break;
-		}
-		else if (self->no_write & 6) {
-			// directly push to queue
-			GST_OBJECT_LOCK(self);
-			queue_push(&self->queue, data + written, len - written);
-			GST_OBJECT_UNLOCK(self);
-			GST_DEBUG_OBJECT (self, "pushed %d bytes to queue", len - written);
-			break;
-		}
-		else
-			GST_LOG_OBJECT (self, "going into poll, have %d bytes to write", len - written);
-		if (poll(pfd, 2, -1) == -1) {
-			if (errno == EINTR)
-				continue;
-			return -1;
-		}
-		if (pfd[0].revents & POLLIN) {
-			/* read all stop commands */
-			while (TRUE) {
-				gchar command;
-				int res;
-				READ_COMMAND (self, command, res);
-				if (res < 0) {
-					GST_DEBUG_OBJECT (self, "no more commands");
-					/* no more commands */
-					goto loop_start;
-				}
-			}
-		}
-		if (pfd[1].revents & POLLPRI) {
-			GstStructure *s;
-			GstMessage *msg;
-			struct video_event evt;
-			if (ioctl(self->fd, VIDEO_GET_EVENT, &evt) < 0)
-				g_warning ("failed to ioctl VIDEO_GET_EVENT!");
-			else {
-				GST_INFO_OBJECT (self, "VIDEO_EVENT %d", evt.type);
-				if (evt.type == VIDEO_EVENT_SIZE_CHANGED) {
-					s = gst_structure_new ("eventSizeChanged",
-						"aspect_ratio", G_TYPE_INT, evt.u.size.aspect_ratio == 0 ? 2 : 3,
-						"width", G_TYPE_INT, evt.u.size.w,
-						"height", G_TYPE_INT, evt.u.size.h, NULL);
-					msg = gst_message_new_element (GST_OBJECT (sink), s);
-					gst_element_post_message (GST_ELEMENT (sink), msg);
-				} else if (evt.type == VIDEO_EVENT_FRAME_RATE_CHANGED) {
-					self->framerate = evt.u.frame_rate;
-					GST_INFO_OBJECT(self, "decoder framerate %d", self->framerate);
-					s = gst_structure_new ("eventFrameRateChanged",
-						"frame_rate", G_TYPE_INT, evt.u.frame_rate, NULL);
-					msg = gst_message_new_element (GST_OBJECT (sink), s);
-					gst_element_post_message (GST_ELEMENT (sink), msg);
-				} else if (evt.type == 16 /*VIDEO_EVENT_PROGRESSIVE_CHANGED*/) {
-					s = gst_structure_new ("eventProgressiveChanged",
-						"progressive", G_TYPE_INT, evt.u.frame_rate, NULL);
-					msg = gst_message_new_element (GST_OBJECT (sink), s);
-					gst_element_post_message (GST_ELEMENT (sink), msg);
-				} else
-					g_warning ("unhandled DVBAPI Video Event %d", evt.type);
-			}
-		}
-		if (pfd[1].revents & POLLOUT) {
-			size_t queue_entry_size;
-			guint8 *queue_data;
-			GST_OBJECT_LOCK(self);
-			if (queue_front(&self->queue, &queue_data, &queue_entry_size)) {
-				int wr = write(self->fd, queue_data, queue_entry_size);
-				if (wr < 0) {
-					switch (errno) {
-						case EINTR:
-						case EAGAIN:
-							break;
-						default:
-							GST_OBJECT_UNLOCK(self);
-							return -3;
-					}
-				}
-				else if (wr == queue_entry_size) {
-					queue_pop(&self->queue);
-					GST_DEBUG_OBJECT (self, "written %d queue bytes... pop entry", wr);
-				}
-				else {
-					self->queue->offset += wr;
-					GST_DEBUG_OBJECT (self, "written %d queue bytes... update offset", wr);
-				}
-				GST_OBJECT_UNLOCK(self);
-				continue;
-			}
-			GST_OBJECT_UNLOCK(self);
-			int wr = write(self->fd, data+written, len - written);
-			if (wr < 0) {
-				switch (errno) {
-					case EINTR:
-					case EAGAIN:
-						continue;
-					default:
-						return -3;
-				}
-			}
-			written += wr;
-		}
-	} while (written != len);
+/* AVC to byte stream without touching the buffer: the NAL units are
+ * referenced in place, each behind a start code segment (4 bytes for 4 byte
+ * lengths, 3 otherwise). They follow the cnt segments of front in
+ * self->h264_iov, which grows with the number of NAL units. front may be
+ * self->h264_iov itself to append. Returns the number of segments */
+static int gst_dvbvideosink_h264_annexb(GstDVBVideoSink *self, const struct iovec *front, int cnt, const guint8 *data, unsigned int len)
+{
+	static const guint8 startcode[4] = { 0, 0, 0, 1 };
+	unsigned int size = self->h264_nal_len_size, pos = 0, i;
+	int iovcnt = cnt;
 
-	return 0;
+	if (!self->h264_iov) {
+		self->h264_iov_size = IOV_MAX_PES;
+		self->h264_iov = g_new(struct iovec, self->h264_iov_size);
+	}
+	if (front != self->h264_iov)
+		memcpy(self->h264_iov, front, cnt * sizeof(*front));
+
+	while (pos + size < len) {
+		unsigned int nal_len = 0;
+		for (i = 0; i < size; ++i)
+			nal_len = (nal_len << 8) | data[pos++];
+		nal_len = MIN(nal_len, len - pos);
+		if (!nal_len)
+			continue;
+		if (iovcnt + 2 > self->h264_iov_size) {
+			self->h264_iov_size *= 2;
+			self->h264_iov = g_renew(struct iovec, self->h264_iov, self->h264_iov_size);
+		}
+		iov_add(self->h264_iov, &iovcnt, size == 4 ? startcode : startcode + 1, size == 4 ? 4 : 3);
+		iov_add(self->h264_iov, &iovcnt, data + pos, nal_len);
+		pos += nal_len;
+	}
+	return iovcnt;
 }
 
 static GstFlowReturn
@@ -833,13 +2292,22 @@ gst_dvbvideosink_render (GstBaseSink * sink, GstBuffer * buffer)
 	GstDVBVideoSink *self = GST_DVBVIDEOSINK (sink);
 	unsigned char *data = GST_BUFFER_DATA(buffer);
 	unsigned int data_len = GST_BUFFER_SIZE (buffer);
-	guint8 pes_header[2048];
+	guint8 pes_header[64];
 	unsigned int pes_header_len=0;
-	unsigned int payload_len=0;
+	struct iovec iov[IOV_MAX_FRAME], *payload = iov;
+	int iovcnt = 0;
+	struct iovec prefix = { NULL, 0 }; // complete PES packets sent in front of the frame
+	const guint8 *es_prefix = self->es_prefix;
+	guint8 bcmv[ES_PREFIX_MAX];
+	GstClockTime timestamp;
+	struct startcode_index index;
+	unsigned int i;
 //	int i=0;
 
 	gboolean commit_prev_frame_data = FALSE,
-			cache_prev_frame = FALSE;
+			cache_prev_frame = FALSE,
+			send_codec_data = FALSE,
+			send_es_prefix = FALSE;
 
 //	for (;i < (data_len > 0xF ? 0xF : data_len); ++i)
 //		printf("%02x ", data[i]);
@@ -849,23 +2317,33 @@ gst_dvbvideosink_render (GstBaseSink * sink, GstBuffer * buffer)
 	if (self->fd < 0)
 		return GST_FLOW_OK;
 
+	if (self->codec_type == CT_H264 && self->h264_nal_aligned && !self->h264_au_output)
+		return gst_dvbvideosink_h264_aggregate(self, buffer);
+
+	if (self->codec_type == CT_H264 && self->h264_frame_mbs_only != 1 && !self->h264_field_output)
+		return gst_dvbvideosink_h264_pair_fields(self, buffer);
+
+	timestamp = gst_dvbvideosink_infer_pts(self, buffer, data, data_len);
+	if (timestamp != GST_BUFFER_TIMESTAMP(buffer)) {
+		GstFlowReturn ret;
+		buffer = gst_buffer_make_metadata_writable(gst_buffer_ref(buffer));
+		GST_BUFFER_TIMESTAMP(buffer) = timestamp;
+		GST_LOG_OBJECT(self, "inferred timestamp %" GST_TIME_FORMAT, GST_TIME_ARGS(GST_BUFFER_TIMESTAMP(buffer)));
+		ret = gst_dvbvideosink_render(sink, buffer);
+		gst_buffer_unref(buffer);
+		return ret;
+	}
+
 	if (self->must_pack_bitstream == 1) {
 		cache_prev_frame = TRUE;
-		unsigned int pos = 0;
-		while(pos < data_len) {
-			if (data[pos++])
-				continue;
-			if (data[pos++])
-				continue;
-			while (!data[pos])
-				++pos;
-			if (data[pos++] != 1)
-				continue;
-			if ((data[pos++] & 0xF0) == 0x20) { // we need time_inc_res
+		gst_dvbvideosink_startcode_index(&index, data, data_len);
+		for (i = 0; i < index.count; ++i) {
+			unsigned int pos = index.pos[i];
+			if ((index.code[i] & 0xF0) == 0x20) { // we need time_inc_res
 				__attribute__((unused)) gboolean low_delay = FALSE;
 				unsigned int ver_id = 1, shape=0, time_inc_res=0, tmp=0;
 				struct bitstream bit;
-				bitstream_init(&bit, data+pos, 0);
+				bitstream_init(&bit, data+pos, data_len-pos, 0);
 				bitstream_get(&bit, 9);
 				if (bitstream_get(&bit, 1)) {
 					ver_id = bitstream_get(&bit, 4); // ver_id
@@ -900,24 +2378,14 @@ gst_dvbvideosink_render (GstBaseSink * sink, GstBuffer * buffer)
 	}
 
 	if (self->must_pack_bitstream == 1) {
-		int tmp1, tmp2;
-		unsigned char c1, c2;
-		unsigned int pos = 0;
-		while(pos < data_len) {
-			if (data[pos++])
-				continue;
-			if (data[pos++])
-				continue;
-			while (!data[pos])
-				++pos;
-			if (data[pos++] != 1)
-				continue;
-			if (data[pos++] != 0xB2)
+		for (i = 0; i < index.count; ++i) {
+			unsigned int pos = index.pos[i], len;
+			if (index.code[i] != 0xB2)
 				continue;
 			if (data_len - pos < 13)
 				break;
-			if (sscanf((char*)data+pos, "DivX%d%c%d%cp", &tmp1, &c1, &tmp2, &c2) == 4 && (c1 == 'b' || c1 == 'B') && (c2 == 'p' || c2 == 'P')) {
-				GST_INFO_OBJECT (self, "%s seen... already packed!", (char*)data+pos);
+			if ((len = gst_dvbvideosink_divx_packed(data + pos, data_len - pos))) {
+				GST_INFO_OBJECT (self, "%.*s seen... already packed!", (int)len, (char*)data+pos);
 				self->must_pack_bitstream = 0;
 			}
 //			if (self->must_pack_bitstream)
@@ -927,129 +2395,76 @@ gst_dvbvideosink_render (GstBaseSink * sink, GstBuffer * buffer)
 		}
 	}
 
-	pes_header[0] = 0;
-	pes_header[1] = 0;
-	pes_header[2] = 1;
-	pes_header[3] = 0xE0;
+	if (self->codec_type == CT_H264 && gst_dvbvideosink_h264_ps_update(self, data, data_len))
+		send_codec_data = TRUE;
+
+	memcpy(pes_header, pes_template, sizeof(pes_template));
 
 		/* do we have a timestamp? */
 	if (GST_BUFFER_TIMESTAMP(buffer) != GST_CLOCK_TIME_NONE) {
-		unsigned long long pts = GST_BUFFER_TIMESTAMP(buffer) * 9LL / 100000 /* convert ns to 90kHz */;
-
-		pes_header[6] = 0x80;
-		pes_header[7] = 0x80;
-		
-		pes_header[8] = 5;
-		
-		pes_header[9] =  0x21 | ((pts >> 29) & 0xE);
-		pes_header[10] = pts >> 22;
-		pes_header[11] = 0x01 | ((pts >> 14) & 0xFE);
-		pes_header[12] = pts >> 7;
-		pes_header[13] = 0x01 | ((pts << 1) & 0xFE);
+		unsigned long long pts;
 
+		GST_OBJECT_LOCK(self);
+		pts = pts_map_write(&self->pts_map, GST_BUFFER_TIMESTAMP(buffer));
+		GST_OBJECT_UNLOCK(self);
+		pes_put_timestamp(pes_header + 9, 0x21, pts);
 		pes_header_len = 14;
 
-		if (self->codec_data) {
+		/* VC-1 and packed bitstreams are sent with the timestamp of the previous
+		 * frame, which is written below without a DTS */
+		if ((self->dts_codecs & (1 << self->codec_type)) && !self->must_pack_bitstream && self->codec_type != CT_VC1) {
+			GstClockTime ts = gst_dvbvideosink_dts(self, GST_BUFFER_TIMESTAMP(buffer), GST_BUFFER_DURATION(buffer));
+			unsigned long long dts = pts_map_convert(&self->pts_map, ts);
+			if (GST_CLOCK_TIME_IS_VALID(ts) && dts != pts) {
+				pes_header[7] = 0xC0;
+				pes_header[8] = 10;
+				pes_header[9] |= 0x10;
+				pes_put_timestamp(pes_header + 14, 0x11, dts);
+				pes_header_len = 19;
+			}
+		}
+
+		if (self->codec_data && self->codec_type != CT_H264) {	// H.264 waits for an IDR, see below
 			switch (self->codec_type) { // we must always resend the codec data before every seq header on dm8k
 			case CT_VC1:
-				if (self->no_header && self->ucPrevFramePicType == 6) {  // I-Frame...
-					GST_INFO_OBJECT(self, "send seq header");
-					self->must_send_header = 1;
-				}
+				if (self->no_header && self->ucPrevFramePicType == 6)  // I-Frame...
+					gst_dvbvideosink_header_random_access(self);
 				break;
 			case CT_MPEG4_PART2:
 			case CT_DIVX4:
 				if (data[0] == 0xb3 || !memcmp(data, "\x00\x00\x01\xb3", 4))
-					self->must_send_header = 1;
+					gst_dvbvideosink_header_random_access(self);
 			default:
 				break;
 			}
+			if (self->must_send_header && gst_dvbvideosink_header_inband(self, data, data_len)) {
+				GST_DEBUG_OBJECT(self, "codec data in band, not injected");
+				self->must_send_header = 0;
+				GST_OBJECT_LOCK(self);
+				++self->header_skipped;
+				GST_OBJECT_UNLOCK(self);
+			}
 			if (self->must_send_header) {
 				if (self->codec_type != CT_MPEG1 && self->codec_type != CT_MPEG2 && (self->codec_type != CT_DIVX4 || data[3] == 0x00)) {
-					unsigned char *codec_data = GST_BUFFER_DATA (self->codec_data);
-					unsigned int codec_data_len = GST_BUFFER_SIZE (self->codec_data);
-					if (self->codec_type == CT_VC1) {
-						codec_data += 1;
-						codec_data_len -= 1;
-					}
-					if (self->codec_type == CT_DIVX311)
-						ASYNC_WRITE(codec_data, codec_data_len);
-					else {
-						memcpy(pes_header+pes_header_len, codec_data, codec_data_len);
-						pes_header_len += codec_data_len;
+					if (self->codec_type == CT_DIVX311) { // the divx311 sequence header has its own PES header
+						prefix.iov_base = GST_BUFFER_DATA (self->codec_data);
+						prefix.iov_len = GST_BUFFER_SIZE (self->codec_data);
+						gst_dvbvideosink_header_injected(self, prefix.iov_len);
 					}
+					else
+						send_codec_data = TRUE;
 					self->must_send_header = 0;
 				}
 			}
-			if (self->codec_type == CT_H264) {  // MKV stuff
-				unsigned int pos = 0;
-				if (self->h264_nal_len_size == 4) {
-					while(TRUE) {
-						unsigned int pack_len = (data[pos] << 24) | (data[pos+1] << 16) | (data[pos+2] << 8) | data[pos+3];
-//						printf("patch %02x %02x %02x %02x\n",
-//							data[pos],
-//							data[pos + 1],
-//							data[pos + 2],
-//							data[pos + 3]);
-						memcpy(data+pos, "\x00\x00\x00\x01", 4);
-//						printf("pos %d, (%d) >= %d\n", pos, pos+pack_len, data_len);
-						pos += 4;
-						if ((pos + pack_len) >= data_len)
-							break;
-						pos += pack_len;
-					}
-				}
-				else if (self->h264_nal_len_size == 3) {
-					while(TRUE) {
-						unsigned int pack_len = (data[pos] << 16) | (data[pos+1] << 8) | data[pos+2];
-//						printf("patch %02x %02x %02x\n",
-//							data[pos],
-//							data[pos + 1],
-//							data[pos + 2]);
-						memcpy(data+pos, "\x00\x00\x01", 3);
-//						printf("pos %d, (%d) >= %d\n", pos, pos+pack_len, data_len);
-						pos += 3;
-						if ((pos + pack_len) >= data_len)
-							break;
-						pos += pack_len;
-					}
-				}
-				else {
-					unsigned char *dest = GST_BUFFER_DATA (self->h264_buffer);
-					unsigned int dest_pos = 0;
-					while(TRUE) {
-						unsigned int pack_len = self->h264_nal_len_size == 2 ? (data[pos] << 8) | data[pos+1] : data[pos];
-						if (dest_pos + pack_len <= H264_BUFFER_SIZE) {
-							memcpy(dest+dest_pos, "\x00\x00\x01", 3);
-							dest_pos += 3;
-							pos += self->h264_nal_len_size;
-							memcpy(dest+dest_pos, data+pos, pack_len);
-							dest_pos += pack_len;
-							if ((pos + pack_len) >= data_len)
-								break;
-							pos += pack_len;
-						}
-						else {
-							g_error("BUG!!!!!!!! H264 buffer to small skip video data!!.. please report!\n");
-							break;
-						}
-					}
-					data = dest;
-					data_len = dest_pos;
-				}
-			}
-			else if (self->codec_type == CT_MPEG4_PART2) {
-				if (data[0] || data[1] || data[2] != 1) {
-					memcpy(pes_header+pes_header_len, "\x00\x00\x01", 3);
-					pes_header_len += 3;
-				}
+			if (self->codec_type == CT_MPEG4_PART2) {
+				if (data[0] || data[1] || data[2] != 1)
+					send_es_prefix = TRUE;
 			}
 			else if (self->codec_type == CT_VC1 || self->codec_type == CT_VC1_SIMPLE_MAIN) {
 				int skip_header_check;
 
 				if (data[0] || data[1] || data[2] != 1) {
-					memcpy(pes_header+pes_header_len, "\x00\x00\x01\x0d", 4);
-					pes_header_len += 4;
+					send_es_prefix = TRUE;
 					skip_header_check = 1;
 				}
 				else
@@ -1058,7 +2473,7 @@ gst_dvbvideosink_render (GstBaseSink * sink, GstBuffer * buffer)
 				self->no_header = skip_header_check;
 
 				if (self->codec_type == CT_VC1) {
-					unsigned char ucRetVal = Vc1HandleStreamBuffer( self, data, skip_header_check );
+					unsigned char ucRetVal = Vc1HandleStreamBuffer( self, data, data_len, skip_header_check );
 					if ( ucRetVal != cVC1NoBufferDataAvailable ) {
 						data_len = GST_BUFFER_SIZE(self->prev_frame);
 						data = GST_BUFFER_DATA(self->prev_frame);
@@ -1076,50 +2491,34 @@ gst_dvbvideosink_render (GstBaseSink * sink, GstBuffer * buffer)
 				}
 			}
 			else if (self->codec_type == CT_DIVX311) {
-				if (data[0] || data[1] || data[2] != 1 || data[3] != 0xb6) {
-					memcpy(pes_header+pes_header_len, "\x00\x00\x01\xb6", 4);
-					pes_header_len += 4;
-				}
+				if (data[0] || data[1] || data[2] != 1 || data[3] != 0xb6)
+					send_es_prefix = TRUE;
 			}
 		}
-		else if (self->codec_type == CT_VP8 || self->codec_type == CT_VP6 || self->codec_type == CT_SPARK) {
-			uint32_t len = data_len + 4 + 6;
-			memcpy(pes_header+pes_header_len, "BCMV", 4);
-			pes_header_len += 4;
-			if (self->codec_type == CT_VP6)
-				++len;
-			pes_header[pes_header_len++] = (len & 0xFF000000) >> 24;
-			pes_header[pes_header_len++] = (len & 0x00FF0000) >> 16;
-			pes_header[pes_header_len++] = (len & 0x0000FF00) >> 8;
-			pes_header[pes_header_len++] = (len & 0x000000FF) >> 0;
-			pes_header[pes_header_len++] = 0;
-			pes_header[pes_header_len++] = 0;
-			if (self->codec_type == CT_VP6)
-				pes_header[pes_header_len++] = 0;
+		else if (self->es_prefix_len) { // VP6, VP8, Spark: BCMV header with the frame length
+			uint32_t len = data_len + self->es_prefix_len;
+			memcpy(bcmv, self->es_prefix, self->es_prefix_len);
+			bcmv[4] = (len & 0xFF000000) >> 24;
+			bcmv[5] = (len & 0x00FF0000) >> 16;
+			bcmv[6] = (len & 0x0000FF00) >> 8;
+			bcmv[7] = (len & 0x000000FF) >> 0;
+			es_prefix = bcmv;
+			send_es_prefix = TRUE;
 		}
 	}
 	else {
 //		printf("no timestamp!\n");
-		pes_header[6] = 0x80;
 		pes_header[7] = 0x00;
 		pes_header[8] = 0;
 		pes_header_len = 9;
 	}
 
 	if (self->must_pack_bitstream == 1) {
-		unsigned int pos = 0;
 		gboolean i_frame = FALSE;
 //		gboolean s_frame = FALSE;
-		while(pos < data_len) {
-			if (data[pos++])
-				continue;
-			if (data[pos++])
-				continue;
-			while (!data[pos])
-				++pos;
-			if (data[pos++] != 1)
-				continue;
-			if (data[pos++] != 0xB6)
+		for (i = 0; i < index.count && index.pos[i] < data_len; ++i) {	// data_len is 0 after a pack frame
+			unsigned int pos = index.pos[i];
+			if (index.code[i] != 0xB6)
 				continue;
 			switch ((data[pos] & 0xC0) >> 6) {
 				case 0: // I-Frame
@@ -1132,6 +2531,7 @@ gst_dvbvideosink_render (GstBaseSink * sink, GstBuffer * buffer)
 					if (self->prev_frame != buffer) {
 						struct bitstream bit;
 						gboolean store_frame=FALSE;
+						unsigned int buffer_len = GST_BUFFER_SIZE(buffer);
 						if (self->prev_frame) {
 							if (!self->num_non_keyframes) {
 //								printf("no non keyframes...immediate commit prev frame\n");
@@ -1148,21 +2548,21 @@ gst_dvbvideosink_render (GstBaseSink * sink, GstBuffer * buffer)
 								pes_header[pes_header_len++] = 0;
 								pes_header[pes_header_len++] = 1;
 								pes_header[pes_header_len++] = 0xB6;
-								bitstream_init(&bit, pes_header+pes_header_len, 1);
+								bitstream_init(&bit, pes_header+pes_header_len, sizeof(pes_header)-pes_header_len, 1);
 								bitstream_put(&bit, 1, 2);
 								bitstream_put(&bit, 0, 1);
 								bitstream_put(&bit, 1, 1);
 								bitstream_put(&bit, self->time_inc, self->time_inc_bits);
 								bitstream_put(&bit, 1, 1);
 								bitstream_put(&bit, 0, 1);
-								bitstream_put(&bit, 0x7F >> bit.avail, 8 - bit.avail);
+								bitstream_put(&bit, 0x7F >> bit.avail, 8 - bit.avail);	// stuffing up to the byte boundary
 //								printf(" insert pack frame %d non keyframes, time_inc %d, time_inc_bits %d -",
 //									self->num_non_keyframes, self->time_inc, self->time_inc_bits);
-//								for (; i < (bit.data - (pes_header+pes_header_len)); ++i)
+//								for (; i < bitstream_tell(&bit) / 8; ++i)
 //									printf(" %02x", pes_header[pes_header_len+i]);
 //								printf("\nset data_len to 0!\n");
 								data_len = 0;
-								pes_header_len += bit.data - (pes_header+pes_header_len);
+								pes_header_len += bitstream_tell(&bit) / 8;
 								cache_prev_frame = TRUE;
 							}
 						}
@@ -1171,8 +2571,8 @@ gst_dvbvideosink_render (GstBaseSink * sink, GstBuffer * buffer)
 
 						self->num_non_keyframes=0;
 
-						// extract time_inc
-						bitstream_init(&bit, data+pos, 0);
+						// extract time_inc.. data_len is 0 after a pack frame, the vop is still in the buffer
+						bitstream_init(&bit, data+pos, pos < buffer_len ? buffer_len - pos : 0, 0);
 						bitstream_get(&bit, 2); // skip coding_type
 						while(bitstream_get(&bit, 1));
 						bitstream_get(&bit, 1);
@@ -1211,22 +2611,25 @@ gst_dvbvideosink_render (GstBaseSink * sink, GstBuffer * buffer)
 //		printf("\n");
 	}
 
-	payload_len = data_len + pes_header_len - 6;
-
 	if (self->prev_frame && self->prev_frame != buffer) {
-		unsigned long long pts = GST_BUFFER_TIMESTAMP(self->prev_frame) * 9LL / 100000 /* convert ns to 90kHz */;
+		unsigned long long pts;
+		GST_OBJECT_LOCK(self);
+		pts = pts_map_write(&self->pts_map, GST_BUFFER_TIMESTAMP(self->prev_frame));
+		GST_OBJECT_UNLOCK(self);
 		GST_DEBUG_OBJECT(self, "use prev timestamp: %08llx", (long long)GST_BUFFER_TIMESTAMP(self->prev_frame));
 
-		pes_header[9] =  0x21 | ((pts >> 29) & 0xE);
-		pes_header[10] = pts >> 22;
-		pes_header[11] = 0x01 | ((pts >> 14) & 0xFE);
-		pes_header[12] = pts >> 7;
-		pes_header[13] = 0x01 | ((pts << 1) & 0xFE);
+		/* a DTS of this buffer doesn't belong to the previous frame and a
+		 * buffer without timestamp has no room for it, rebuild the section
+		 * as PTS only.. bytes already appended to the header move along */
+		if (pes_header[8] != 5) {
+			memmove(pes_header + 14, pes_header + 9 + pes_header[8], pes_header_len - 9 - pes_header[8]);
+			pes_header_len += 5 - pes_header[8];
+			pes_header[7] = 0x80;
+			pes_header[8] = 5;
+		}
+		pes_put_timestamp(pes_header + 9, 0x21, pts);
 	}
 
-	if (commit_prev_frame_data)
-		payload_len += GST_BUFFER_SIZE (self->prev_frame);
-
 	if (self->codec_type == CT_MPEG2 || self->codec_type == CT_MPEG1) {
 		if (!self->codec_data && data_len > 3 && !data[0] && !data[1] && data[2] == 1 && data[3] == 0xb3) { // sequence header?
 			gboolean ok = TRUE;
@@ -1256,29 +2659,21 @@ gst_dvbvideosink_render (GstBaseSink * sink, GstBuffer * buffer)
 					break;
 				// extended start code
 				if ( !data[pos] && !data[pos+1] && data[pos+2] == 1 && data[pos+3] == 0xB5 ) {
-					pos+=3;
-					sheader_data_len+=3;
-					do {
-						pos+=1;
-						++sheader_data_len;
-						if (pos+2 > data_len)
-							goto leave;
-					}
-					while( data[pos] || data[pos+1] || data[pos+2] != 1 );
+					unsigned int next = startcode_find(data, data_len, pos+4);
+					if (next >= data_len)
+						goto leave;
+					sheader_data_len+=next-pos;
+					pos=next;
 				}
 				if ( pos+3 >=data_len )
 					break;
 				// private data
 				if ( !data[pos] && !data[pos+1] && data[pos+2] && data[pos+3] == 0xB2 ) {
-					pos+=3;
-					sheader_data_len+=3;
-					do {
-						pos+=1;
-						++sheader_data_len;
-						if (pos+2 > data_len)
-							goto leave;
-					}
-					while( data[pos] || data[pos+1] || data[pos+2] != 1 );
+					unsigned int next = startcode_find(data, data_len, pos+4);
+					if (next >= data_len)
+						goto leave;
+					sheader_data_len+=next-pos;
+					pos=next;
 				}
 				self->codec_data = gst_buffer_new_and_alloc(sheader_data_len);
 				memcpy(GST_BUFFER_DATA(self->codec_data), data+pos-sheader_data_len, sheader_data_len);
@@ -1288,57 +2683,54 @@ leave:
 			}
 		}
 		else if (self->codec_data && self->must_send_header) {
+			unsigned int pos = 0;
 			unsigned char *codec_data = GST_BUFFER_DATA (self->codec_data);
 			unsigned int codec_data_len = GST_BUFFER_SIZE (self->codec_data);
-			int pos = 0;
-			while(pos < data_len) {
-				if ( data[pos++] )
-					continue;
-				if ( data[pos++] )
-					continue;
-				while ( !data[pos] )
-					pos++;
-				if ( data[pos++] != 1 )
-					continue;
+			while ((pos = startcode_find(data, data_len, pos) + 3) < data_len) {
 				if ( data[pos++] != 0xb8 ) // group start code
 					continue;
 				pos-=4; // before group start
-				payload_len += codec_data_len;
-				if (payload_len <= 0xFFFF) {
-					pes_header[4] = payload_len >> 8;
-					pes_header[5] = payload_len & 0xFF;
-				}
-				else {
-					pes_header[4] = 0;
-					pes_header[5] = 0;
-				}
-				ASYNC_WRITE(pes_header, pes_header_len);
-				ASYNC_WRITE(data, pos);
-				ASYNC_WRITE(codec_data, codec_data_len);
-				ASYNC_WRITE(data+pos, data_len - pos);
+				iov_add(iov, &iovcnt, pes_header + PES_HEADER_LEN(pes_header), pes_header_len - PES_HEADER_LEN(pes_header));
+				iov_add(iov, &iovcnt, data, pos);
+				iov_add(iov, &iovcnt, codec_data, codec_data_len);
+				iov_add(iov, &iovcnt, data+pos, data_len - pos);
+				gst_dvbvideosink_header_injected(self, codec_data_len);
+				PES_WRITE(NULL, iov, iovcnt);
 				--self->must_send_header;
 				return GST_FLOW_OK;
 			}
 		}
 	}
 
-	if (payload_len <= 0xFFFF) {
-		pes_header[4] = payload_len >> 8;
-		pes_header[5] = payload_len & 0xFF;
-	}
-	else {
-		pes_header[4] = 0;
-		pes_header[5] = 0;
+	/* the PES payload starts with the codec data and/or the stream prefix,
+	 * then the data collected behind the header */
+	if (send_codec_data) {
+		iov_add(iov, &iovcnt, self->codec_prefix, self->codec_prefix_len - (send_es_prefix ? 0 : self->es_prefix_len));
+		gst_dvbvideosink_header_injected(self, self->codec_prefix_len - self->es_prefix_len);
 	}
-
-	ASYNC_WRITE(pes_header, pes_header_len);
+	else if (send_es_prefix)
+		iov_add(iov, &iovcnt, es_prefix, self->es_prefix_len);
+	iov_add(iov, &iovcnt, pes_header + PES_HEADER_LEN(pes_header), pes_header_len - PES_HEADER_LEN(pes_header));
 
 	if (commit_prev_frame_data) {
 		GST_DEBUG_OBJECT(self, "commit prev frame data");
-		ASYNC_WRITE(GST_BUFFER_DATA (self->prev_frame), GST_BUFFER_SIZE (self->prev_frame));
+		iov_add(iov, &iovcnt, GST_BUFFER_DATA (self->prev_frame), GST_BUFFER_SIZE (self->prev_frame));
+	}
+
+	if (self->codec_type == CT_H264 && self->h264_nal_len_size) {	// MKV stuff
+		iovcnt = gst_dvbvideosink_h264_annexb(self, iov, iovcnt, data, data_len);
+		payload = self->h264_iov;
+		if (self->h264_field_pair)
+			iovcnt = gst_dvbvideosink_h264_annexb(self, self->h264_iov, iovcnt,
+				GST_BUFFER_DATA(self->h264_field_pair), GST_BUFFER_SIZE(self->h264_field_pair));
+	}
+	else {
+		iov_add(iov, &iovcnt, data, data_len);
+		if (self->h264_field_pair)
+			iov_add(iov, &iovcnt, GST_BUFFER_DATA(self->h264_field_pair), GST_BUFFER_SIZE(self->h264_field_pair));
 	}
 
-	ASYNC_WRITE(data, data_len);
+	PES_WRITE(prefix.iov_len ? &prefix : NULL, payload, iovcnt);
 
 	if (self->prev_frame && self->prev_frame != buffer) {
 		GST_DEBUG_OBJECT(self, "unref prev_frame buffer");
@@ -1381,7 +2773,11 @@ gst_dvbvideosink_set_caps (GstBaseSink * basesink, GstCaps * caps)
 	int streamtype = -1;
 	self->framerate = -1;
 	self->no_header = 0;
-
+	gst_dvbvideosink_infer_caps(self, structure);
+	gst_dvbvideosink_dts_reset(self, TRUE);
+	gst_dvbvideosink_h264_au_clear(self);
+	gst_dvbvideosink_h264_field_clear(self);
+	self->h264_frame_mbs_only = -1;
 	if (!strcmp (mimetype, "video/mpeg")) {
 		gint mpegversion;
 		gst_structure_get_int (structure, "mpegversion", &mpegversion);
@@ -1425,79 +2821,27 @@ gst_dvbvideosink_set_caps (GstBaseSink * basesink, GstCaps * caps)
 		GST_INFO_OBJECT (self, "MIMETYPE video/x-3ivx -> VIDEO_SET_STREAMTYPE, 4");
 	} else if (!strcmp (mimetype, "video/x-h264")) {
 		const GValue *cd_data = gst_structure_get_value (structure, "codec_data");
+		const gchar *alignment;
 		streamtype = 1;
+		gst_dvbvideosink_h264_ps_clear(self);
+		self->h264_nal_len_size = 0;
 		if (cd_data) {
-			unsigned char tmp[2048];
-			unsigned int tmp_len = 0;
 			GstBuffer *codec_data = gst_value_get_buffer (cd_data);
-			unsigned char *data = GST_BUFFER_DATA (codec_data);
-			unsigned int cd_len = GST_BUFFER_SIZE (codec_data);
-			unsigned int cd_pos = 0;
 			GST_INFO_OBJECT (self, "H264 have codec data..!");
-			if (cd_len > 7 && data[0] == 1) {
-				unsigned short len = (data[6] << 8) | data[7];
-//				printf("2 %d bytes\n", len);
-				if (cd_len >= (len + 8)) {
-					unsigned int i=0;
-					uint8_t profile_num[] = { 66, 77, 88, 100 };
-					uint8_t profile_cmp[2] = { 0x67, 0x00 };
-					const char *profile_str[] = { "baseline", "main", "extended", "high" };
-//					printf("3\n");
-					memcpy(tmp, "\x00\x00\x00\x01", 4);
-					tmp_len += 4;
-//					printf("header part1 ");
-//					for (i = 0; i < len; ++i)
-//						printf("%02x ", data[8+i]);
-//					printf("\n");
-					memcpy(tmp+tmp_len, data+8, len);
-					for (i = 0; i < 4; ++i) {
-						profile_cmp[1] = profile_num[i];
-						if (!memcmp(tmp+tmp_len, profile_cmp, 2)) {
-							uint8_t level_org = tmp[tmp_len+3];
-							if (level_org > 0x29) {
-								GST_INFO_OBJECT (self, "H264 %s profile@%d.%d patched down to 4.1!", profile_str[i], level_org / 10 , level_org % 10);
-								tmp[tmp_len+3] = 0x29; // level 4.1
-							}
-							else
-								GST_INFO_OBJECT (self, "H264 %s profile@%d.%d", profile_str[i], level_org / 10 , level_org % 10);
-							break;
-						}
-					}
-					tmp_len += len;
-					cd_pos = 8 + len;
-					if (cd_len > (cd_pos + 2)) {
-						len = (data[cd_pos+1] << 8) | data[cd_pos+2];
-//						printf("4 %d bytes\n", len);
-						cd_pos += 3;
-						if (cd_len >= (cd_pos+len)) {
-//							printf("codec data ok!\n");
-							memcpy(tmp+tmp_len, "\x00\x00\x00\x01", 4);
-							tmp_len += 4;
-//							printf("header part2 %02x %02x %02x %02x ... %d bytes\n", data[cd_pos], data[cd_pos+1], data[cd_pos+2], data[cd_pos+3], len);
-							memcpy(tmp+tmp_len, data+cd_pos, len);
-							tmp_len += len;
-							self->codec_data = gst_buffer_new_and_alloc(tmp_len);
-							memcpy(GST_BUFFER_DATA(self->codec_data), tmp, tmp_len);
-							self->h264_nal_len_size = (data[4] & 0x03) + 1;
-							if (self->h264_nal_len_size < 3)
-								self->h264_buffer = gst_buffer_new_and_alloc(H264_BUFFER_SIZE);
-						}
-						else
-							GST_WARNING_OBJECT (self, "codec_data to short(4)");
-					}
-					else
-						GST_WARNING_OBJECT (self, "codec_data to short(3)");
-				}
+			if (gst_dvbvideosink_h264_avcc(self, GST_BUFFER_DATA (codec_data), GST_BUFFER_SIZE (codec_data))) {
+				self->codec_data = gst_dvbvideosink_h264_ps_buffer(self);
+				if (self->codec_data)
+					self->h264_nal_len_size = (GST_BUFFER_DATA (codec_data)[4] & 0x03) + 1;
 				else
-					GST_WARNING_OBJECT (self, "codec_data to short(2)");
+					GST_WARNING_OBJECT (self, "no SPS or PPS in codec_data");
 			}
-			else if (cd_len <= 7)
-				GST_WARNING_OBJECT (self, "codec_data to short(1)");
-			else
-				GST_WARNING_OBJECT (self, "wrong avcC version %d!", data[0]);
 		}
+		alignment = gst_structure_get_string (structure, "alignment");
+		if (alignment)
+			self->h264_nal_aligned = !strcmp(alignment, "nal");
 		else
-			self->h264_nal_len_size = 0;
+			self->h264_nal_aligned = -1;
+		self->h264_detect_count = 0;
 		GST_INFO_OBJECT (self, "MIMETYPE video/x-h264 VIDEO_SET_STREAMTYPE, 1");
 	} else if (!strcmp (mimetype, "video/x-h263")) {
 		streamtype = 2;
@@ -1621,7 +2965,7 @@ gst_dvbvideosink_set_caps (GstBaseSink * basesink, GstCaps * caps)
 					self->codec_data = gst_value_get_buffer (codec_data);
 					gst_buffer_ref (self->codec_data);
 
-					Vc1HandleStreamBuffer( self, GST_BUFFER_DATA(self->codec_data)+1, 2 );
+					Vc1HandleStreamBuffer( self, GST_BUFFER_DATA(self->codec_data)+1, GST_BUFFER_SIZE(self->codec_data)-1, 2 );
 				}
 			}
 			else
@@ -1642,6 +2986,10 @@ gst_dvbvideosink_set_caps (GstBaseSink * basesink, GstCaps * caps)
 		streamtype = 21;
 		GST_INFO_OBJECT (self, "MIMETYPE video/x-flash-video -> VIDEO_SET_STREAMTYPE, 21");
 	}
+	/* frames of the previous stream go out before the decoder is set up again */
+	if (gst_dvbvideosink_coalesce_flush(basesink, self))
+		GST_WARNING_OBJECT (self, "failed to write coalesced data: %s", g_strerror (errno));
+	gst_dvbvideosink_build_templates(self);
 	if (streamtype != -1) {
 		gint numerator, denominator;
 		if (self->framerate == -1 && gst_structure_get_fraction (structure, "framerate", &numerator, &denominator)) {
@@ -1698,6 +3046,8 @@ gst_dvbvideosink_set_caps (GstBaseSink * basesink, GstCaps * caps)
 				GST_ELEMENT_ERROR (self, STREAM, CODEC_NOT_FOUND, (NULL), ("hardware decoder can't handle streamtype %i", streamtype));
 		ioctl(self->fd, VIDEO_PLAY);
 		self->dec_running = TRUE;
+		if (self->tsmux)
+			tsmux_set_stream(self->tsmux, TSMUX_VIDEO, gst_dvbvideosink_ts_stream_type(self->codec_type));
 	} else
 		GST_ELEMENT_ERROR (self, STREAM, TYPE_NOT_FOUND, (NULL), ("unimplemented stream type %s", mimetype));
 
@@ -1765,6 +3115,16 @@ gst_dvbvideosink_start (GstBaseSink * basesink)
 	fcntl (READ_SOCKET (self), F_SETFL, O_NONBLOCK);
 	fcntl (WRITE_SOCKET (self), F_SETFL, O_NONBLOCK);
 
+	queue_alloc(&self->queue, self->queue_size);
+	pacer_init(&self->pacer);
+	pts_map_init(&self->pts_map);
+
+	GST_OBJECT_LOCK(self);
+	self->header_injected = 0;
+	self->header_injected_bytes = 0;
+	self->header_skipped = 0;
+	GST_OBJECT_UNLOCK(self);
+
 	return TRUE;
 	/* ERRORS */
 socket_pair:
@@ -1781,6 +3141,8 @@ gst_dvbvideosink_stop (GstBaseSink * basesink)
 	GstDVBVideoSink *self = GST_DVBVIDEOSINK (basesink);
 	FILE *f = fopen("/proc/stb/vmpeg/0/fallback_framerate", "w");
 	GST_DEBUG_OBJECT (self, "stop");
+	writer_stop(&self->writer);
+	uring_free(&self->uring);
 	if (self->fd >= 0)
 	{
 		if (self->dec_running) {
@@ -1793,17 +3155,39 @@ gst_dvbvideosink_stop (GstBaseSink * basesink)
 		close(self->fd);
 	}
 
+	if (self->tsmux) {
+		tsmux_release(self->tsmux, TSMUX_VIDEO);
+		self->tsmux = NULL;
+	}
+	if (self->ts_filter >= 0) {
+		close(self->ts_filter);
+		self->ts_filter = -1;
+	}
+
 	if (self->codec_data)
 		gst_buffer_unref(self->codec_data);
 
-	if (self->h264_buffer)
-		gst_buffer_unref(self->h264_buffer);
+	g_free(self->codec_prefix);
+	self->codec_prefix = NULL;
+	self->codec_prefix_len = 0;
+
+	g_free(self->coalesce_data);
+	self->coalesce_data = NULL;
+	self->coalesce_bytes = 0;
+	self->coalesce_size = 0;
+
+	gst_dvbvideosink_h264_au_clear(self);
+	gst_dvbvideosink_h264_field_clear(self);
+
+	g_free(self->h264_iov);
+	self->h264_iov = NULL;
+	self->h264_iov_size = 0;
+	gst_dvbvideosink_h264_ps_clear(self);
 
 	if (self->prev_frame)
 		gst_buffer_unref(self->prev_frame);
 
-	while(self->queue)
-		queue_pop(&self->queue);
+	queue_free(&self->queue);
 
 	if (f) {
 		fputs(self->saved_fallback_framerate, f);
@@ -1834,9 +3218,7 @@ gst_dvbvideosink_change_state (GstElement * element, GstStateChange transition)
 		self->fd = open("/dev/dvb/adapter0/video0", O_RDWR|O_NONBLOCK);
 //		self->fd = open("/dump.pes", O_RDWR|O_CREAT|O_TRUNC, 0555);
 
-		GST_OBJECT_LOCK(self);
-		self->no_write |= 4;
-		GST_OBJECT_UNLOCK(self);
+		write_state_set(&self->no_write, WRITE_PAUSED);
 
 		if (self->fd >= 0) {
 			GstStructure *s = 0;
@@ -1869,16 +3251,43 @@ gst_dvbvideosink_change_state (GstElement * element, GstStateChange transition)
 				"progressive", G_TYPE_INT, progressive, NULL);
 			msg = gst_message_new_element (GST_OBJECT (element), s);
 			gst_element_post_message (GST_ELEMENT (element), msg);
-			ioctl(self->fd, VIDEO_SELECT_SOURCE, VIDEO_SOURCE_MEMORY);
+			GST_OBJECT_LOCK(self);
+			if (self->ts_output) {
+				self->tsmux = tsmux_get(self->ts_output, TSMUX_VIDEO);
+				if (self->tsmux)
+					self->ts_filter = tsmux_open_filter(self->ts_output, TSMUX_VIDEO);
+				else
+					GST_ELEMENT_WARNING (self, RESOURCE, OPEN_WRITE, (NULL), ("can't write TS to %s, using PES output", self->ts_output));
+			}
+			GST_OBJECT_UNLOCK(self);
+			/* without a filter (TS to a file) the decoder gets nothing */
+			ioctl(self->fd, VIDEO_SELECT_SOURCE, self->ts_filter >= 0 ? VIDEO_SOURCE_DEMUX : VIDEO_SOURCE_MEMORY);
 			ioctl(self->fd, VIDEO_FREEZE);
+
+			if (self->tsmux)
+				GST_INFO_OBJECT (self, "TS output to %s", self->ts_output);
+			else if (self->use_writer_thread || self->use_shared_reactor) {
+				self->writer.sink = GST_OBJECT (self);
+				self->writer.fd = self->fd;
+				self->writer.control_read = READ_SOCKET(self);
+				self->writer.control_write = WRITE_SOCKET(self);
+				self->writer.no_write = &self->no_write;
+				self->writer.queue = &self->queue;
+				self->writer.pacer = &self->pacer;
+				if (!writer_start(&self->writer, self->use_shared_reactor))
+					GST_WARNING_OBJECT (self, "failed to start writer thread, writing from the streaming thread");
+			}
+			if (self->use_io_uring && !self->tsmux && !writer_running(&self->writer) && !uring_setup(&self->uring))
+				GST_INFO_OBJECT (self, "io_uring not available (%s), using poll", g_strerror(errno));
 		}
 		break;
 	case GST_STATE_CHANGE_PAUSED_TO_PLAYING:
 		GST_DEBUG_OBJECT (self,"GST_STATE_CHANGE_PAUSED_TO_PLAYING");
 		ioctl(self->fd, VIDEO_CONTINUE);
-		GST_OBJECT_LOCK(self);
-		self->no_write &= ~4;
-		GST_OBJECT_UNLOCK(self);
+		write_state_clear(&self->no_write, WRITE_PAUSED);
+		/* wake a render blocked on the full pause queue */
+		SEND_COMMAND (self, CONTROL_STOP);
+		writer_wakeup(&self->writer);
 		break;
 	default:
 		break;
@@ -1889,14 +3298,25 @@ gst_dvbvideosink_change_state (GstElement * element, GstStateChange transition)
 	switch (transition) {
 	case GST_STATE_CHANGE_PLAYING_TO_PAUSED:
 		GST_DEBUG_OBJECT (self,"GST_STATE_CHANGE_PLAYING_TO_PAUSED");
-		GST_OBJECT_LOCK(self);
-		self->no_write |= 4;
-		GST_OBJECT_UNLOCK(self);
+		write_state_set(&self->no_write, WRITE_PAUSED);
+		/* the writer thread drains the pause queue on resume by itself, the
+		 * streaming thread writes the collected frames with the next ones */
+		if (writer_running(&self->writer)) {
+			GST_OBJECT_LOCK(self);
+			if (self->coalesce_bytes) {
+				queue_push(&self->queue, self->coalesce_data, self->coalesce_bytes);
+				self->coalesce_bytes = 0;
+			}
+			GST_OBJECT_UNLOCK(self);
+		}
 		ioctl(self->fd, VIDEO_FREEZE);
 		SEND_COMMAND (self, CONTROL_STOP);
+		writer_wakeup(&self->writer);
 		break;
 	case GST_STATE_CHANGE_PAUSED_TO_READY:
 		GST_DEBUG_OBJECT (self,"GST_STATE_CHANGE_PAUSED_TO_READY");
+		writer_stop(&self->writer);
+		uring_free(&self->uring);
 		break;
 	case GST_STATE_CHANGE_READY_TO_NULL:
 		GST_DEBUG_OBJECT (self,"GST_STATE_CHANGE_READY_TO_NULL");
@@ -1944,8 +3364,6 @@ static unsigned int
 Vc1ParseSeqHeader( GstDVBVideoSink *self, struct bitstream *bit )
 {
 	unsigned char n;
-	long uiStartAddr = (long)&(bit->data[0]);
-	long uiStopAddr = 0;
 
 	// skip first 5 bytes (PROFILE,LEVEL,COLORDIFF_FORMAT,FRMRTQ_POSTPROC,BITRTQ_POSTPROC,POSTPROCFLAG,MAX_CODED_WIDTH,MAX_CODED_HEIGHT)
 	bitstream_get( bit, 32 );
@@ -2048,16 +3466,13 @@ Vc1ParseSeqHeader( GstDVBVideoSink *self, struct bitstream *bit )
 		}
 	}
 
-	uiStopAddr = (long)&(bit->data[0]);
-	return (unsigned int)(uiStopAddr - uiStartAddr + 1);
+	return (unsigned int)((bitstream_tell(bit) + 7) / 8);	// bytes touched
 }
 
 static unsigned int
 Vc1ParseEntryPointHeader( GstDVBVideoSink *self, struct bitstream *bit )
 {
 	unsigned char n, ucEXTENDED_MV;
-	long uiStartAddr = (long)&(bit->data[0]);
-	long uiStopAddr = 0;
 
 	// skip the first two bits (BROKEN_LINK,CLOSED_ENTRY)
 	bitstream_get( bit, 2 );
@@ -2105,9 +3520,7 @@ Vc1ParseEntryPointHeader( GstDVBVideoSink *self, struct bitstream *bit )
 		bitstream_get( bit, 3 );
 	}
 
-	uiStopAddr = (long)&(bit->data[0]);
-
-	return (unsigned int)(uiStopAddr - uiStartAddr + 1);
+	return (unsigned int)((bitstream_tell(bit) + 7) / 8);	// bytes touched
 }
 
 static unsigned char
@@ -2272,7 +3685,7 @@ Vc1GetNrOfFramesFromBFractionVal( unsigned char ucBFVal )
 }
 
 static unsigned char
-Vc1HandleStreamBuffer( GstDVBVideoSink *self, unsigned char *data, int flags )
+Vc1HandleStreamBuffer( GstDVBVideoSink *self, unsigned char *data, unsigned int len, int flags )
 {
 	unsigned char ucPType, ucRetVal = cVC1BufferDataAvailable;
 	unsigned int i = -1;
@@ -2290,7 +3703,7 @@ Vc1HandleStreamBuffer( GstDVBVideoSink *self, unsigned char *data, int flags )
 			// Sequence header
 			struct bitstream bitstr;
 			i++;
-			bitstream_init( &bitstr, &data[i], 0 );
+			bitstream_init( &bitstr, &data[i], i < len ? len - i : 0, 0 );
 			i += Vc1ParseSeqHeader(self, &bitstr);
 			//printf("Sequence header\n");
 
@@ -2298,7 +3711,7 @@ Vc1HandleStreamBuffer( GstDVBVideoSink *self, unsigned char *data, int flags )
 				// Entry Point Header
 				struct bitstream bitstr;
 				i += 4;
-				bitstream_init( &bitstr, &data[i], 0 );
+				bitstream_init( &bitstr, &data[i], i < len ? len - i : 0, 0 );
 				i += Vc1ParseEntryPointHeader(self, &bitstr);
 				//printf("Entry Point header\n");
 
@@ -2323,7 +3736,7 @@ parse_frame_header:
 
 			i++;
 
-			bitstream_init( &bitstr, &data[i], 0 );
+			bitstream_init( &bitstr, &data[i], i < len ? len - i : 0, 0 );
 			ucPType = Vc1GetFrameType( self, &bitstr );
 
 			GST_DEBUG_OBJECT(self, "picturetype = %d", ucPType);
@@ -49,6 +49,9 @@
 
 #include <gst/gst.h>
 #include <gst/base/gstbasesink.h>
+#include <gst/base/gstadapter.h>
+
+#include "common.h"
 
 G_BEGIN_DECLS
 
@@ -68,14 +71,27 @@ typedef struct _GstDVBVideoSink		GstDVBVideoSink;
 typedef struct _GstDVBVideoSinkClass	GstDVBVideoSinkClass;
 typedef struct _GstDVBVideoSinkPrivate	GstDVBVideoSinkPrivate;
 
-typedef enum { CT_MPEG1, CT_MPEG2, CT_H264, CT_DIVX311, CT_DIVX4, CT_MPEG4_PART2, CT_VC1, CT_VC1_SIMPLE_MAIN, CT_SPARK, CT_VP6, CT_VP8 } t_codec_type;
+#define DTS_WINDOW 16
+#define DTS_DEFAULT_REORDER 1
+#define DTS_WARMUP 3
 
-typedef struct queue_entry
-{
-	struct queue_entry *next;
-	size_t bytes;
-	size_t offset;
-} queue_entry_t;
+#define ES_PREFIX_MAX 11	/* BCMV header of VP6 */
+
+#define HEADER_SCAN_MAX 1024	/* in-band parameter sets are looked for in front of the frame */
+
+#define H264_DETECT_BUFFERS 32	/* give up detecting NAL alignment after this */
+
+#define H264_MAX_SPS 32
+#define H264_MAX_PPS 256
+
+/* when the codec data goes to the decoder again */
+typedef enum {
+	HEADER_POLICY_AUTO,		/* per hardware */
+	HEADER_POLICY_RANDOM_ACCESS,	/* at every random access point */
+	HEADER_POLICY_DISCONTINUITY	/* after flushes until the decoder has seen it */
+} t_header_policy;
+
+typedef enum { CT_MPEG1, CT_MPEG2, CT_H264, CT_DIVX311, CT_DIVX4, CT_MPEG4_PART2, CT_VC1, CT_VC1_SIMPLE_MAIN, CT_SPARK, CT_VP6, CT_VP8 } t_codec_type;
 
 struct _GstDVBVideoSink
 {
@@ -84,9 +100,38 @@ struct _GstDVBVideoSink
 	gint control_sock[2];
 
 	gint must_send_header;
+	t_header_policy header_policy;
+	guint64 header_injected;	/* statistics, protected by the object lock */
+	guint64 header_injected_bytes;
+	guint64 header_skipped;
 
-	GstBuffer *h264_buffer;
 	gint h264_nal_len_size;
+	struct iovec *h264_iov;	/* AVC converted to byte stream, see h264_annexb */
+	gint h264_iov_size;
+
+	/* access unit aggregation of NAL aligned H.264 */
+	gint h264_nal_aligned;	/* -1 = not known yet */
+	guint h264_detect_count;
+	GstAdapter *h264_au;
+	GstClockTime h264_au_timestamp;
+	gboolean h264_au_vcl;	/* the pending access unit has a slice */
+	gboolean h264_au_output;	/* rendering the aggregated access unit */
+
+	/* PAFF: the two fields of a frame go out in one PES */
+	gint h264_frame_mbs_only;	/* from the SPS, -1 = no SPS seen yet */
+	guint h264_log2_max_frame_num;
+	gboolean h264_separate_colour_plane;
+	GstBuffer *h264_field;	/* first field, waiting for the second one */
+	GstBuffer *h264_field_pair;	/* second field, written behind the first */
+	guint h264_field_frame_num;
+	gboolean h264_field_bottom;
+	gboolean h264_field_output;	/* rendering a field pair */
+
+	/* parameter sets by id from avcC and in-band, NAL units without start
+	 * code. After a discontinuity the next IDR gets the ones it refers to */
+	GstBuffer *h264_sps[H264_MAX_SPS];
+	GstBuffer *h264_sps_ext[H264_MAX_SPS];
+	GstBuffer *h264_pps[H264_MAX_PPS];
 
 	GstBuffer *codec_data;
 	t_codec_type codec_type;
@@ -100,9 +145,56 @@ struct _GstDVBVideoSink
 	int fd;
 	gboolean dec_running;
 
-	int no_write;
-
-	queue_entry_t *queue;
+	volatile gint no_write;
+
+	queue_t queue;
+	guint queue_size;
+
+	writer_t writer;
+	gboolean use_writer_thread;
+	gboolean use_shared_reactor;
+
+	uring_t uring;
+	gboolean use_io_uring;
+
+	pacer_t pacer;
+	pts_map_t pts_map;
+
+	/* several small frames in one write (VP6, Spark, MPEG-4 part 2),
+	 * the buffer is protected by the object lock */
+	guint max_coalesce_bytes;
+	GstClockTime max_coalesce_latency;
+	guint8 *coalesce_data;
+	size_t coalesce_bytes;
+	size_t coalesce_size;
+	GstClockTime coalesce_start;
+
+	/* MPEG-TS output to the DVR device instead of PES to the decoder */
+	gchar *ts_output;
+	tsmux_t *tsmux;
+	int ts_filter;		/* demux PES filter feeding the decoder */
+
+	/* DTS generation, in decode order */
+	guint dts_codecs;	/* 1 << codec type */
+	gchar *dts_codecs_str;
+	GstClockTime dts_last;
+	GstClockTime dts_window[DTS_WINDOW];	/* PTS of the last frames */
+	guint dts_count;
+	guint dts_reorder;	/* learned reorder depth in frames */
+	GstClockTime dts_duration;
+
+	/* PTS for buffers without timestamp */
+	GstClockTime infer_duration;	/* frame duration from the caps, NONE = decoder framerate */
+	gboolean infer_framed;	/* the caps say one buffer is one frame */
+	GstClockTime infer_next;	/* decode order time of the next frame */
+	GstClockTime infer_gop;	/* MPEG-1/2: time of temporal reference 0 */
+	GstClockTime infer_display;	/* MPEG-1/2: end of the latest frame in display order */
+
+	/* stream dependent bytes in front of each frame, built in set_caps */
+	guint8 es_prefix[ES_PREFIX_MAX];	/* start code or BCMV header */
+	guint es_prefix_len;
+	guint8 *codec_prefix;	/* codec data followed by es_prefix */
+	guint codec_prefix_len;
 
 	// VC1 stuff....
 
@@ -0,0 +1,38 @@
+/*
+ * GStreamer DVB Media Sink
+ *
+ * helpers of the check programs. Each program includes src/common.c, which
+ * makes the static functions reachable, and runs without a decoder: pipes
+ * and plain files stand in for the devices.
+ */
+
+#ifndef __CHECK_H__
+#define __CHECK_H__
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <gst/gst.h>
+
+#define CHECK(cond) do { \
+		if (!(cond)) { \
+			fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #cond); \
+			exit(1); \
+		} \
+	} while(0)
+
+/* the exit code automake counts as a skipped test */
+#define CHECK_SKIP	77
+
+static inline void check_init(int *argc, char ***argv)
+{
+	gst_init(argc, argv);
+	GST_DEBUG_CATEGORY_INIT (dvbsink_common_debug, "dvbsink_common", 0, "dvbsink checks");
+}
+
+/* seconds on a monotonic clock, for the timings */
+static inline double check_time(void)
+{
+	return (double)gst_util_get_timestamp() / GST_SECOND;
+}
+
+#endif /* __CHECK_H__ */
@@ -0,0 +1,128 @@
+/*
+ * GStreamer DVB Media Sink
+ *
+ * the pacer against a decoder-like device: a 64k pipe which a reader drains
+ * at a fixed rate in small reads. Without pacing every read frees a little
+ * space and the writer thread follows with a tiny write; with min-write the
+ * same data has to go out in fewer, larger writes.
+ */
+
+#include "common.c"
+#include "check.h"
+#include <signal.h>
+#include <time.h>
+
+#define PIPE_SIZE	(64 * 1024)
+#define DRAIN_RATE	(4 * 1024 * 1024)	/* bytes per second */
+#define DRAIN_CHUNK	512
+#define TOTAL_BYTES	(2 * 1024 * 1024)
+#define FRAME_SIZE	(32 * 1024)
+#define MIN_WRITE	(32 * 1024)
+
+typedef struct
+{
+	int fd;
+	size_t bytes;
+} reader_t;
+
+/* reads DRAIN_CHUNK bytes at a time, never ahead of DRAIN_RATE */
+static gpointer reader_thread(gpointer data)
+{
+	reader_t *reader = data;
+	guint8 buf[DRAIN_CHUNK];
+	double start = check_time();
+	ssize_t n;
+
+	for (;;) {
+		double due = start + (double)reader->bytes / DRAIN_RATE;
+		double now = check_time();
+		if (due > now) {
+			struct timespec ts = { 0, (long)((due - now) * 1e9) };
+			nanosleep(&ts, NULL);
+		}
+		n = read(reader->fd, buf, sizeof(buf));
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0)
+			break;
+		reader->bytes += n;
+	}
+	return NULL;
+}
+
+static void run(pacer_t *pacer)
+{
+	static guint8 frame[FRAME_SIZE];
+	int pipe_fd[2], control[2];
+	reader_t reader = { -1, 0 };
+	GThread *thread;
+	writer_t writer;
+	queue_t queue;
+	gint no_write = 0;
+	size_t sent;
+
+	CHECK(pipe(pipe_fd) == 0);
+	CHECK(socketpair(PF_UNIX, SOCK_STREAM, 0, control) == 0);
+	CHECK(fcntl(pipe_fd[1], F_SETPIPE_SZ, PIPE_SIZE) >= PIPE_SIZE);
+	fcntl(pipe_fd[1], F_SETFL, O_NONBLOCK);
+	fcntl(control[0], F_SETFL, O_NONBLOCK);
+	fcntl(control[1], F_SETFL, O_NONBLOCK);
+
+	pacer_init(pacer);
+	queue_init(&queue);
+	queue_alloc(&queue, 0);
+	writer_init(&writer);
+	writer.fd = pipe_fd[1];
+	writer.control_read = control[0];
+	writer.control_write = control[1];
+	writer.no_write = &no_write;
+	writer.queue = &queue;
+	writer.pacer = pacer;
+	CHECK(writer_start(&writer, FALSE));
+
+	reader.fd = pipe_fd[0];
+	thread = g_thread_create(reader_thread, &reader, TRUE, NULL);
+	CHECK(thread);
+
+	for (sent = 0; sent < TOTAL_BYTES; sent += FRAME_SIZE) {
+		struct iovec iov = { frame, FRAME_SIZE };
+		CHECK(writer_push(&writer, &iov, 1, NULL, 0) == 0);
+	}
+	CHECK(writer_drain(&writer));
+	writer_stop(&writer);
+	close(pipe_fd[1]);
+	g_thread_join(thread);
+	CHECK(reader.bytes == TOTAL_BYTES);
+	CHECK(pacer->bytes == TOTAL_BYTES);
+
+	printf("min-write %6u: %5llu writes, %5llu partial, %6llu bytes per write, %llu kB/s drain rate\n",
+		pacer->min_write, (unsigned long long)pacer->writes, (unsigned long long)pacer->partial_writes,
+		(unsigned long long)(pacer->bytes / pacer->writes), (unsigned long long)pacer->rate / 1024);
+
+	queue_free(&queue);
+	close(pipe_fd[0]);
+	close(control[0]);
+	close(control[1]);
+}
+
+int main(int argc, char **argv)
+{
+	pacer_t plain, paced;
+
+	check_init(&argc, &argv);
+	signal(SIGPIPE, SIG_IGN);
+
+	memset(&plain, 0, sizeof(plain));
+	run(&plain);
+	memset(&paced, 0, sizeof(paced));
+	paced.min_write = MIN_WRITE;
+	run(&paced);
+
+	/* the learned rate is in the right range */
+	CHECK(paced.rate > DRAIN_RATE / 2 && paced.rate < DRAIN_RATE * 2);
+	CHECK(paced.deferrals > 0);
+	CHECK(paced.writes * 2 < plain.writes);
+	CHECK(paced.bytes / paced.writes > 2 * (plain.bytes / plain.writes));
+
+	return 0;
+}
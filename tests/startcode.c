@@ -0,0 +1,173 @@
+/*
+ * GStreamer DVB Media Sink
+ *
+ * compares startcode_find, built with the vector loop of the target (SSE2 or
+ * NEON, AVX2 in the startcode_avx2 build), with startcode_scalar and a plain
+ * byte loop like the parsers had before. Random buffers are searched from
+ * every offset, short buffers end right before an unreadable page at every
+ * alignment, and an HD sized frame gives the timings.
+ */
+
+#include "common.c"
+#include "check.h"
+#include <sys/mman.h>
+
+#if defined(__AVX2__)
+#define VARIANT	"avx2"
+#elif defined(__SSE2__)
+#define VARIANT	"sse2"
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+#define VARIANT	"neon"
+#else
+#define VARIANT	"scalar"
+#endif
+
+#define RANDOM_LEN	1024
+#define RANDOM_RUNS	200
+#define TAIL_MAX	160
+#define HD_LEN	(1920 * 1080 * 3 / 2)
+#define HD_SLICES	68	/* one per macroblock row */
+#define HD_RUNS	20
+
+static size_t startcode_bytes(const guint8 *data, size_t len, size_t pos)
+{
+	for (; pos + 2 < len; ++pos)
+		if (!data[pos] && !data[pos + 1] && data[pos + 2] == 1)
+			return pos;
+	return len;
+}
+
+/* mostly zeros and ones, so start codes and near misses are everywhere */
+static void fill_dense(guint8 *data, size_t len)
+{
+	size_t i;
+
+	for (i = 0; i < len; ++i) {
+		int r = rand() % 8;
+		data[i] = r < 4 ? 0 : r < 6 ? 1 : rand();
+	}
+}
+
+/* like coded slices: random bytes without 00 00 0x, start codes between */
+static void fill_slices(guint8 *data, size_t len, int slices)
+{
+	size_t i;
+
+	for (i = 0; i < len; ++i) {
+		data[i] = rand();
+		if (i >= 2 && !data[i - 2] && !data[i - 1] && data[i] < 4)
+			data[i] = 3;
+	}
+	for (i = 0; i < (size_t)slices; ++i) {
+		size_t pos = (len - 4) / slices * i + rand() % 16;
+		data[pos] = data[pos + 1] = 0;
+		data[pos + 2] = 1;
+	}
+}
+
+static void check_all_offsets(const guint8 *data, size_t len)
+{
+	size_t pos;
+
+	for (pos = 0; pos <= len; ++pos) {
+		size_t expect = startcode_bytes(data, len, pos);
+		CHECK(startcode_find(data, len, pos) == expect);
+		CHECK(startcode_scalar(data, len, pos) == expect);
+	}
+}
+
+/* the buffer ends where the mapping does, reading data[len] faults */
+static void check_tails(void)
+{
+	long page = sysconf(_SC_PAGESIZE);
+	guint8 *map = mmap(NULL, 2 * page, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	guint8 *end = map + page;
+	size_t len, i;
+	int run;
+
+	CHECK(map != MAP_FAILED);
+	CHECK(mprotect(end, page, PROT_NONE) == 0);
+
+	for (run = 0; run < 4; ++run) {
+		for (len = 0; len <= TAIL_MAX; ++len) {
+			guint8 *data = end - len;
+			fill_dense(data, len);
+			check_all_offsets(data, len);
+			if (len < 3)
+				continue;
+			/* a start code in the last three bytes, and cut short */
+			memset(data, 0xFF, len - 3);
+			data[len - 3] = data[len - 2] = 0;
+			data[len - 1] = 1;
+			CHECK(startcode_find(data, len, 0) == len - 3);
+			for (i = 1; i <= 3; ++i) {
+				CHECK(startcode_find(data, len - i, 0) == len - i);
+				if (i <= len - 3)
+					CHECK(startcode_find(data + i, len - i, 0) == len - 3 - i);
+			}
+		}
+	}
+	munmap(map, 2 * page);
+}
+
+typedef size_t (*startcode_func) (const guint8 *data, size_t len, size_t pos);
+
+static size_t count(startcode_func find, const guint8 *data, size_t len)
+{
+	size_t pos, n = 0;
+
+	for (pos = 0; (pos = find(data, len, pos)) < len; pos += 3)
+		++n;
+	return n;
+}
+
+static double timing(const char *name, startcode_func find, const guint8 *data, size_t len, size_t expect)
+{
+	double start = check_time(), mbs;
+	int run;
+
+	for (run = 0; run < HD_RUNS; ++run)
+		CHECK(count(find, data, len) == expect);
+	mbs = (double)len * HD_RUNS / (check_time() - start) / 1e6;
+	printf("%-14s %8.1f MB/s\n", name, mbs);
+	return mbs;
+}
+
+int main(int argc, char **argv)
+{
+	guint8 *data = g_malloc(HD_LEN);
+	size_t expect, i;
+	int run;
+
+	check_init(&argc, &argv);
+#if defined(__AVX2__)
+	__builtin_cpu_init();
+	if (!__builtin_cpu_supports("avx2")) {
+		printf("no AVX2 on this CPU\n");
+		return CHECK_SKIP;
+	}
+#endif
+
+	srand(1);
+	for (run = 0; run < RANDOM_RUNS; ++run) {
+		size_t len = 1 + rand() % RANDOM_LEN, off = rand() % 64;
+		fill_dense(data + off, len);
+		check_all_offsets(data + off, len);
+	}
+	check_tails();
+
+	fill_slices(data, HD_LEN, HD_SLICES);
+	expect = count(startcode_bytes, data, HD_LEN);
+	CHECK(expect >= HD_SLICES);
+	/* the same offsets in the same order */
+	for (i = 0; i < HD_LEN; i = startcode_find(data, HD_LEN, i) + 3)
+		CHECK(startcode_find(data, HD_LEN, i) == startcode_bytes(data, HD_LEN, i));
+
+	printf("%zu start codes in a %d byte frame\n", expect, HD_LEN);
+	timing("byte loop", startcode_bytes, data, HD_LEN, expect);
+	timing("scalar", startcode_scalar, data, HD_LEN, expect);
+	timing(VARIANT, startcode_find, data, HD_LEN, expect);
+
+	g_free(data);
+	return 0;
+}
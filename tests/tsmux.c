@@ -0,0 +1,282 @@
+/*
+ * GStreamer DVB Media Sink
+ *
+ * muxes video and audio PES packets into a file and checks the transport
+ * stream: packet sync, continuity counters, PAT/PMT with their CRC, and PCRs
+ * at most 100ms apart, which neither run past the data nor fall behind it by
+ * much more than the decoder buffer delay. Also at most 100ms of data apart,
+ * at the rate of the first seconds with audio and video. The input has a long
+ * PES and a stretch without video, where the timestamps alone don't give a
+ * PCR often enough. Also checks that a sink waiting for the mux wakes up on
+ * its control socket.
+ */
+
+#include "common.c"
+#include "check.h"
+
+#define PCR_MAX_INTERVAL	9000	/* 100ms */
+#define PCR_MAX_DELAY	(TSMUX_PCR_DELAY + 18000)	/* the decoder's buffer and 200ms */
+#define VIDEO_DURATION	3600
+#define AUDIO_DURATION	2160
+#define AUDIO_SIZE	768
+#define LONG_PES_SIZE	(200 * 1024)
+#define MAX_PCRS	1024
+
+typedef struct
+{
+	tsmux_t *mux;
+	int control[2];
+	gint no_write;
+	guint64 video_ts, audio_ts;
+} source_t;
+
+static void put_ts(guint8 *p, guint8 prefix, guint64 ts)
+{
+	p[0] = prefix | (ts >> 29 & 0x0E) | 1;
+	p[1] = ts >> 22;
+	p[2] = ts >> 14 | 1;
+	p[3] = ts >> 7;
+	p[4] = ts << 1 | 1;
+}
+
+static void write_pes(source_t *src, int stream, guint64 ts, size_t size)
+{
+	static guint8 payload[LONG_PES_SIZE];
+	guint8 header[PES_MIN_HEADER + 10] = { 0, 0, 1 };
+	struct iovec iov[2];
+	size_t hlen = 0;
+
+	if (stream == TSMUX_VIDEO) {
+		/* PTS one frame after the DTS like with B frames */
+		header[3] = 0xE0;
+		header[7] = 0xC0;
+		header[8] = 10;
+		put_ts(header + 9, 0x31, ts + VIDEO_DURATION);
+		put_ts(header + 14, 0x11, ts);
+	}
+	else {
+		header[3] = 0xC0;
+		header[7] = 0x80;
+		header[8] = 5;
+		put_ts(header + 9, 0x21, ts);
+	}
+	header[6] = 0x80;
+	hlen = PES_HEADER_LEN(header);
+	if (hlen - 6 + size <= 0xFFFF) {
+		header[4] = (hlen - 6 + size) >> 8;
+		header[5] = (hlen - 6 + size) & 0xFF;
+	}
+
+	iov[0].iov_base = header;
+	iov[0].iov_len = hlen;
+	iov[1].iov_base = payload;
+	iov[1].iov_len = size;
+	CHECK(tsmux_write(src->mux, stream, iov, 2, src->control[0], &src->no_write) == 0);
+}
+
+/* both streams in timestamp order up to 'until', video only when enabled */
+static void write_av(source_t *src, guint64 until, gboolean video, size_t long_pes)
+{
+	for (;;) {
+		if (video && src->video_ts <= src->audio_ts) {
+			if (src->video_ts >= until)
+				break;
+			write_pes(src, TSMUX_VIDEO, src->video_ts, long_pes ? long_pes : 10000 + rand() % 30000);
+			long_pes = 0;
+			src->video_ts += VIDEO_DURATION;
+		}
+		else {
+			if (src->audio_ts >= until)
+				break;
+			write_pes(src, TSMUX_AUDIO, src->audio_ts, AUDIO_SIZE);
+			src->audio_ts += AUDIO_DURATION;
+		}
+	}
+	if (!video)
+		src->video_ts = src->audio_ts;
+}
+
+static int check_section(const guint8 *p, guint8 table_id)
+{
+	const guint8 *s = p + 5;
+	int len = (s[1] & 0x0F) << 8 | s[2];
+
+	CHECK(p[1] & 0x40);
+	CHECK(p[4] == 0);
+	CHECK(s[0] == table_id);
+	CHECK(len + 3 <= TS_PACKET_SIZE - 5);
+	/* the CRC over the whole section including the CRC gives 0 */
+	CHECK(tsmux_crc32(s, len + 3) == 0);
+	return len;
+}
+
+static void check_ts(const char *path, double ticks_per_packet)
+{
+	guint8 p[TS_PACKET_SIZE];
+	int cc[0x2000], pats = 0, pmts = 0, pcrs = 0, pes = 0, i;
+	guint64 pcr = 0, max_interval = 0, max_distance = 0, pcr_values[MAX_PCRS];
+	guint packet = 0, pcr_packets[MAX_PCRS];
+	gboolean pcr_valid = FALSE;
+	FILE *file = fopen(path, "rb");
+	size_t rd;
+
+	CHECK(file);
+	memset(cc, -1, sizeof(cc));
+	while ((rd = fread(p, 1, sizeof(p), file)) == sizeof(p)) {
+		int pid = (p[1] & 0x1F) << 8 | p[2], afc = p[3] >> 4 & 3, off = 4;
+
+		CHECK(p[0] == 0x47);
+		CHECK(afc);
+		if (afc & 1) {
+			if (cc[pid] >= 0)
+				CHECK((p[3] & 0x0F) == ((cc[pid] + 1) & 0x0F));
+			cc[pid] = p[3] & 0x0F;
+		}
+		if (afc & 2) {
+			off = 5 + p[4];
+			CHECK(off <= TS_PACKET_SIZE);
+			if (p[4] && p[5] & 0x10) {
+				guint64 next = (guint64)p[6] << 25 | p[7] << 17 | p[8] << 9 | p[9] << 1 | p[10] >> 7;
+				CHECK(pid == TSMUX_PID_PCR);
+				CHECK(!(p[5] & 0x80));	/* no discontinuity */
+				if (pcr_valid) {
+					CHECK(next > pcr);
+					max_interval = MAX(max_interval, next - pcr);
+					CHECK(next - pcr <= PCR_MAX_INTERVAL);
+				}
+				pcr = next;
+				pcr_valid = TRUE;
+				CHECK(pcrs < MAX_PCRS);
+				pcr_values[pcrs] = pcr;
+				pcr_packets[pcrs++] = packet;
+			}
+		}
+
+		if (pid == 0) {
+			CHECK(check_section(p, 0x00) == 13);
+			CHECK(((p[15] & 0x1F) << 8 | p[16]) == TSMUX_PID_PMT);
+			++pats;
+		}
+		else if (pid == TSMUX_PID_PMT) {
+			const guint8 *s = p + 5;
+			CHECK(check_section(p, 0x02) == 9 + 4 + 2 * 5);
+			CHECK(((s[8] & 0x1F) << 8 | s[9]) == TSMUX_PID_PCR);
+			CHECK(s[12] == 0x1B && ((s[13] & 0x1F) << 8 | s[14]) == TSMUX_PID_VIDEO);
+			CHECK(s[17] == 0x03 && ((s[18] & 0x1F) << 8 | s[19]) == TSMUX_PID_AUDIO);
+			++pmts;
+		}
+		else if (pid == TSMUX_PID_VIDEO || pid == TSMUX_PID_AUDIO) {
+			CHECK(pats && pmts);
+			if (p[1] & 0x40) {
+				const guint8 *h = p + off;
+				guint64 ts = tsmux_get_ts(h + ((h[7] & 0xC0) == 0xC0 ? 14 : 9));
+				CHECK(h[0] == 0 && h[1] == 0 && h[2] == 1);
+				/* the decoder gets each PES before its time, and
+				 * not much earlier */
+				CHECK(pcr_valid && ts > pcr);
+				CHECK(ts - pcr <= PCR_MAX_DELAY);
+				++pes;
+			}
+		}
+		else
+			CHECK(pid == TSMUX_PID_PCR);
+		++packet;
+	}
+	CHECK(rd == 0);
+	fclose(file);
+
+	CHECK(pcrs > 1);
+	for (i = 1; i < pcrs; ++i) {
+		guint64 distance = (pcr_packets[i] - pcr_packets[i - 1]) * ticks_per_packet;
+		max_distance = MAX(max_distance, distance);
+		CHECK(distance <= PCR_MAX_INTERVAL);
+	}
+
+	printf("%d PES, %d PCR (at most %" G_GUINT64_FORMAT "ms apart, %" G_GUINT64_FORMAT "ms of data), %d PAT, %d PMT\n",
+		pes, pcrs, max_interval / 90, max_distance / 90, pats, pmts);
+	CHECK(pats > 1 && pmts > 1);
+}
+
+typedef struct
+{
+	source_t *src;
+	volatile gint done;
+} waiter_t;
+
+static gpointer waiter_thread(gpointer data)
+{
+	waiter_t *waiter = data;
+
+	write_pes(waiter->src, TSMUX_AUDIO, waiter->src->audio_ts, AUDIO_SIZE);
+	g_atomic_int_set(&waiter->done, 1);
+	return NULL;
+}
+
+/* a write waiting for the mux returns on a flush, without polling */
+static void check_lock_wakeup(source_t *video, source_t *audio)
+{
+	waiter_t waiter = { audio, 0 };
+	GThread *thread;
+	char c = 's';
+
+	CHECK(tsmux_lock(video->mux, video->control[0], &video->no_write) == 0);
+	thread = g_thread_create(waiter_thread, &waiter, TRUE, NULL);
+	CHECK(thread);
+	g_usleep(50000);
+	CHECK(!g_atomic_int_get(&waiter.done));
+
+	write_state_set(&audio->no_write, WRITE_FLUSHING);
+	CHECK(write(audio->control[1], &c, 1) == 1);
+	g_thread_join(thread);
+	CHECK(g_atomic_int_get(&waiter.done));
+	write_state_clear(&audio->no_write, WRITE_FLUSHING);
+	tsmux_unlock(video->mux);
+}
+
+int main(int argc, char **argv)
+{
+	char path[] = "/tmp/tsmuxXXXXXX";
+	source_t src[TSMUX_STREAMS];
+	double ticks_per_packet;
+	int i, fd;
+
+	check_init(&argc, &argv);
+
+	fd = mkstemp(path);
+	CHECK(fd >= 0);
+	close(fd);
+
+	memset(src, 0, sizeof(src));
+	for (i = 0; i < TSMUX_STREAMS; ++i) {
+		CHECK(socketpair(PF_UNIX, SOCK_STREAM, 0, src[i].control) == 0);
+		fcntl(src[i].control[0], F_SETFL, O_NONBLOCK);
+		src[i].mux = tsmux_get(path, i);
+		CHECK(src[i].mux);
+	}
+	CHECK(src[TSMUX_VIDEO].mux == src[TSMUX_AUDIO].mux);
+	CHECK(!tsmux_get("/tmp/other.ts", TSMUX_VIDEO));
+	tsmux_set_stream(src[0].mux, TSMUX_VIDEO, 0x1B);
+	tsmux_set_stream(src[0].mux, TSMUX_AUDIO, 0x03);
+
+	check_lock_wakeup(&src[TSMUX_VIDEO], &src[TSMUX_AUDIO]);
+
+	/* one source with the timestamps of both streams */
+	srand(1);
+	src[0].video_ts = src[0].audio_ts = 3 * 90000;
+	write_av(&src[0], src[0].video_ts + 2 * 90000, TRUE, 0);
+	ticks_per_packet = 2.0 * 90000 / src[0].mux->packets;
+	write_av(&src[0], src[0].video_ts + 1 * 90000, TRUE, LONG_PES_SIZE);
+	write_av(&src[0], src[0].video_ts + 2 * 90000, FALSE, 0);
+	write_av(&src[0], src[0].video_ts + 1 * 90000, TRUE, 0);
+
+	tsmux_release(src[0].mux, TSMUX_VIDEO);
+	tsmux_release(src[0].mux, TSMUX_AUDIO);
+
+	check_ts(path, ticks_per_packet);
+	unlink(path);
+	for (i = 0; i < TSMUX_STREAMS; ++i) {
+		close(src[i].control[0]);
+		close(src[i].control[1]);
+	}
+	return 0;
+}
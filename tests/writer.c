@@ -0,0 +1,218 @@
+/*
+ * GStreamer DVB Media Sink
+ *
+ * writes a counter sequence to a pipe through every write path of common.c:
+ * the poll loop of the streaming thread (the fallback without io_uring),
+ * uring_poll_writev, the writer thread and the shared reactor. A reader
+ * thread checks the bytes, the rate of each path is printed.
+ */
+
+#include "common.c"
+#include "check.h"
+#include <signal.h>
+
+#define TOTAL_BYTES	(32 * 1024 * 1024)
+#define MAX_FRAME	(64 * 1024)
+
+enum { PATH_POLL, PATH_URING, PATH_WRITER, PATH_REACTOR };
+static const char *const path_names[] = { "poll", "io_uring", "writer thread", "reactor" };
+
+typedef struct
+{
+	int fd;
+	size_t bytes;
+	gboolean ok;
+} reader_t;
+
+static gpointer reader_thread(gpointer data)
+{
+	reader_t *reader = data;
+	guint8 buf[65536], expect = 0;
+	ssize_t n, i;
+
+	while ((n = read(reader->fd, buf, sizeof(buf))) != 0) {
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			reader->ok = FALSE;
+			break;
+		}
+		for (i = 0; i < n; ++i)
+			if (buf[i] != expect++)
+				reader->ok = FALSE;
+		reader->bytes += n;
+	}
+	return NULL;
+}
+
+/* the write loop of the sinks without a writer thread */
+static void write_frame(int path, uring_t *uring, int control_fd, int fd, struct iovec *iov, int iovcnt)
+{
+	struct pollfd pfd[2];
+	short revents[2];
+	int wr;
+
+	pfd[0].fd = control_fd;
+	pfd[0].events = POLLIN;
+	pfd[1].fd = fd;
+	pfd[1].events = POLLOUT;
+
+	iov_advance(&iov, &iovcnt, 0);
+	while (iovcnt) {
+		if (path == PATH_URING) {
+			switch (uring_poll_writev(uring, control_fd, fd, 0, iov, iovcnt, revents, &wr)) {
+			case 1:
+				if (wr < 0) {
+					CHECK(errno == EAGAIN || errno == EINTR);
+					continue;
+				}
+				iov_advance(&iov, &iovcnt, wr);
+				continue;
+			case 0:
+				CHECK(!(revents[1] & (POLLERR | POLLHUP)));
+				continue;
+			default:
+				CHECK(!"uring_poll_writev failed");
+			}
+		}
+		CHECK(poll(pfd, 2, -1) >= 0 || errno == EINTR);
+		if (!(pfd[1].revents & POLLOUT))
+			continue;
+		wr = writev(fd, iov, iovcnt);
+		if (wr < 0) {
+			CHECK(errno == EAGAIN || errno == EINTR);
+			continue;
+		}
+		iov_advance(&iov, &iovcnt, wr);
+	}
+}
+
+static void run(int path, uring_t *uring)
+{
+	static guint8 frame[MAX_FRAME];
+	int pipe_fd[2], control[2];
+	reader_t reader = { -1, 0, TRUE };
+	GThread *thread;
+	writer_t writer;
+	queue_t queue;
+	gint no_write = 0;
+	size_t sent = 0;
+	guint8 counter = 0;
+	double start;
+
+	CHECK(pipe(pipe_fd) == 0);
+	CHECK(socketpair(PF_UNIX, SOCK_STREAM, 0, control) == 0);
+	fcntl(pipe_fd[1], F_SETFL, O_NONBLOCK);
+	fcntl(control[0], F_SETFL, O_NONBLOCK);
+	fcntl(control[1], F_SETFL, O_NONBLOCK);
+
+	queue_init(&queue);
+	queue_alloc(&queue, 0);
+	writer_init(&writer);
+	if (path == PATH_WRITER || path == PATH_REACTOR) {
+		writer.fd = pipe_fd[1];
+		writer.control_read = control[0];
+		writer.control_write = control[1];
+		writer.no_write = &no_write;
+		writer.queue = &queue;
+		CHECK(writer_start(&writer, path == PATH_REACTOR));
+		CHECK(path == PATH_WRITER ? writer.thread != NULL : writer.reactor != NULL);
+	}
+
+	reader.fd = pipe_fd[0];
+	thread = g_thread_create(reader_thread, &reader, TRUE, NULL);
+	CHECK(thread);
+
+	start = check_time();
+	srand(1);
+	while (sent < TOTAL_BYTES) {
+		size_t len = MIN(1 + rand() % MAX_FRAME, TOTAL_BYTES - sent), i;
+		struct iovec iov[3];
+		int iovcnt = 0;
+
+		for (i = 0; i < len; ++i)
+			frame[i] = counter++;
+		/* header, empty and payload segments like a PES packet */
+		iov_add(iov, &iovcnt, frame, MIN(len, 14));
+		iov[iovcnt].iov_base = frame;
+		iov[iovcnt++].iov_len = 0;
+		iov_add(iov, &iovcnt, frame + MIN(len, 14), len - MIN(len, 14));
+
+		if (path == PATH_WRITER || path == PATH_REACTOR)
+			CHECK(writer_push(&writer, iov, iovcnt, NULL, 0) == 0);
+		else
+			write_frame(path, uring, control[0], pipe_fd[1], iov, iovcnt);
+		sent += len;
+	}
+	if (path == PATH_WRITER || path == PATH_REACTOR) {
+		CHECK(writer_drain(&writer));
+		writer_stop(&writer);
+	}
+	close(pipe_fd[1]);
+	g_thread_join(thread);
+
+	printf("%-14s %7.1f MB/s\n", path_names[path], sent / (check_time() - start) / 1e6);
+	CHECK(reader.ok);
+	CHECK(reader.bytes == sent);
+
+	queue_free(&queue);
+	close(pipe_fd[0]);
+	close(control[0]);
+	close(control[1]);
+}
+
+/* with the pipe full, a command on the control socket has to end the wait
+ * and nothing may be written */
+static void check_uring_wakeup(uring_t *uring)
+{
+	static guint8 data[4096];
+	struct iovec iov = { data, sizeof(data) };
+	int pipe_fd[2], control[2], wr = 0;
+	short revents[2];
+	char c = 's';
+
+	CHECK(pipe(pipe_fd) == 0);
+	CHECK(socketpair(PF_UNIX, SOCK_STREAM, 0, control) == 0);
+	fcntl(pipe_fd[1], F_SETFL, O_NONBLOCK);
+	fcntl(control[0], F_SETFL, O_NONBLOCK);
+	while (write(pipe_fd[1], data, sizeof(data)) > 0);
+	CHECK(errno == EAGAIN);
+
+	CHECK(write(control[1], &c, 1) == 1);
+	CHECK(uring_poll_writev(uring, control[0], pipe_fd[1], 0, &iov, 1, revents, &wr) == 0);
+	CHECK(revents[0] & POLLIN);
+	writer_read_commands(control[0]);
+
+	close(pipe_fd[0]);
+	close(pipe_fd[1]);
+	close(control[0]);
+	close(control[1]);
+}
+
+int main(int argc, char **argv)
+{
+	uring_t uring;
+
+	check_init(&argc, &argv);
+	signal(SIGPIPE, SIG_IGN);
+
+	uring_init(&uring);
+	CHECK(!uring_running(&uring));
+
+	run(PATH_POLL, &uring);
+	if (uring_setup(&uring)) {
+		check_uring_wakeup(&uring);
+		run(PATH_URING, &uring);
+		uring_free(&uring);
+		CHECK(!uring_running(&uring));
+	}
+	else {
+		/* the sinks go on with the poll loop measured above */
+		printf("io_uring not available (%s), poll fallback only\n", g_strerror(errno));
+		CHECK(!uring_running(&uring));
+	}
+	run(PATH_WRITER, &uring);
+	run(PATH_REACTOR, &uring);
+
+	return 0;
+}